@@ -24,17 +24,35 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stddef.h>
 #include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <time.h>
 #include <db.h>
 
 static int open_exsited_queue_db(DB_TXN *txn, char *queue_name, DB **queue_dbp);
-static int create_queue_db(DB_TXN *txn, char *queue_name, size_t queue_name_size, DB **queue_dbp, u_int32_t max_size);
+static int create_queue_db(DB_TXN *txn, char *queue_name, size_t queue_name_size, DB **queue_dbp, u_int32_t max_size, u_int32_t queue_flags);
 static int get_queue_db_handle(DB_TXN *txn, char *queue_name, size_t queue_name_size, queue_rec_t* queue_recp);
+static void put_queue_db_handle(char *queue_name, size_t queue_name_size, queue_rec_t *queue_recp);
 static int update_queue_length(DB_TXN *txn, char *queue_name, size_t queue_name_size, int delta);
 static void close_queue_db_list(void);
+static int queue_append(DB_TXN *txn, queue_rec_t *queue_recp, item *it);
+static int chunk_join(DB_TXN *txn, char *queue_name, size_t queue_name_size, item **itp, const bool consume);
+static void chunk_drop_queue(char *queue_name, size_t queue_name_size, uint64_t limit);
+static void queue_reaper_add(const char *dead_name, size_t dead_name_size, const char *queue_name,
+                             size_t queue_name_size, uint64_t chunk_limit);
+static item *item_deflate(item *it);
+static int item_inflate(item **itp);
+static void queue_meta_add(const char *queue_name, size_t queue_name_size, queue_rec_t *queue_recp);
+static int queue_meta_open(const char *queue_name, size_t queue_name_size, DB **queue_dbp);
+static void queue_meta_release(const char *queue_name, size_t queue_name_size);
+static bool queue_meta_take(const char *queue_name, size_t queue_name_size, DB **queue_dbp);
+static void queue_meta_drop(const char *queue_name, size_t queue_name_size);
+static void queue_meta_set_size(const char *queue_name, size_t queue_name_size, u_int32_t size);
+static void queue_meta_event(queue_rec_t *queue_recp, int counter, int bytes_counter, uint64_t bytes);
 
 static void *bdb_chkpoint_thread __P((void *));
 static void *bdb_memp_trickle_thread __P((void *));
@@ -47,6 +65,25 @@ static pthread_t chk_ptid;
 static pthread_t mtri_ptid;
 static pthread_t dld_ptid;
 
+static pthread_mutex_t chunk_id_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t next_chunk_id;
+
+/* serializes opening and closing queues, see queue_meta_open() */
+static pthread_mutex_t queue_open_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * A deleted queue waiting to be reclaimed, in queue.list under the name
+ * its file was renamed to: "deleted <chunk_limit>", which has a space, so
+ * no client can name a queue that.
+ */
+typedef struct {
+    queue_rec_t rec;            /* flags has QUEUE_DEAD */
+    uint64_t chunk_limit;       /* its chunks have lower ids */
+    char name[512];             /* what it was called, not NUL-terminated */
+} dead_queue_rec_t;
+
+#define DEAD_QUEUE_NAME_SIZE 32
+
 void bdb_settings_init(void)
 {
     bdb_settings.env_home = DBHOME;
@@ -56,11 +93,16 @@ void bdb_settings_init(void)
     /* queue only */
     bdb_settings.re_len = 1024;
     bdb_settings.q_extentsize = 131072;
+    bdb_settings.max_open_queues = 0;
 
     bdb_settings.page_size = 4096;  /* default is 4K */
     bdb_settings.txn_nosync = 0; /* default DB_TXN_NOSYNC is off */
     bdb_settings.dldetect_val = 100 * 1000; /* default is 100 millisecond */
     bdb_settings.chkpoint_val = 60 * 5;
+    bdb_settings.chkpoint_kbyte = 0;
+    bdb_settings.chkpoint_recovery = 0;
+    bdb_settings.log_retain = -1;
+    bdb_settings.log_archive_dir = NULL;
     bdb_settings.memp_trickle_val = 30;
     bdb_settings.memp_trickle_percent = 60;
     bdb_settings.db_flags = DB_CREATE | DB_AUTO_COMMIT;
@@ -151,8 +193,7 @@ void bdb_qlist_db_open(void){
     DB_TXN *txn = NULL;
     DBT dbkey, dbdata;
     char queue_name[512];
-    queue_rec_t queue_rec;
-    DB *queue_dbp = NULL;
+    dead_queue_rec_t dead;      /* a queue_rec_t unless QUEUE_DEAD */
 
     u_int32_t qlist_db_flags = DB_CREATE;
 
@@ -216,21 +257,27 @@ void bdb_qlist_db_open(void){
     dbkey.data = (void *)queue_name;
     dbkey.ulen = 512;
     dbkey.flags = DB_DBT_USERMEM;
-    dbdata.data = (void *)&queue_rec;
-    dbdata.ulen = sizeof(queue_rec);
+    dbdata.data = (void *)&dead;
+    dbdata.ulen = sizeof(dead);
     dbdata.flags = DB_DBT_USERMEM;
 
-    /* Iterate over the database, retrieving each record in turn. */
+    /*
+     * Iterate over the database, retrieving each record in turn. Queues
+     * are only registered here; each is opened on first use, see
+     * queue_meta_open(), so startup doesn't wait for thousands of opens.
+     * Deleted queues that were not reclaimed yet go back to the reaper.
+     */
+    memset(&dead, 0, sizeof(dead));
     while ((ret = cursorp->get(cursorp, &dbkey, &dbdata, DB_NEXT)) == 0) {
-        //memset(&queue_rec, 0, sizeof(queue_rec_t));
-        ret = open_exsited_queue_db(txn, queue_name, &queue_rec.queue_dbp);
-        if (ret != 0){
-            goto err;
-        }
-        ret = cursorp->put(cursorp, &dbkey, &dbdata, DB_CURRENT);
-        if (ret != 0){
-            goto err;
+        if (dead.rec.flags & QUEUE_DEAD) {
+            queue_reaper_add(queue_name, dbkey.size, dead.name,
+                             dbdata.size - offsetof(dead_queue_rec_t, name), dead.chunk_limit);
+        } else {
+            dead.rec.queue_dbp = NULL;  /* a handle of the last run */
+            queue_meta_add(queue_name, dbkey.size, &dead.rec);
         }
+        /* records of older versions are shorter, leave no flags behind */
+        memset(&dead, 0, sizeof(dead));
     }
     if (ret != DB_NOTFOUND) {
         goto err;
@@ -259,60 +306,54 @@ err:
 
 }
 
+/*
+ * Opens are done on first use, on a worker thread, so a file that isn't
+ * there, as on a replica still getting its copy from the master, is not
+ * waited for: that is DB_NOTFOUND, and any other error goes back as is.
+ */
 static int open_exsited_queue_db(DB_TXN *txn, char *queue_name, DB **queue_dbp){
-    int ret, db_open;
+    int ret;
     u_int32_t db_flags = DB_CREATE;
     DB *temp_dbp = NULL;
-    db_open = 0;
-
-    /* for replicas to get a full master copy, then open db */
-    while(!db_open) {
-        if (temp_dbp != NULL){
-            temp_dbp->close(temp_dbp, 0);
-            temp_dbp = NULL;
-        }
 
-        if ((ret = db_create(&temp_dbp, envp, 0)) != 0) {
-            fprintf(stderr, "db_create: %s\n", db_strerror(ret));
-            goto err;
-        }
+    /* the handle must be transactional to be used in transactions */
+    if (txn == NULL)
+        db_flags |= DB_AUTO_COMMIT;
 
-        /* set record length */
-        if (bdb_settings.q_extentsize != 0){
-            if((ret = temp_dbp->set_q_extentsize(temp_dbp, bdb_settings.q_extentsize)) != 0){
-                fprintf(stderr, "temp_dbp[%s]->set_q_extentsize: %s\n", queue_name, db_strerror(ret));
-                goto err;
-            }
-        }
+    if ((ret = db_create(&temp_dbp, envp, 0)) != 0) {
+        fprintf(stderr, "db_create: %s\n", db_strerror(ret));
+        goto err;
+    }
 
-        /* set record length */
-        if((ret = temp_dbp->set_re_len(temp_dbp, bdb_settings.re_len)) != 0){
-            fprintf(stderr, "temp_dbp[%s]->set_re_len: %s\n", queue_name, db_strerror(ret));
+    /* set record length */
+    if (bdb_settings.q_extentsize != 0){
+        if((ret = temp_dbp->set_q_extentsize(temp_dbp, bdb_settings.q_extentsize)) != 0){
+            fprintf(stderr, "temp_dbp[%s]->set_q_extentsize: %s\n", queue_name, db_strerror(ret));
             goto err;
         }
+    }
 
-        /* set page size */
-        if((ret = temp_dbp->set_pagesize(temp_dbp, bdb_settings.page_size)) != 0){
-            fprintf(stderr, "temp_dbp[%s]->set_pagesize: %s\n", queue_name, db_strerror(ret));
-            goto err;
-        }
+    /* set record length */
+    if((ret = temp_dbp->set_re_len(temp_dbp, bdb_settings.re_len)) != 0){
+        fprintf(stderr, "temp_dbp[%s]->set_re_len: %s\n", queue_name, db_strerror(ret));
+        goto err;
+    }
 
-        /* try to open db*/
-        ret = temp_dbp->open(temp_dbp, txn, queue_name, NULL, DB_QUEUE, db_flags, 0664);
-        switch (ret){
-        case 0:
-            db_open = 1;
-            *queue_dbp = temp_dbp;
-            break;
-        case ENOENT:
-        case DB_LOCK_DEADLOCK:
-            fprintf(stderr, "temp_dbp[%s]->open: %s\n", queue_name, db_strerror(ret));
-            sleep(2);
-            break;
-        default:
-            goto err;
-        }
+    /* set page size */
+    if((ret = temp_dbp->set_pagesize(temp_dbp, bdb_settings.page_size)) != 0){
+        fprintf(stderr, "temp_dbp[%s]->set_pagesize: %s\n", queue_name, db_strerror(ret));
+        goto err;
+    }
+
+    /* try to open db*/
+    ret = temp_dbp->open(temp_dbp, txn, queue_name, NULL, DB_QUEUE, db_flags, 0664);
+    if (ret != 0) {
+        fprintf(stderr, "temp_dbp[%s]->open: %s\n", queue_name, db_strerror(ret));
+        if (ret == ENOENT)
+            ret = DB_NOTFOUND;
+        goto err;
     }
+    *queue_dbp = temp_dbp;
     return 0;
 
 err:
@@ -322,7 +363,7 @@ err:
     return ret;
 }
 
-static int create_queue_db(DB_TXN *txn, char *queue_name, size_t queue_name_size, DB **queue_dbp, u_int32_t max_size) {
+static int create_queue_db(DB_TXN *txn, char *queue_name, size_t queue_name_size, DB **queue_dbp, u_int32_t max_size, u_int32_t queue_flags) {
     int ret;
     u_int32_t db_flags = DB_CREATE;
     queue_rec_t queue_rec;
@@ -356,6 +397,7 @@ static int create_queue_db(DB_TXN *txn, char *queue_name, size_t queue_name_size
     queue_rec.queue_dbp = temp_dbp;
     queue_rec.size = 0;
     queue_rec.max_size = max_size;
+    queue_rec.flags = queue_flags;
 
     BDB_CLEANUP_DBT();
     dbkey.data = (void *)queue_name;
@@ -378,52 +420,112 @@ err:
     return ret;
 }
 
+/*
+ * Deleting a queue only renames its file and marks it dead in queue.list,
+ * in one transaction, so the name is free again at once. Its file and
+ * chunks, which may take long to remove, are left to the reaper thread.
+ */
 int delete_queue_db(char *queue_name, size_t queue_name_size){
     DBT dbkey, dbdata;
     int ret;
     DB_TXN *txn = NULL;
     queue_rec_t queue_rec;
     DB *queue_dbp = NULL;
+    dead_queue_rec_t dead;
+    char dead_name[DEAD_QUEUE_NAME_SIZE];
+    uint64_t chunk_limit;
+    bool open_locked = false;
+
+    if (queue_name_size > sizeof(dead.name)) {
+        return 1;
+    }
 
     BDB_CLEANUP_DBT();
     dbkey.data = (void *)queue_name;
     dbkey.size = queue_name_size;
 
+    memset(&queue_rec, 0, sizeof(queue_rec_t));
     ret = envp->txn_begin(envp, NULL, &txn, 0);
     if (ret != 0) {
         goto err;
     }
 
-    memset(&queue_rec, 0, sizeof(queue_rec_t));
     ret = get_queue_db_handle(txn, queue_name, queue_name_size, &queue_rec);
-
     if (ret != 0 ){
         goto err;
     }
+    put_queue_db_handle(queue_name, queue_name_size, &queue_rec);
 
-    queue_dbp = queue_rec.queue_dbp;
-    ret = queue_dbp->close(queue_dbp, 0);
-    if (ret != 0 ){
+    /* queue.list first, before queue_open_lock, as in purge_queue_db() */
+    ret = qlist_dbp->del(qlist_dbp, txn, &dbkey, 0);
+    if (ret != 0){
         goto err;
     }
 
-    ret = envp->dbremove(envp, txn, queue_name, NULL, 0);
+    /*
+     * The record is write-locked now: a set that got to it first has
+     * committed its chunks already, one that comes later waits for us and
+     * finds the queue gone. Chunks from here on belong to a new queue of
+     * the same name, if anyone creates one.
+     */
+    pthread_mutex_lock(&chunk_id_lock);
+    chunk_limit = ++next_chunk_id;
+    pthread_mutex_unlock(&chunk_id_lock);
+    snprintf(dead_name, sizeof(dead_name), "deleted %llu", (unsigned long long)chunk_limit);
+
+    memset(&dead, 0, sizeof(dead));
+    dead.rec.flags = QUEUE_DEAD;
+    dead.chunk_limit = chunk_limit;
+    memcpy(dead.name, queue_name, queue_name_size);
+    BDB_CLEANUP_DBT();
+    dbkey.data = (void *)dead_name;
+    dbkey.size = strlen(dead_name);
+    dbdata.data = (void *)&dead;
+    dbdata.size = offsetof(dead_queue_rec_t, name) + queue_name_size;
+    ret = qlist_dbp->put(qlist_dbp, txn, &dbkey, &dbdata, 0);
     if (ret != 0){
         goto err;
     }
 
-    ret = qlist_dbp->del(qlist_dbp, txn, &dbkey, 0);
+    /* peeks don't read in a transaction: wait for those still at it */
+    for (;;) {
+        pthread_mutex_lock(&queue_open_lock);
+        open_locked = true;
+        if (queue_meta_take(queue_name, queue_name_size, &queue_dbp))
+            break;
+        pthread_mutex_unlock(&queue_open_lock);
+        open_locked = false;
+        usleep(1000);
+    }
+    /* if we abort from here on, the queue is opened again when next used */
+    if (queue_dbp != NULL) {
+        ret = queue_dbp->close(queue_dbp, 0);
+        if (ret != 0 ){
+            goto err;
+        }
+    }
+
+    ret = envp->dbrename(envp, txn, queue_name, NULL, dead_name, 0);
     if (ret != 0){
         goto err;
     }
+    pthread_mutex_unlock(&queue_open_lock);
+    open_locked = false;
 
     ret = txn->commit(txn, 0);
+    txn = NULL;
     if (ret != 0) {
         goto err;
     }
+
+    queue_meta_drop(queue_name, queue_name_size);
+    queue_reaper_add(dead_name, strlen(dead_name), queue_name, queue_name_size, chunk_limit);
     return 0;
 
 err:
+    if (open_locked) {
+        pthread_mutex_unlock(&queue_open_lock);
+    }
     if (txn != NULL){
         txn->abort(txn);
     }
@@ -433,215 +535,1877 @@ err:
     return 1;
 }
 
-static int get_queue_db_handle(DB_TXN *txn, char *queue_name, size_t queue_name_size, queue_rec_t *queue_recp){
-    DBT dbkey, dbdata;
-    int ret;
-    DB *temp_dbp = NULL;
-
-    memset(queue_recp, 0, sizeof(queue_rec_t));
-
-    BDB_CLEANUP_DBT();
-    dbkey.data = (void *)queue_name;
-    dbkey.size = queue_name_size;
-    dbdata.data = (void *)queue_recp;
-    dbdata.ulen = sizeof(queue_rec_t);
-    dbdata.flags = DB_DBT_USERMEM;
-
-    ret = qlist_dbp->get(qlist_dbp, txn, &dbkey, &dbdata, 0);
-
-    return ret;
-}
-
-static int update_queue_length(DB_TXN *txn, char *queue_name, size_t queue_name_size, int delta)
-{
+/*
+ * Empties a queue by swapping in a new file under its name: the old one
+ * is renamed away and reclaimed like a deleted queue's. The queue.list
+ * record is rewritten, never removed, so the queue doesn't go missing for
+ * a moment: a request that comes in meanwhile waits for the swap on its
+ * lock. Returns 1 if there is no such queue.
+ */
+int purge_queue_db(char *queue_name, size_t queue_name_size){
     DBT dbkey, dbdata;
     int ret;
+    DB_TXN *txn = NULL;
     queue_rec_t queue_rec;
+    DB *queue_dbp = NULL, *new_dbp = NULL;
+    dead_queue_rec_t dead;
+    char dead_name[DEAD_QUEUE_NAME_SIZE];
+    uint64_t chunk_limit;
+    bool open_locked = false;
 
-    BDB_CLEANUP_DBT();
-    dbkey.data = (void *)queue_name;
-    dbkey.size = queue_name_size;
-    dbdata.data = (void *)&queue_rec;
-    dbdata.ulen = sizeof(queue_rec_t);
-    dbdata.flags = DB_DBT_USERMEM;
-
-
-    ret = qlist_dbp->get(qlist_dbp, txn, &dbkey, &dbdata, 0);
-    if (ret == 0){
-        queue_rec.size += delta;
-        ret = qlist_dbp->put(qlist_dbp, txn, &dbkey, &dbdata, 0);
+    if (queue_name_size > sizeof(dead.name)) {
+        return 1;
     }
 
-    return ret;
-}
-
+    memset(&queue_rec, 0, sizeof(queue_rec_t));
+    ret = envp->txn_begin(envp, NULL, &txn, 0);
+    if (ret != 0) {
+        goto err;
+    }
 
-int print_queue_db_list(char *buf, size_t buf_size){
-    DBT dbkey, dbdata;
-    int ret, res;
-    DB_TXN *txn = NULL;
-    DBC *cursorp = NULL;
-    char queue_name[512];
-    queue_rec_t queue_rec;
-    DB *queue_db = NULL;
-    int remains = buf_size - 5;
+    ret = get_queue_db_handle(txn, queue_name, queue_name_size, &queue_rec);
+    if (ret != 0) {
+        goto err;
+    }
+    put_queue_db_handle(queue_name, queue_name_size, &queue_rec);
 
-    memset(queue_name, 0, 512);
+    /*
+     * Every transaction reads the queue's record before it uses the
+     * handle, so once ours is written nobody else's is using it. Both
+     * records are written before queue_open_lock is taken: a request
+     * waiting on that lock may hold locks in queue.list.
+     */
+    queue_rec.size = 0;
     BDB_CLEANUP_DBT();
     dbkey.data = (void *)queue_name;
-    dbkey.ulen = 512;
-    dbkey.flags = DB_DBT_USERMEM;
+    dbkey.size = queue_name_size;
     dbdata.data = (void *)&queue_rec;
-    dbdata.ulen = sizeof(queue_rec_t);
-    dbdata.flags = DB_DBT_USERMEM;
-
-    ret = envp->txn_begin(envp, NULL, &txn, 0);
-    if (ret != 0) {
+    dbdata.size = sizeof(queue_rec_t);
+    ret = qlist_dbp->put(qlist_dbp, txn, &dbkey, &dbdata, 0);
+    if (ret != 0){
         goto err;
     }
 
-    /* Get a cursor */
-    ret = qlist_dbp->cursor(qlist_dbp, txn, &cursorp, 0);
+    /* with the record write-locked, chunks from here on are the new file's */
+    pthread_mutex_lock(&chunk_id_lock);
+    chunk_limit = ++next_chunk_id;
+    pthread_mutex_unlock(&chunk_id_lock);
+    snprintf(dead_name, sizeof(dead_name), "deleted %llu", (unsigned long long)chunk_limit);
+
+    memset(&dead, 0, sizeof(dead));
+    dead.rec.flags = QUEUE_DEAD;
+    dead.chunk_limit = chunk_limit;
+    memcpy(dead.name, queue_name, queue_name_size);
+    BDB_CLEANUP_DBT();
+    dbkey.data = (void *)dead_name;
+    dbkey.size = strlen(dead_name);
+    dbdata.data = (void *)&dead;
+    dbdata.size = offsetof(dead_queue_rec_t, name) + queue_name_size;
+    ret = qlist_dbp->put(qlist_dbp, txn, &dbkey, &dbdata, 0);
     if (ret != 0){
         goto err;
     }
 
-    /* Iterate over the database, retrieving each record in turn. */
-    while ((ret = cursorp->get(cursorp, &dbkey, &dbdata, DB_NEXT)) == 0) {
-        queue_db = queue_rec.queue_dbp;
-        queue_name[dbkey.size] = '\0';
-        if (remains > strlen(queue_name) + 30){
-            res = sprintf(buf, "STAT %s %d %d\r\n", queue_name, queue_rec.size, queue_rec.max_size);
-            remains -= res;
-            buf += res;
-        } else {
+    /* peeks don't read in a transaction: wait for those still at it */
+    for (;;) {
+        pthread_mutex_lock(&queue_open_lock);
+        open_locked = true;
+        if (queue_meta_take(queue_name, queue_name_size, &queue_dbp))
             break;
+        pthread_mutex_unlock(&queue_open_lock);
+        open_locked = false;
+        usleep(1000);
+    }
+    if (queue_dbp != NULL) {
+        ret = queue_dbp->close(queue_dbp, 0);
+        if (ret != 0){
+            goto err;
         }
     }
-    if (!(ret == DB_NOTFOUND || ret == 0)) {
+
+    ret = envp->dbrename(envp, txn, queue_name, NULL, dead_name, 0);
+    if (ret != 0){
         goto err;
     }
 
-    if (cursorp != NULL){
-        cursorp->close(cursorp);
+    ret = create_queue_db(txn, queue_name, queue_name_size, &new_dbp, queue_rec.max_size, queue_rec.flags);
+    if (ret != 0){
+        goto err;
     }
+    pthread_mutex_unlock(&queue_open_lock);
+    open_locked = false;
 
+    /* nobody can change it before we commit: we hold the record */
+    queue_meta_set_size(queue_name, queue_name_size, 0);
     ret = txn->commit(txn, 0);
+    txn = NULL;
     if (ret != 0) {
         goto err;
     }
-    sprintf(buf, "END");
+
+    /* the handle belongs to our transaction: the next user opens its own */
+    new_dbp->close(new_dbp, 0);
+    queue_reaper_add(dead_name, strlen(dead_name), queue_name, queue_name_size, chunk_limit);
     return 0;
 
 err:
-    if (cursorp != NULL){
-        cursorp->close(cursorp);
+    if (open_locked) {
+        pthread_mutex_unlock(&queue_open_lock);
     }
     if (txn != NULL){
         txn->abort(txn);
     }
+    if (new_dbp != NULL){
+        new_dbp->close(new_dbp, 0);
+    }
     if (settings.verbose > 1) {
-        fprintf(stderr, "print_queue_db_list: %s\n", db_strerror(ret));
+        fprintf(stderr, "purge_queue_db: %s\n", db_strerror(ret));
     }
-    return -1;
+    return ret == DB_NOTFOUND ? 1 : -1;
 }
 
-static void close_queue_db_list(void){
-    DBT dbkey, dbdata;
-    int ret;
+/*
+ * The reaper thread reclaims deleted queues one at a time, oldest first:
+ * their chunks in batches, then their file, then their queue.list record.
+ * It pauses REAP_PAUSE_USEC between steps, so it doesn't take the disk
+ * from requests.
+ */
+
+#define REAP_PAUSE_USEC 10000
+
+typedef struct _dead_queue dead_queue_t;
+struct _dead_queue {
+    dead_queue_t *next;
+    uint64_t chunk_limit;
+    char dead_name[DEAD_QUEUE_NAME_SIZE];
+    size_t nkey;
+    char key[];
+};
+
+static pthread_t reap_ptid;
+static pthread_mutex_t reap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reap_cond = PTHREAD_COND_INITIALIZER;
+static dead_queue_t *reap_head;
+static dead_queue_t *reap_tail;
+static struct {
+    unsigned int pending;
+    uint64_t reclaimed;
+} reap_stats;                   /* under reap_lock */
+
+static void queue_reaper_add(const char *dead_name, size_t dead_name_size, const char *queue_name,
+                             size_t queue_name_size, uint64_t chunk_limit) {
+    dead_queue_t *dq;
+
+    if (dead_name_size >= DEAD_QUEUE_NAME_SIZE)
+        return;
+    dq = (dead_queue_t *)calloc(1, sizeof(dead_queue_t) + queue_name_size + 1);
+    if (dq == NULL) {
+        fprintf(stderr, "queue_reaper_add: out of memory, %.*s is left till restart\n",
+                (int)dead_name_size, dead_name);
+        return;
+    }
+    dq->chunk_limit = chunk_limit;
+    memcpy(dq->dead_name, dead_name, dead_name_size);
+    dq->nkey = queue_name_size;
+    memcpy(dq->key, queue_name, queue_name_size);
+
+    pthread_mutex_lock(&reap_lock);
+    if (reap_tail != NULL)
+        reap_tail->next = dq;
+    else
+        reap_head = dq;
+    reap_tail = dq;
+    reap_stats.pending++;
+    pthread_cond_signal(&reap_cond);
+    pthread_mutex_unlock(&reap_lock);
+}
+
+/* removes a dead queue's file and record, once its chunks are gone */
+static int queue_reap(dead_queue_t *dq) {
+    DBT dbkey;
     DB_TXN *txn = NULL;
-    DBC *cursorp = NULL;
-    char queue_name[512];
-    queue_rec_t queue_rec;
-    DB *queue_dbp = NULL;
+    int ret;
 
-    memset(queue_name, 0, 512);
-    BDB_CLEANUP_DBT();
-    dbkey.data = (void *)queue_name;
-    dbkey.ulen = 512;
-    dbkey.flags = DB_DBT_USERMEM;
-    dbdata.data = (void *)&queue_rec;
-    dbdata.ulen = sizeof(queue_rec_t);
-    dbdata.flags = DB_DBT_USERMEM;
+    chunk_drop_queue(dq->key, dq->nkey, dq->chunk_limit);
+    usleep(REAP_PAUSE_USEC);
 
     ret = envp->txn_begin(envp, NULL, &txn, 0);
     if (ret != 0) {
         goto err;
     }
-
-    /* Get a cursor */
-    ret = qlist_dbp->cursor(qlist_dbp, txn, &cursorp, 0);
-    if (ret != 0){
+    ret = envp->dbremove(envp, txn, dq->dead_name, NULL, 0);
+    if (ret != 0 && ret != ENOENT) {
         goto err;
     }
-
-    /* Iterate over the database, retrieving each record in turn. */
-    while ((ret = cursorp->get(cursorp, &dbkey, &dbdata, DB_NEXT)) == 0) {
-        queue_dbp = queue_rec.queue_dbp;
-        ret = queue_dbp->close(queue_dbp, 0);
-        if (settings.verbose > 1) {
-            fprintf(stderr, "close_queue_db_list: %s %s\n", queue_name, db_strerror(ret));
-        }
-    }
-    if (ret != DB_NOTFOUND) {
+    memset(&dbkey, 0, sizeof(dbkey));
+    dbkey.data = (void *)dq->dead_name;
+    dbkey.size = strlen(dq->dead_name);
+    ret = qlist_dbp->del(qlist_dbp, txn, &dbkey, 0);
+    if (ret != 0 && ret != DB_NOTFOUND) {
         goto err;
     }
-
-    if (cursorp != NULL){
-        cursorp->close(cursorp);
-    }
-
     ret = txn->commit(txn, 0);
     if (ret != 0) {
         goto err;
     }
-    return;
-
-err:
-    if (cursorp != NULL){
-        cursorp->close(cursorp);
+    if (settings.verbose > 1) {
+        fprintf(stderr, "queue_reap: %s (%.*s) reclaimed\n", dq->dead_name, (int)dq->nkey, dq->key);
     }
+    return 0;
+err:
     if (txn != NULL){
         txn->abort(txn);
     }
-    if (settings.verbose > 1) {
-        fprintf(stderr, "close_queue_db_list: %s\n", db_strerror(ret));
+    fprintf(stderr, "queue_reap: %s: %s\n", dq->dead_name, db_strerror(ret));
+    return ret;
+}
+
+static void *bdb_reap_thread(void *arg)
+{
+    dead_queue_t *dq;
+    int ret;
+
+    for (;;) {
+        pthread_mutex_lock(&reap_lock);
+        while (reap_head == NULL)
+            pthread_cond_wait(&reap_cond, &reap_lock);
+        dq = reap_head;
+        pthread_mutex_unlock(&reap_lock);
+
+        ret = queue_reap(dq);
+
+        pthread_mutex_lock(&reap_lock);
+        reap_head = dq->next;
+        if (reap_head == NULL)
+            reap_tail = NULL;
+        reap_stats.pending--;
+        if (ret == 0)
+            reap_stats.reclaimed++;
+        pthread_mutex_unlock(&reap_lock);
+        free(dq);   /* failed ones are tried again after a restart */
+        usleep(REAP_PAUSE_USEC);
     }
-    return;
+    return (NULL);
 }
 
-/* if return item is not NULL, free by caller */
-item *bdb_get(char *key, size_t nkey){
-    item *it = NULL;
+void start_reap_thread(void){
+    if ((errno = pthread_create(&reap_ptid, NULL, bdb_reap_thread, NULL)) != 0) {
+        fprintf(stderr, "failed spawning reap thread: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static int get_queue_db_handle(DB_TXN *txn, char *queue_name, size_t queue_name_size, queue_rec_t *queue_recp){
     DBT dbkey, dbdata;
-    DB_TXN *txn = NULL;
-    queue_rec_t queue_rec;
-    DB *queue_dbp = NULL;
-    db_recno_t recno;
     int ret;
+    DB *temp_dbp = NULL;
 
-    /* first, alloc a fixed size */
-    it = item_alloc2();
-    if (it == 0) {
-        return NULL;
-    }
+    memset(queue_recp, 0, sizeof(queue_rec_t));
 
     BDB_CLEANUP_DBT();
-    dbkey.data = &recno;
-    dbkey.ulen = sizeof(recno);
-    dbkey.flags = DB_DBT_USERMEM;
-    dbdata.ulen = bdb_settings.re_len;
-    dbdata.data = it;
+    dbkey.data = (void *)queue_name;
+    dbkey.size = queue_name_size;
+    dbdata.data = (void *)queue_recp;
+    dbdata.ulen = sizeof(queue_rec_t);
     dbdata.flags = DB_DBT_USERMEM;
 
-    ret = envp->txn_begin(envp, NULL, &txn, 0);
-    if (ret != 0) {
+    ret = qlist_dbp->get(qlist_dbp, txn, &dbkey, &dbdata, 0);
+    /* the handle in the record may be from an earlier run */
+    queue_recp->queue_dbp = NULL;
+    if (ret != 0)
+        return ret;
+
+    return queue_meta_open(queue_name, queue_name_size, &queue_recp->queue_dbp);
+}
+
+/*
+ * Lets the handle get_queue_db_handle() gave be closed again, once the
+ * caller's transaction is over. Does nothing if it gave none.
+ */
+static void put_queue_db_handle(char *queue_name, size_t queue_name_size, queue_rec_t *queue_recp){
+    if (queue_recp->queue_dbp != NULL) {
+        queue_meta_release(queue_name, queue_name_size);
+        queue_recp->queue_dbp = NULL;
+    }
+}
+
+static int update_queue_length(DB_TXN *txn, char *queue_name, size_t queue_name_size, int delta)
+{
+    DBT dbkey, dbdata;
+    int ret;
+    queue_rec_t queue_rec;
+
+    BDB_CLEANUP_DBT();
+    dbkey.data = (void *)queue_name;
+    dbkey.size = queue_name_size;
+    dbdata.data = (void *)&queue_rec;
+    dbdata.ulen = sizeof(queue_rec_t);
+    dbdata.flags = DB_DBT_USERMEM;
+
+
+    ret = qlist_dbp->get(qlist_dbp, txn, &dbkey, &dbdata, 0);
+    if (ret == 0){
+        queue_rec.size += delta;
+        ret = qlist_dbp->put(qlist_dbp, txn, &dbkey, &dbdata, 0);
+    }
+    /* under UPDATE_QUEUE_LENGTH_LOCK, so the last write wins even if its
+       transaction is then aborted: the next update puts it right again */
+    if (ret == 0){
+        queue_meta_set_size(queue_name, queue_name_size, queue_rec.size);
+    }
+
+    return ret;
+}
+
+
+/*
+ * Queue metadata. Every queue in queue.list has an entry here too, so
+ * "stats queue" and the per-queue statistics are served from memory,
+ * without a cursor over queue.list. Creating and deleting a queue take
+ * queue_meta_lock for writing; everything else only reads the table and
+ * updates counters in place, with atomic adds where several threads may
+ * update the same one.
+ */
+
+#define QUEUE_META_HASH_POWER 14
+#define QUEUE_META_HASH_SIZE (1 << QUEUE_META_HASH_POWER)
+
+/* traffic counters, see queue_meta_event() */
+enum {
+    QUEUE_ENQUEUES,
+    QUEUE_DEQUEUES,
+    QUEUE_BYTES_IN,
+    QUEUE_BYTES_OUT,
+    QUEUE_EMPTY_GETS,
+    QUEUE_FULL_REJECTS,
+    QUEUE_COUNTERS
+};
+
+/* a cache line each, so threads don't write over each other's: allocated aligned */
+#define QUEUE_COUNTERS_ALIGN 64
+typedef struct {
+    uint64_t count[QUEUE_COUNTERS];
+    uint64_t pad[8 - QUEUE_COUNTERS];
+} queue_counters_t;
+
+typedef struct _queue_meta queue_meta_t;
+struct _queue_meta {
+    queue_meta_t *next;         /* hash chain */
+    u_int32_t size;             /* as last written by update_queue_length() */
+    u_int32_t max_size;
+    u_int32_t flags;
+    DB *dbp;                    /* NULL until used, or once closed as cold, see queue_meta_open();
+                                   its app_private points back here */
+    queue_meta_t *lru_prev;     /* the open queues, most recently used first */
+    queue_meta_t *lru_next;
+    unsigned int refs;          /* callers between get_ and put_queue_db_handle() */
+    queue_counters_t *counters; /* one per worker thread, see thread_index() */
+    /* compression, see item_deflate() */
+    uint64_t raw_bytes;         /* message bytes given to lz_compress() */
+    uint64_t stored_bytes;      /* what was stored for them */
+    uint64_t compress_usec;
+    uint64_t decompress_usec;
+    size_t nkey;
+    char key[];
+};
+
+static queue_meta_t *queue_meta[QUEUE_META_HASH_SIZE];
+static pthread_rwlock_t queue_meta_lock = PTHREAD_RWLOCK_INITIALIZER;
+static unsigned int queue_meta_count;
+
+/*
+ * The open handles are kept in LRU order. Once there are more than
+ * bdb_settings.max_open_queues of them, the least recently used ones that
+ * nobody is using are closed, and opened again when next needed. dbp,
+ * refs and the list are only changed under queue_lru_lock, taken after
+ * queue_meta_lock; closes happen under queue_open_lock too, so a queue is
+ * never opened while its old handle is still being closed.
+ */
+static pthread_mutex_t queue_lru_lock = PTHREAD_MUTEX_INITIALIZER;
+static queue_meta_t *queue_lru_head;
+static queue_meta_t *queue_lru_tail;
+static struct {
+    unsigned int open;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} queue_lru_stats;
+
+static queue_meta_t **queue_meta_bucket(const char *queue_name, size_t queue_name_size) {
+    uint32_t h = 0;
+    size_t i;
+
+    for (i = 0; i < queue_name_size; i++)
+        h = h * 31 + (unsigned char)queue_name[i];
+    return &queue_meta[h & (QUEUE_META_HASH_SIZE - 1)];
+}
+
+/* queue_meta_lock must be held */
+static queue_meta_t *queue_meta_find(const char *queue_name, size_t queue_name_size) {
+    queue_meta_t *qm;
+
+    for (qm = *queue_meta_bucket(queue_name, queue_name_size); qm != NULL; qm = qm->next) {
+        if (qm->nkey == queue_name_size && memcmp(qm->key, queue_name, queue_name_size) == 0)
+            return qm;
+    }
+    return NULL;
+}
+
+/* queue_lru_lock must be held */
+static void queue_lru_link(queue_meta_t *qm) {
+    qm->lru_prev = NULL;
+    qm->lru_next = queue_lru_head;
+    if (queue_lru_head != NULL)
+        queue_lru_head->lru_prev = qm;
+    else
+        queue_lru_tail = qm;
+    queue_lru_head = qm;
+    queue_lru_stats.open++;
+}
+
+/* queue_lru_lock must be held */
+static void queue_lru_unlink(queue_meta_t *qm) {
+    if (qm->lru_prev != NULL)
+        qm->lru_prev->lru_next = qm->lru_next;
+    else
+        queue_lru_head = qm->lru_next;
+    if (qm->lru_next != NULL)
+        qm->lru_next->lru_prev = qm->lru_prev;
+    else
+        queue_lru_tail = qm->lru_prev;
+    qm->lru_prev = qm->lru_next = NULL;
+    queue_lru_stats.open--;
+}
+
+/*
+ * Takes a reference on the queue's handle and makes it the most recently
+ * used, or returns NULL if it isn't open. queue_meta_lock must be held.
+ */
+static DB *queue_meta_ref(queue_meta_t *qm) {
+    DB *dbp;
+
+    pthread_mutex_lock(&queue_lru_lock);
+    dbp = qm->dbp;
+    if (dbp != NULL) {
+        qm->refs++;
+        if (qm != queue_lru_head) {
+            queue_lru_unlink(qm);
+            queue_lru_link(qm);
+        }
+        queue_lru_stats.hits++;
+    }
+    pthread_mutex_unlock(&queue_lru_lock);
+    return dbp;
+}
+
+/*
+ * Closes the least recently used handles nobody holds until no more than
+ * max_open_queues are open, or only busy ones are left. queue_open_lock
+ * must be held.
+ */
+static void queue_lru_trim(void) {
+    queue_meta_t *qm;
+    DB *dbp;
+    int ret;
+
+    while (bdb_settings.max_open_queues > 0) {
+        dbp = NULL;
+        pthread_rwlock_rdlock(&queue_meta_lock);
+        pthread_mutex_lock(&queue_lru_lock);
+        if (queue_lru_stats.open > bdb_settings.max_open_queues) {
+            for (qm = queue_lru_tail; qm != NULL && qm->refs > 0; qm = qm->lru_prev)
+                ;
+            if (qm != NULL) {
+                queue_lru_unlink(qm);
+                dbp = qm->dbp;
+                qm->dbp = NULL;
+                queue_lru_stats.evictions++;
+            }
+        }
+        pthread_mutex_unlock(&queue_lru_lock);
+        pthread_rwlock_unlock(&queue_meta_lock);
+        if (dbp == NULL)
+            break;
+
+        ret = dbp->close(dbp, 0);
+        if (ret != 0 || settings.verbose > 1) {
+            fprintf(stderr, "queue_lru_trim: %s\n", db_strerror(ret));
+        }
+    }
+}
+
+static void queue_meta_add(const char *queue_name, size_t queue_name_size, queue_rec_t *queue_recp) {
+    queue_meta_t **bucket, *qm;
+    bool opened = false;
+
+    pthread_rwlock_wrlock(&queue_meta_lock);
+    qm = queue_meta_find(queue_name, queue_name_size);
+    if (qm == NULL) {
+        qm = (queue_meta_t *)calloc(1, sizeof(queue_meta_t) + queue_name_size);
+        if (qm != NULL) {
+            if (posix_memalign((void **)&qm->counters, QUEUE_COUNTERS_ALIGN,
+                               settings.num_threads * sizeof(queue_counters_t)) != 0) {
+                free(qm);
+                qm = NULL;
+            } else {
+                memset(qm->counters, 0, settings.num_threads * sizeof(queue_counters_t));
+            }
+        }
+        if (qm == NULL) {
+            pthread_rwlock_unlock(&queue_meta_lock);
+            fprintf(stderr, "queue_meta_add: out of memory\n");
+            return;
+        }
+        qm->nkey = queue_name_size;
+        memcpy(qm->key, queue_name, queue_name_size);
+        bucket = queue_meta_bucket(queue_name, queue_name_size);
+        qm->next = *bucket;
+        *bucket = qm;
+        queue_meta_count++;
+    }
+    qm->size = queue_recp->size;
+    qm->max_size = queue_recp->max_size;
+    qm->flags = queue_recp->flags;
+    pthread_mutex_lock(&queue_lru_lock);
+    if (qm->dbp == NULL && queue_recp->queue_dbp != NULL) {
+        qm->dbp = queue_recp->queue_dbp;
+        qm->dbp->app_private = qm;
+        queue_lru_link(qm);
+        opened = true;
+    }
+    pthread_mutex_unlock(&queue_lru_lock);
+    pthread_rwlock_unlock(&queue_meta_lock);
+
+    if (opened) {
+        pthread_mutex_lock(&queue_open_lock);
+        queue_lru_trim();
+        pthread_mutex_unlock(&queue_open_lock);
+    }
+}
+
+/*
+ * Gets the queue's DB handle, with a reference the caller gives back with
+ * queue_meta_release(), opening it if it isn't open: on its first use
+ * since startup, or after it was closed to stay within max_open_queues.
+ * Opens happen one at a time under queue_open_lock, in their own
+ * transaction, so the caller's transaction doesn't own the handle. Returns
+ * DB_NOTFOUND for a queue that isn't registered.
+ */
+static int queue_meta_open(const char *queue_name, size_t queue_name_size, DB **queue_dbp) {
+    char name[512];
+    queue_meta_t *qm;
+    DB *dbp = NULL;
+    int ret = 0;
+
+    pthread_rwlock_rdlock(&queue_meta_lock);
+    qm = queue_meta_find(queue_name, queue_name_size);
+    if (qm != NULL)
+        dbp = queue_meta_ref(qm);
+    pthread_rwlock_unlock(&queue_meta_lock);
+    if (qm == NULL)
+        return DB_NOTFOUND;
+    if (dbp != NULL) {
+        *queue_dbp = dbp;
+        return 0;
+    }
+    if (queue_name_size >= sizeof(name))
+        return EINVAL;
+
+    pthread_mutex_lock(&queue_open_lock);
+    pthread_rwlock_rdlock(&queue_meta_lock);
+    qm = queue_meta_find(queue_name, queue_name_size);
+    if (qm != NULL)
+        dbp = queue_meta_ref(qm);
+    pthread_rwlock_unlock(&queue_meta_lock);
+
+    if (qm == NULL) {
+        ret = DB_NOTFOUND;      /* deleted while we waited */
+    } else if (dbp == NULL) {
+        memcpy(name, queue_name, queue_name_size);
+        name[queue_name_size] = '\0';
+        ret = open_exsited_queue_db(NULL, name, &dbp);
+        if (ret == 0) {
+            pthread_rwlock_rdlock(&queue_meta_lock);
+            qm = queue_meta_find(queue_name, queue_name_size);
+            if (qm != NULL) {
+                pthread_mutex_lock(&queue_lru_lock);
+                qm->dbp = dbp;
+                dbp->app_private = qm;
+                qm->refs++;
+                queue_lru_link(qm);
+                queue_lru_stats.misses++;
+                pthread_mutex_unlock(&queue_lru_lock);
+            }
+            pthread_rwlock_unlock(&queue_meta_lock);
+            if (qm == NULL) {
+                dbp->close(dbp, 0);
+                ret = DB_NOTFOUND;
+            } else if (settings.verbose > 1) {
+                fprintf(stderr, "queue_meta_open: opened %s\n", name);
+            }
+        } else if (settings.verbose > 1) {
+            fprintf(stderr, "queue_meta_open: %s %s\n", name, db_strerror(ret));
+        }
+        if (ret == 0)
+            queue_lru_trim();
+    }
+    pthread_mutex_unlock(&queue_open_lock);
+
+    if (ret == 0)
+        *queue_dbp = dbp;
+    return ret;
+}
+
+/* gives back the reference queue_meta_open() took */
+static void queue_meta_release(const char *queue_name, size_t queue_name_size) {
+    queue_meta_t *qm;
+
+    pthread_rwlock_rdlock(&queue_meta_lock);
+    qm = queue_meta_find(queue_name, queue_name_size);
+    if (qm != NULL) {
+        pthread_mutex_lock(&queue_lru_lock);
+        if (qm->refs > 0)
+            qm->refs--;
+        pthread_mutex_unlock(&queue_lru_lock);
+    }
+    pthread_rwlock_unlock(&queue_meta_lock);
+}
+
+/*
+ * Takes the queue's handle, if open, out of the table for the caller to
+ * close, unless somebody holds it: then it returns false and leaves it.
+ * queue_open_lock must be held, so the queue isn't opened again meanwhile.
+ */
+static bool queue_meta_take(const char *queue_name, size_t queue_name_size, DB **queue_dbp) {
+    queue_meta_t *qm;
+    bool taken = true;
+
+    *queue_dbp = NULL;
+    pthread_rwlock_rdlock(&queue_meta_lock);
+    qm = queue_meta_find(queue_name, queue_name_size);
+    if (qm != NULL) {
+        pthread_mutex_lock(&queue_lru_lock);
+        if (qm->refs > 0) {
+            taken = false;
+        } else if (qm->dbp != NULL) {
+            queue_lru_unlink(qm);
+            *queue_dbp = qm->dbp;
+            qm->dbp = NULL;
+        }
+        pthread_mutex_unlock(&queue_lru_lock);
+    }
+    pthread_rwlock_unlock(&queue_meta_lock);
+    return taken;
+}
+
+static void queue_meta_drop(const char *queue_name, size_t queue_name_size) {
+    queue_meta_t **pp, *qm;
+    DB *dbp = NULL;
+
+    pthread_rwlock_wrlock(&queue_meta_lock);
+    for (pp = queue_meta_bucket(queue_name, queue_name_size); (qm = *pp) != NULL; pp = &qm->next) {
+        if (qm->nkey == queue_name_size && memcmp(qm->key, queue_name, queue_name_size) == 0) {
+            *pp = qm->next;
+            pthread_mutex_lock(&queue_lru_lock);
+            if (qm->dbp != NULL) {
+                queue_lru_unlink(qm);
+                dbp = qm->dbp;
+            }
+            pthread_mutex_unlock(&queue_lru_lock);
+            free(qm->counters);
+            free(qm);
+            queue_meta_count--;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&queue_meta_lock);
+
+    if (dbp != NULL)
+        dbp->close(dbp, 0);
+}
+
+static void queue_meta_set_size(const char *queue_name, size_t queue_name_size, u_int32_t size) {
+    queue_meta_t *qm;
+
+    pthread_rwlock_rdlock(&queue_meta_lock);
+    qm = queue_meta_find(queue_name, queue_name_size);
+    if (qm != NULL)
+        qm->size = size;
+    pthread_rwlock_unlock(&queue_meta_lock);
+}
+
+/*
+ * Counts one event for the calling worker thread, and bytes in
+ * bytes_counter if that is not -1. Each thread has its own slot, so no
+ * atomics are needed. Nor is a lookup: the caller holds the handle
+ * get_queue_db_handle() gave, which keeps the entry alive and points to it.
+ */
+static void queue_meta_event(queue_rec_t *queue_recp, int counter, int bytes_counter, uint64_t bytes) {
+    queue_meta_t *qm;
+    int thread = thread_index();
+
+    if (thread < 0 || thread >= settings.num_threads || queue_recp->queue_dbp == NULL)
+        return;
+    qm = (queue_meta_t *)queue_recp->queue_dbp->app_private;
+    qm->counters[thread].count[counter]++;
+    if (bytes_counter >= 0)
+        qm->counters[thread].count[bytes_counter] += bytes;
+}
+
+static int queue_meta_cmp(const void *a, const void *b) {
+    const queue_meta_t *qa = *(const queue_meta_t *const *)a;
+    const queue_meta_t *qb = *(const queue_meta_t *const *)b;
+    int res = memcmp(qa->key, qb->key, qa->nkey < qb->nkey ? qa->nkey : qb->nkey);
+
+    if (res == 0)
+        res = qa->nkey < qb->nkey ? -1 : qa->nkey > qb->nkey;
+    return res;
+}
+
+/*
+ * "STAT <queue> <size> <max_size>" for the queues whose names start with
+ * prefix, by name, skipping the first offset of them and stopping after
+ * limit (0 for no limit), then END. With detail, each line goes on with
+ * the queue's enqueues, dequeues, bytes in and out, gets that found it
+ * empty and sets refused because it was full. Returns a buffer the
+ * caller frees, or NULL when out of memory. Writers are not held up:
+ * they take the lock for reading too, only creating and deleting a queue
+ * waits.
+ */
+char *bdb_queue_stats(const char *prefix, size_t nprefix, unsigned int offset, unsigned int limit,
+                      const bool detail, int *bytes) {
+    queue_meta_t **list, *qm;
+    uint64_t count[QUEUE_COUNTERS];
+    unsigned int n = 0, i, end;
+    size_t size = 8;
+    char *buf, *pos;
+    int t, k;
+
+    pthread_rwlock_rdlock(&queue_meta_lock);
+    list = (queue_meta_t **)malloc(sizeof(queue_meta_t *) * (queue_meta_count + 1));
+    if (list == NULL) {
+        pthread_rwlock_unlock(&queue_meta_lock);
+        return NULL;
+    }
+    for (i = 0; i < QUEUE_META_HASH_SIZE; i++) {
+        for (qm = queue_meta[i]; qm != NULL; qm = qm->next) {
+            if (qm->nkey >= nprefix && memcmp(qm->key, prefix, nprefix) == 0)
+                list[n++] = qm;
+        }
+    }
+    qsort(list, n, sizeof(queue_meta_t *), queue_meta_cmp);
+
+    end = (limit > 0 && limit < n - (offset < n ? offset : n)) ? offset + limit : n;
+    for (i = offset; i < end; i++)
+        size += list[i]->nkey + (detail ? 32 + QUEUE_COUNTERS * 21 : 32);
+    buf = pos = (char *)malloc(size);
+    if (buf != NULL) {
+        for (i = offset; i < end; i++) {
+            qm = list[i];
+            pos += sprintf(pos, "STAT %.*s %u %u", (int)qm->nkey, qm->key,
+                           qm->size, qm->max_size);
+            if (detail) {
+                memset(count, 0, sizeof(count));
+                for (t = 0; t < settings.num_threads; t++) {
+                    for (k = 0; k < QUEUE_COUNTERS; k++)
+                        count[k] += qm->counters[t].count[k];
+                }
+                for (k = 0; k < QUEUE_COUNTERS; k++)
+                    pos += sprintf(pos, " %llu", (unsigned long long)count[k]);
+            }
+            pos += sprintf(pos, "\r\n");
+        }
+        pos += sprintf(pos, "END\r\n");
+        *bytes = pos - buf;
+    }
+    pthread_rwlock_unlock(&queue_meta_lock);
+    free(list);
+    return buf;
+}
+
+/* closes the handles of the queues that were opened */
+static void close_queue_db_list(void){
+    queue_meta_t *qm;
+    int i, ret;
+
+    pthread_rwlock_wrlock(&queue_meta_lock);
+    for (i = 0; i < QUEUE_META_HASH_SIZE; i++) {
+        for (qm = queue_meta[i]; qm != NULL; qm = qm->next) {
+            if (qm->dbp == NULL)
+                continue;
+            ret = qm->dbp->close(qm->dbp, 0);
+            qm->dbp = NULL;
+            qm->lru_prev = qm->lru_next = NULL;
+            if (settings.verbose > 1) {
+                fprintf(stderr, "close_queue_db_list: %.*s %s\n", (int)qm->nkey, qm->key, db_strerror(ret));
+            }
+        }
+    }
+    queue_lru_head = queue_lru_tail = NULL;
+    queue_lru_stats.open = 0;
+    pthread_rwlock_unlock(&queue_meta_lock);
+}
+
+/*
+ * Chunks. A message larger than re_len is split: the queue gets a head
+ * record, the first re_len - 8 bytes of the message with a chunk id in the
+ * last 8, and the rest goes to chunk.list in records of up to re_len bytes,
+ * keyed by queue name, chunk id and chunk index. Head and chunks are
+ * appended in one transaction and consumed in one. A head record is told
+ * from a plain one by an ITEM_ntotal() above re_len.
+ */
+
+#define CHUNK_ID_SIZE sizeof(uint64_t)
+#define CHUNK_HEAD_SIZE (bdb_settings.re_len - CHUNK_ID_SIZE)
+#define CHUNK_KEY_SIZE(nkey) ((nkey) + 1 + 8 + 4)
+#define CHUNK_KEY_MAX CHUNK_KEY_SIZE(512)
+#define CHUNK_DROP_BATCH 100
+
+void bdb_chunk_db_open(void){
+    int ret;
+
+    if ((ret = db_create(&chunk_dbp, envp, 0)) != 0) {
+        fprintf(stderr, "db_create: %s\n", db_strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+
+    ret = chunk_dbp->open(chunk_dbp, NULL, "chunk.list", NULL, DB_BTREE, DB_CREATE | DB_AUTO_COMMIT, 0664);
+    if (ret != 0) {
+        fprintf(stderr, "bdb_chunk_db_open: %s\n", db_strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+
+    /* start from the clock, so chunk ids of a previous run are not reused */
+    next_chunk_id = (uint64_t)time(NULL) << 20;
+}
+
+/* big-endian id and index, so the chunks of a message sort together, in order */
+static u_int32_t chunk_key(unsigned char *buf, char *queue_name, size_t queue_name_size,
+                           uint64_t id, uint32_t index){
+    unsigned char *p = buf + queue_name_size + 1;
+    int i;
+
+    memcpy(buf, queue_name, queue_name_size);
+    buf[queue_name_size] = '\0';
+    for (i = 7; i >= 0; i--)
+        *p++ = (unsigned char)(id >> (i * 8));
+    for (i = 3; i >= 0; i--)
+        *p++ = (unsigned char)(index >> (i * 8));
+    return (u_int32_t)(p - buf);
+}
+
+/*
+ * DB_APPENDs a message to a queue, compressed if the queue asks for it and
+ * split into chunks if it needs to be.
+ */
+static int queue_append(DB_TXN *txn, queue_rec_t *queue_recp, item *it){
+    DB *queue_dbp = queue_recp->queue_dbp;
+    item *zit = NULL;
+    DBT dbkey, dbdata;
+    db_recno_t recno;
+    unsigned char ckey[CHUNK_KEY_MAX];
+    char saved[CHUNK_ID_SIZE];
+    char *id_pos;
+    size_t ntotal = ITEM_ntotal(it), off, len;
+    uint64_t id;
+    uint32_t index;
+    int ret;
+
+    if ((queue_recp->flags & QUEUE_COMPRESS) && !(it->it_flags & ITEM_COMPRESSED)) {
+        zit = item_deflate(it);
+        if (zit != NULL) {
+            it = zit;
+            ntotal = ITEM_ntotal(it);
+        }
+    }
+
+    BDB_CLEANUP_DBT();
+    dbkey.data = &recno;
+    dbkey.ulen = sizeof(recno);
+    dbkey.flags = DB_DBT_USERMEM;
+    dbdata.data = it;
+
+    if (ntotal <= bdb_settings.re_len) {
+        dbdata.size = ntotal;
+        ret = queue_dbp->put(queue_dbp, txn, &dbkey, &dbdata, DB_APPEND);
+        goto out;
+    }
+
+    pthread_mutex_lock(&chunk_id_lock);
+    id = ++next_chunk_id;
+    pthread_mutex_unlock(&chunk_id_lock);
+
+    /* the head record is the start of the item, with the id over its last bytes */
+    id_pos = (char *)it + CHUNK_HEAD_SIZE;
+    memcpy(saved, id_pos, CHUNK_ID_SIZE);
+    memcpy(id_pos, &id, CHUNK_ID_SIZE);
+    dbdata.size = bdb_settings.re_len;
+    ret = queue_dbp->put(queue_dbp, txn, &dbkey, &dbdata, DB_APPEND);
+    memcpy(id_pos, saved, CHUNK_ID_SIZE);
+    if (ret != 0) {
+        goto out;
+    }
+
+    for (off = CHUNK_HEAD_SIZE, index = 0; off < ntotal; off += len, index++) {
+        len = ntotal - off < bdb_settings.re_len ? ntotal - off : bdb_settings.re_len;
+
+        BDB_CLEANUP_DBT();
+        dbkey.data = ckey;
+        dbkey.size = chunk_key(ckey, ITEM_key(it), it->nkey, id, index);
+        dbdata.data = (char *)it + off;
+        dbdata.size = len;
+        ret = chunk_dbp->put(chunk_dbp, txn, &dbkey, &dbdata, 0);
+        if (ret != 0) {
+            break;
+        }
+    }
+out:
+    if (zit != NULL) {
+        free(zit);
+    }
+    return ret;
+}
+
+/*
+ * *itp holds a head record just read; replaces it with the whole message,
+ * each chunk read straight into its place in the new item. With consume,
+ * the chunks are deleted as they are read.
+ */
+static int chunk_join(DB_TXN *txn, char *queue_name, size_t queue_name_size, item **itp, const bool consume){
+    DBT dbkey, dbdata;
+    unsigned char ckey[CHUNK_KEY_MAX];
+    item *head = *itp, *it;
+    size_t ntotal = ITEM_ntotal(head), off, len;
+    uint64_t id;
+    uint32_t index;
+    int ret;
+
+    it = (item *)malloc(ntotal);
+    if (it == NULL) {
+        return ENOMEM;
+    }
+    memcpy(it, head, CHUNK_HEAD_SIZE);
+    memcpy(&id, (char *)head + CHUNK_HEAD_SIZE, CHUNK_ID_SIZE);
+
+    for (off = CHUNK_HEAD_SIZE, index = 0; off < ntotal; off += len, index++) {
+        len = ntotal - off < bdb_settings.re_len ? ntotal - off : bdb_settings.re_len;
+
+        BDB_CLEANUP_DBT();
+        dbkey.data = ckey;
+        dbkey.size = chunk_key(ckey, queue_name, queue_name_size, id, index);
+        dbdata.data = (char *)it + off;
+        dbdata.ulen = len;
+        dbdata.flags = DB_DBT_USERMEM;
+        ret = chunk_dbp->get(chunk_dbp, txn, &dbkey, &dbdata, 0);
+        if (ret == 0 && consume) {
+            ret = chunk_dbp->del(chunk_dbp, txn, &dbkey, 0);
+        }
+        if (ret != 0) {
+            free(it);
+            return ret;
+        }
+    }
+
+    /* the head's buffer is a plain one again, back to the freelist */
+    head->nbytes = 0;
+    item_free(head);
+    *itp = it;
+    return 0;
+}
+
+/*
+ * Drops the chunks left behind by the messages of a deleted queue, a batch
+ * per transaction. Ids from limit on belong to a queue created under the
+ * same name since, those stay.
+ */
+static void chunk_drop_queue(char *queue_name, size_t queue_name_size, uint64_t limit){
+    DBT dbkey, dbdata;
+    DB_TXN *txn = NULL;
+    DBC *cursorp = NULL;
+    unsigned char ckey[CHUNK_KEY_MAX];
+    unsigned char *p;
+    uint64_t id;
+    int i, ndropped, ntotal = 0, done = 0;
+    int ret;
+
+    while (!done) {
+        ret = envp->txn_begin(envp, NULL, &txn, 0);
+        if (ret != 0) {
+            goto err;
+        }
+        ret = chunk_dbp->cursor(chunk_dbp, txn, &cursorp, 0);
+        if (ret != 0) {
+            goto err;
+        }
+
+        BDB_CLEANUP_DBT();
+        dbkey.data = ckey;
+        dbkey.size = chunk_key(ckey, queue_name, queue_name_size, 0, 0);
+        dbkey.ulen = sizeof(ckey);
+        dbkey.flags = DB_DBT_USERMEM;
+        dbdata.flags = DB_DBT_PARTIAL;  /* keys only */
+
+        ret = cursorp->get(cursorp, &dbkey, &dbdata, DB_SET_RANGE);
+        for (ndropped = 0; ret == 0 && ndropped < CHUNK_DROP_BATCH; ndropped++) {
+            if (dbkey.size != CHUNK_KEY_SIZE(queue_name_size) ||
+                memcmp(ckey, queue_name, queue_name_size) != 0 ||
+                ckey[queue_name_size] != '\0') {
+                break;
+            }
+            p = ckey + queue_name_size + 1;
+            for (id = 0, i = 0; i < 8; i++)
+                id = (id << 8) | p[i];
+            if (id >= limit) {
+                break;
+            }
+            ret = cursorp->del(cursorp, 0);
+            if (ret != 0) {
+                goto err;
+            }
+            ret = cursorp->get(cursorp, &dbkey, &dbdata, DB_NEXT);
+        }
+        if (ret != 0 && ret != DB_NOTFOUND) {
+            goto err;
+        }
+        done = ndropped < CHUNK_DROP_BATCH || ret == DB_NOTFOUND;
+        ntotal += ndropped;
+
+        cursorp->close(cursorp);
+        cursorp = NULL;
+        ret = txn->commit(txn, 0);
+        txn = NULL;
+        if (ret != 0) {
+            goto err;
+        }
+        if (!done) {
+            usleep(REAP_PAUSE_USEC);    /* only the reaper drops chunks */
+        }
+    }
+
+    if (settings.verbose > 1 && ntotal > 0) {
+        fprintf(stderr, "chunk_drop_queue: %d chunks of %s dropped\n", ntotal, queue_name);
+    }
+    return;
+err:
+    if (cursorp != NULL){
+        cursorp->close(cursorp);
+    }
+    if (txn != NULL){
+        txn->abort(txn);
+    }
+    if (settings.verbose > 1) {
+        fprintf(stderr, "chunk_drop_queue: %s\n", db_strerror(ret));
+    }
+}
+
+/*
+ * Compression. On a queue created with "compress", a message is stored as
+ * its uncompressed length, 4 bytes, and the lz_compress()ed data, with
+ * ITEM_COMPRESSED set in the item header; key and suffix stay as they
+ * were. Messages that don't get smaller are stored as is. Each queue's
+ * ratio and time spent are kept in its queue_meta_t for "stats compress".
+ */
+
+#define COMPRESS_MIN_BYTES 64   /* smaller messages are not worth it */
+#define COMPRESS_LEN_SIZE sizeof(uint32_t)
+
+/* microseconds on a clock that doesn't jump with the time of day */
+static uint64_t compress_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void compress_stats_add(char *queue_name, size_t queue_name_size, uint64_t raw_bytes,
+                               uint64_t stored_bytes, uint64_t compress_usec, uint64_t decompress_usec) {
+    queue_meta_t *qm;
+
+    pthread_rwlock_rdlock(&queue_meta_lock);
+    qm = queue_meta_find(queue_name, queue_name_size);
+    if (qm != NULL) {
+        __sync_fetch_and_add(&qm->raw_bytes, raw_bytes);
+        __sync_fetch_and_add(&qm->stored_bytes, stored_bytes);
+        __sync_fetch_and_add(&qm->compress_usec, compress_usec);
+        __sync_fetch_and_add(&qm->decompress_usec, decompress_usec);
+    }
+    pthread_rwlock_unlock(&queue_meta_lock);
+}
+
+/*
+ * One "STAT <queue> <raw bytes> <stored bytes> <ratio> <compress usec>
+ * <decompress usec>" line per queue that has compressed anything, then
+ * END. Returns a buffer the caller frees, or NULL when out of memory.
+ */
+char *bdb_compress_stats(int *bytes) {
+    queue_meta_t *qm;
+    char *buf, *p;
+    size_t size = 8;
+    int i, n = 0;
+
+    pthread_rwlock_rdlock(&queue_meta_lock);
+    for (i = 0; i < QUEUE_META_HASH_SIZE; i++) {
+        for (qm = queue_meta[i]; qm != NULL; qm = qm->next) {
+            if (qm->raw_bytes > 0) {
+                size += qm->nkey + 128;
+                n++;
+            }
+        }
+    }
+    buf = p = (char *)malloc(size);
+    if (buf != NULL) {
+        /* counters move under a read lock: no more lines than sized for */
+        for (i = 0; i < QUEUE_META_HASH_SIZE && n > 0; i++) {
+            for (qm = queue_meta[i]; qm != NULL && n > 0; qm = qm->next) {
+                if (qm->raw_bytes == 0)
+                    continue;
+                n--;
+                p += sprintf(p, "STAT %.*s %llu %llu %.2f %llu %llu\r\n", (int)qm->nkey, qm->key,
+                             (unsigned long long)qm->raw_bytes, (unsigned long long)qm->stored_bytes,
+                             qm->stored_bytes ? (double)qm->raw_bytes / qm->stored_bytes : 0.0,
+                             (unsigned long long)qm->compress_usec,
+                             (unsigned long long)qm->decompress_usec);
+            }
+        }
+        p += sprintf(p, "END\r\n");
+        *bytes = p - buf;
+    }
+    pthread_rwlock_unlock(&queue_meta_lock);
+    return buf;
+}
+
+/*
+ * Returns a compressed copy of it, to be free()d, or NULL if compression
+ * wouldn't save anything.
+ */
+static item *item_deflate(item *it) {
+    size_t hlen = ITEM_ntotal(it) - it->nbytes;
+    size_t clen = 0;
+    uint32_t raw = it->nbytes;
+    uint64_t start;
+    item *zit;
+
+    if (it->nbytes < COMPRESS_MIN_BYTES) {
+        return NULL;
+    }
+    zit = (item *)malloc(ITEM_ntotal(it));
+    if (zit == NULL) {
+        return NULL;
+    }
+
+    memcpy(zit, it, hlen);
+
+    start = compress_now();
+    clen = lz_compress(ITEM_data(it), it->nbytes, ITEM_data(zit) + COMPRESS_LEN_SIZE,
+                       it->nbytes - COMPRESS_LEN_SIZE - 1);
+    compress_stats_add(ITEM_key(it), it->nkey, it->nbytes,
+                       clen > 0 ? clen + COMPRESS_LEN_SIZE : it->nbytes, compress_now() - start, 0);
+    if (clen == 0) {
+        free(zit);
+        return NULL;
+    }
+
+    memcpy(ITEM_data(zit), &raw, COMPRESS_LEN_SIZE);
+    zit->nbytes = clen + COMPRESS_LEN_SIZE;
+    zit->it_flags |= ITEM_COMPRESSED;
+    return zit;
+}
+
+/*
+ * Replaces the compressed item *itp with the plain one. 0 on success, or
+ * EINVAL if the data doesn't decompress, *itp is left alone then.
+ */
+static int item_inflate(item **itp) {
+    item *zit = *itp, *it;
+    size_t hlen = ITEM_ntotal(zit) - zit->nbytes;
+    uint32_t raw;
+    uint64_t start;
+    int len;
+
+    if (zit->nbytes < COMPRESS_LEN_SIZE) {
+        return EINVAL;
+    }
+    memcpy(&raw, ITEM_data(zit), COMPRESS_LEN_SIZE);
+    if (raw > ITEM_SIZE_MAX + 2) {
+        return EINVAL;
+    }
+
+    /* a freelist buffer or a malloc()ed one, as item_free() expects for the size */
+    if (hlen + raw <= bdb_settings.re_len) {
+        it = item_alloc2();
+    } else {
+        it = (item *)malloc(hlen + raw);
+    }
+    if (it == NULL) {
+        return ENOMEM;
+    }
+
+    memcpy(it, zit, hlen);
+    it->nbytes = raw;
+    it->it_flags &= ~ITEM_COMPRESSED;
+
+    start = compress_now();
+    len = lz_decompress(ITEM_data(zit) + COMPRESS_LEN_SIZE, zit->nbytes - COMPRESS_LEN_SIZE,
+                        ITEM_data(it), raw);
+    if (len != (int)raw) {
+        item_free(it);
+        return EINVAL;
+    }
+    compress_stats_add(ITEM_key(zit), zit->nkey, 0, 0, 0, compress_now() - start);
+
+    item_free(zit);
+    *itp = it;
+    return 0;
+}
+
+/* if return item is not NULL, free by caller */
+item *bdb_get(char *key, size_t nkey){
+    item *it = NULL;
+    DBT dbkey, dbdata;
+    DB_TXN *txn = NULL;
+    queue_rec_t queue_rec;
+    DB *queue_dbp = NULL;
+    db_recno_t recno;
+    uint64_t t;
+    int ret;
+
+    /* first, alloc a fixed size */
+    it = item_alloc2();
+    if (it == 0) {
+        return NULL;
+    }
+
+    BDB_CLEANUP_DBT();
+    dbkey.data = &recno;
+    dbkey.ulen = sizeof(recno);
+    dbkey.flags = DB_DBT_USERMEM;
+    dbdata.ulen = bdb_settings.re_len;
+    dbdata.data = it;
+    dbdata.flags = DB_DBT_USERMEM;
+
+    memset(&queue_rec, 0, sizeof(queue_rec_t));
+    t = latency_now();
+    ret = envp->txn_begin(envp, NULL, &txn, 0);
+    if (ret != 0) {
+        goto err;
+    }
+    t = latency_mark(LATENCY_GET_TXN_BEGIN, t);
+
+    ret = get_queue_db_handle(txn, key, nkey, &queue_rec);
+    t = latency_mark(LATENCY_GET_QLIST, t);
+
+    if (ret != 0) {
+        goto err;
+    }
+
+    queue_dbp = queue_rec.queue_dbp;
+    ret = queue_dbp->get(queue_dbp, txn, &dbkey, &dbdata, DB_CONSUME);
+    if (ret != 0){
+        if (ret == DB_NOTFOUND) {
+            queue_meta_event(&queue_rec, QUEUE_EMPTY_GETS, -1, 0);
+        }
+        goto err;
+    }
+    if (ITEM_ntotal(it) > bdb_settings.re_len) {
+        ret = chunk_join(txn, key, nkey, &it, true);
+        if (ret != 0) {
+            goto err;
+        }
+    }
+    if (queue_rec.max_size) {
+        UPDATE_QUEUE_LENGTH_LOCK();
+        ret = update_queue_length(txn, key, nkey, -1);
+        UPDATE_QUEUE_LENGTH_UNLOCK();
+        if (ret != 0) {
+            goto err;
+        }
+    }
+
+    /* before the commit: a message that doesn't decompress stays queued */
+    if ((queue_rec.flags & QUEUE_COMPRESS) && (it->it_flags & ITEM_COMPRESSED)) {
+        ret = item_inflate(&it);
+        if (ret != 0) {
+            goto err;
+        }
+    }
+
+    t = latency_mark(LATENCY_GET_CONSUME, t);
+
+    ret = txn->commit(txn, 0);
+    txn = NULL;
+    if (ret != 0) {
+        goto err;
+    }
+    latency_mark(LATENCY_GET_COMMIT, t);
+    queue_meta_event(&queue_rec, QUEUE_DEQUEUES, QUEUE_BYTES_OUT, it->nbytes - 2);
+    put_queue_db_handle(key, nkey, &queue_rec);
+    return it;
+err:
+    item_free(it);
+    it = NULL;
+    if (txn != NULL){
+        txn->abort(txn);
+    }
+    put_queue_db_handle(key, nkey, &queue_rec);
+    if (settings.verbose > 1) {
+        fprintf(stderr, "bdb_get: %s\n", db_strerror(ret));
+    }
+    return NULL;
+}
+
+/*
+ * Reads up to max_items records from the head of the queue without
+ * consuming them: a plain read cursor, no transaction. Returns the number
+ * of items stored in items (freed by caller), or -1 on error.
+ */
+int bdb_peek(char *key, size_t nkey, item **items, int max_items){
+    DBT dbkey, dbdata;
+    queue_rec_t queue_rec;
+    DB *queue_dbp = NULL;
+    DBC *cursorp = NULL;
+    db_recno_t recno;
+    item *it = NULL;
+    int ret, nitems = 0;
+
+    memset(&queue_rec, 0, sizeof(queue_rec_t));
+    ret = get_queue_db_handle(NULL, key, nkey, &queue_rec);
+    if (ret != 0) {
+        goto err;
+    }
+
+    queue_dbp = queue_rec.queue_dbp;
+    ret = queue_dbp->cursor(queue_dbp, NULL, &cursorp, 0);
+    if (ret != 0) {
+        goto err;
+    }
+
+    while (nitems < max_items) {
+        it = item_alloc2();
+        if (it == 0) {
+            break;
+        }
+
+        BDB_CLEANUP_DBT();
+        dbkey.data = &recno;
+        dbkey.ulen = sizeof(recno);
+        dbkey.flags = DB_DBT_USERMEM;
+        dbdata.ulen = bdb_settings.re_len;
+        dbdata.data = it;
+        dbdata.flags = DB_DBT_USERMEM;
+
+        ret = cursorp->get(cursorp, &dbkey, &dbdata, DB_NEXT);
+        if (ret != 0) {
+            item_free(it);
+            if (ret != DB_NOTFOUND) {
+                goto err;
+            }
+            break;
+        }
+        if (ITEM_ntotal(it) > bdb_settings.re_len) {
+            ret = chunk_join(NULL, key, nkey, &it, false);
+            if (ret == DB_NOTFOUND) {
+                /* consumed under our feet */
+                item_free(it);
+                continue;
+            }
+            if (ret != 0) {
+                item_free(it);
+                goto err;
+            }
+        }
+        if ((queue_rec.flags & QUEUE_COMPRESS) && (it->it_flags & ITEM_COMPRESSED)) {
+            ret = item_inflate(&it);
+            if (ret != 0) {
+                item_free(it);
+                goto err;
+            }
+        }
+        items[nitems++] = it;
+    }
+
+    cursorp->close(cursorp);
+    put_queue_db_handle(key, nkey, &queue_rec);
+    return nitems;
+err:
+    while (nitems > 0) {
+        item_free(items[--nitems]);
+    }
+    if (cursorp != NULL){
+        cursorp->close(cursorp);
+    }
+    put_queue_db_handle(key, nkey, &queue_rec);
+    if (settings.verbose > 1 && ret != DB_NOTFOUND) {
+        fprintf(stderr, "bdb_peek: %s\n", db_strerror(ret));
+    }
+    return ret == DB_NOTFOUND ? 0 : -1;
+}
+
+/* 0 for Success
+   -1 for SERVER_ERROR
+*/
+int bdb_add(char *key, size_t nkey, item *it){
+    int ret;
+    DBT dbkey, dbdata;
+    DB_TXN *txn = NULL;
+    queue_rec_t queue_rec;
+    DB *queue_dbp = NULL;
+    db_recno_t recno;
+    u_int32_t max_size = -1;
+    u_int32_t queue_flags = 0;
+
+
+    memset(&queue_rec, 0, sizeof(queue_rec_t));
+    BDB_CLEANUP_DBT();
+    dbkey.data = &recno;
+    dbkey.ulen = sizeof(recno);
+    dbkey.flags = DB_DBT_USERMEM;
+    dbdata.data = it;
+    dbdata.size = ITEM_ntotal(it);
+
+    char* max_size_str = ITEM_data(it);
+    char* opt;
+
+    max_size = atoi(max_size_str);
+    if (strlen(max_size_str) < 1 ||
+        *max_size_str < '0' || *max_size_str > '9' || max_size < 0) {
+        if (settings.verbose > 1) {
+            fprintf(stderr, "bdb_add: max_size: %d is not valid!\n", max_size);
+        }
+        ret = -1;
+        goto err;
+    }
+
+    /* "<max_size> compress" asks for the queue's messages to be compressed */
+    for (opt = max_size_str; *opt >= '0' && *opt <= '9'; opt++)
+        ;
+    while (*opt == ' ')
+        opt++;
+    if (strncmp(opt, "compress", 8) == 0) {
+        queue_flags |= QUEUE_COMPRESS;
+        opt += 8;
+    }
+    if (*opt != '\r') {
+        if (settings.verbose > 1) {
+            fprintf(stderr, "bdb_add: unknown queue option: %.*s\n", (int)strcspn(opt, "\r"), opt);
+        }
+        ret = -1;
+        goto err;
+    }
+
+    ret = envp->txn_begin(envp, NULL, &txn, 0);
+    if (ret != 0) {
+        if (settings.verbose > 1) {
+            fprintf(stderr, "bdb_add: %s\n", db_strerror(ret));
+        }
+        ret = -1;
+        goto err;
+    }
+
+    memset(&queue_rec, 0, sizeof(queue_rec_t));
+    ret = get_queue_db_handle(txn, key, nkey, &queue_rec);
+    if (ret == 0) {
+        ret = -1;
+        goto err;
+    } else if (ret == DB_NOTFOUND) {
+        ret = create_queue_db(txn, key, nkey, &queue_dbp, max_size, queue_flags);
+        if (ret != 0) {
+            if (settings.verbose > 1) {
+                fprintf(stderr, "bdb_add: %s\n", db_strerror(ret));
+            }
+            ret = -1;
+            goto err;
+        }
+    } else {
+        ret = -1;
+        goto err;
+    }
+
+    ret = txn->commit(txn, 0);
+    txn = NULL;
+    if (ret != 0) {
+        if (settings.verbose > 1) {
+            fprintf(stderr, "bdb_add: %s\n", db_strerror(ret));
+        }
+        ret = -1;
+        goto err;
+    }
+
+    memset(&queue_rec, 0, sizeof(queue_rec_t));
+    queue_rec.queue_dbp = queue_dbp;
+    queue_rec.max_size = max_size;
+    queue_rec.flags = queue_flags;
+    queue_meta_add(key, nkey, &queue_rec);
+    return 0;
+err:
+    if (txn != NULL){
+        txn->abort(txn);
+    }
+    put_queue_db_handle(key, nkey, &queue_rec);
+    return ret;
+}
+
+/* 0 for Success
+   -1 for SERVER_ERROR
+*/
+int bdb_put(char *key, size_t nkey, item *it){
+    int ret;
+    DB_TXN *txn = NULL;
+    queue_rec_t queue_rec;
+    uint64_t t;
+
+    memset(&queue_rec, 0, sizeof(queue_rec_t));
+    t = latency_now();
+    ret = envp->txn_begin(envp, NULL, &txn, 0);
+    if (ret != 0) {
+        goto err;
+    }
+    t = latency_mark(LATENCY_PUT_TXN_BEGIN, t);
+
+    ret = get_queue_db_handle(txn, key, nkey, &queue_rec);
+    t = latency_mark(LATENCY_PUT_QLIST, t);
+
+    if (ret != 0){
+        if (txn != NULL){
+            txn->abort(txn);
+        }
+        if (settings.verbose > 1) {
+            fprintf(stderr, "bdb_put: %s\n", db_strerror(ret));
+        }
+        return 1;
+    }
+
+    if (queue_rec.max_size && (queue_rec.size + 1 > queue_rec.max_size)) {
+        if (txn != NULL){
+            txn->abort(txn);
+        }
+        queue_meta_event(&queue_rec, QUEUE_FULL_REJECTS, -1, 0);
+        put_queue_db_handle(key, nkey, &queue_rec);
+        if (settings.verbose > 1) {
+            fprintf(stderr, "bdb_put: queue size limited %d\n", queue_rec.max_size);
+        }
+        return -1;
+    }
+
+    ret = queue_append(txn, &queue_rec, it);
+    if (ret != 0) {
+        goto err;
+    }
+
+    if (queue_rec.max_size) {
+        UPDATE_QUEUE_LENGTH_LOCK();
+        ret = update_queue_length(txn, key, nkey, 1);
+        UPDATE_QUEUE_LENGTH_UNLOCK();
+        if (ret != 0) {
+            goto err;
+        }
+    }
+
+    t = latency_mark(LATENCY_PUT_APPEND, t);
+
+    ret = txn->commit(txn, 0);
+    if (ret != 0) {
+        goto err;
+    }
+    latency_mark(LATENCY_PUT_COMMIT, t);
+    queue_meta_event(&queue_rec, QUEUE_ENQUEUES, QUEUE_BYTES_IN, it->nbytes - 2);
+    put_queue_db_handle(key, nkey, &queue_rec);
+
+    return 0;
+err:
+    if (txn != NULL){
+        txn->abort(txn);
+    }
+    put_queue_db_handle(key, nkey, &queue_rec);
+    if (settings.verbose > 1) {
+        fprintf(stderr, "bdb_put: %s\n", db_strerror(ret));
+    }
+    return -1;
+}
+
+/*
+ * Gives it the key key: a message carries the name of its queue, which
+ * its chunks and an expired lease go by. Returns the new item, it is
+ * freed, or NULL when out of memory, it is left alone then.
+ */
+static item *item_rekey(item *it, char *key, size_t nkey) {
+    size_t ntotal = ITEM_ntotal(it) - it->nkey + nkey;
+    item *nit;
+
+    if (it->nkey == nkey && memcmp(ITEM_key(it), key, nkey) == 0) {
+        return it;
+    }
+    /* a freelist buffer or a malloc()ed one, as item_free() expects for the size */
+    if (ntotal <= bdb_settings.re_len) {
+        nit = item_alloc2();
+    } else {
+        nit = (item *)malloc(ntotal);
+    }
+    if (nit == NULL) {
+        return NULL;
+    }
+
+    memcpy(nit, it, sizeof(item));
+    nit->nkey = nkey;
+    memcpy(ITEM_key(nit), key, nkey);
+    ITEM_key(nit)[nkey] = '\0';
+    memcpy(ITEM_suffix(nit), ITEM_suffix(it), it->nsuffix + it->nbytes);
+    item_free(it);
+    return nit;
+}
+
+/*
+ * Moves up to max_items messages from the head of src to the tail of dst
+ * in one transaction, stopping early when src runs empty or dst is full.
+ * src and dst must differ. A message that is compressed in src stays so
+ * if dst compresses too. The number moved goes in *nmoved, and the
+ * messages in items, plain, for the caller to free, with their number in
+ * *nitems: fewer if some didn't decompress. Returns 0, 1 if either queue
+ * doesn't exist, or -1 on error, when nothing is moved.
+ */
+int bdb_move(char *src, size_t nsrc, char *dst, size_t ndst, item **items, int max_items,
+             int *nmoved, int *nitems){
+    DBT dbkey, dbdata;
+    DB_TXN *txn = NULL;
+    queue_rec_t src_rec, dst_rec;
+    db_recno_t recno;
+    item *it = NULL;
+    int ret, n = 0, i, j;
+
+    *nmoved = *nitems = 0;
+    memset(&src_rec, 0, sizeof(queue_rec_t));
+    memset(&dst_rec, 0, sizeof(queue_rec_t));
+    ret = envp->txn_begin(envp, NULL, &txn, 0);
+    if (ret != 0) {
+        goto err;
+    }
+
+    ret = get_queue_db_handle(txn, src, nsrc, &src_rec);
+    if (ret != 0) {
+        goto err;
+    }
+    ret = get_queue_db_handle(txn, dst, ndst, &dst_rec);
+    if (ret != 0) {
+        goto err;
+    }
+
+    while (n < max_items) {
+        if (dst_rec.max_size && dst_rec.size + n + 1 > dst_rec.max_size) {
+            queue_meta_event(&dst_rec, QUEUE_FULL_REJECTS, -1, 0);
+            break;
+        }
+
+        it = item_alloc2();
+        if (it == 0) {
+            ret = ENOMEM;
+            goto err;
+        }
+        BDB_CLEANUP_DBT();
+        dbkey.data = &recno;
+        dbkey.ulen = sizeof(recno);
+        dbkey.flags = DB_DBT_USERMEM;
+        dbdata.ulen = bdb_settings.re_len;
+        dbdata.data = it;
+        dbdata.flags = DB_DBT_USERMEM;
+
+        ret = src_rec.queue_dbp->get(src_rec.queue_dbp, txn, &dbkey, &dbdata, DB_CONSUME);
+        if (ret == DB_NOTFOUND) {
+            if (n == 0) {
+                queue_meta_event(&src_rec, QUEUE_EMPTY_GETS, -1, 0);
+            }
+            item_free(it);
+            it = NULL;
+            break;
+        }
+        if (ret != 0) {
+            goto err;
+        }
+        if (ITEM_ntotal(it) > bdb_settings.re_len) {
+            ret = chunk_join(txn, src, nsrc, &it, true);
+            if (ret != 0) {
+                goto err;
+            }
+        }
+        if ((src_rec.flags & QUEUE_COMPRESS) && (it->it_flags & ITEM_COMPRESSED)
+            && !(dst_rec.flags & QUEUE_COMPRESS)) {
+            ret = item_inflate(&it);
+            if (ret != 0) {
+                goto err;
+            }
+        }
+        if ((items[n] = item_rekey(it, dst, ndst)) == NULL) {
+            ret = ENOMEM;
+            goto err;
+        }
+        it = NULL;
+
+        ret = queue_append(txn, &dst_rec, items[n]);
+        n++;
+        if (ret != 0) {
+            goto err;
+        }
+    }
+
+    /* one write per queue.list record, however many were moved */
+    if (n > 0 && (src_rec.max_size || dst_rec.max_size)) {
+        UPDATE_QUEUE_LENGTH_LOCK();
+        ret = 0;
+        if (src_rec.max_size) {
+            ret = update_queue_length(txn, src, nsrc, -n);
+        }
+        if (ret == 0 && dst_rec.max_size) {
+            ret = update_queue_length(txn, dst, ndst, n);
+        }
+        UPDATE_QUEUE_LENGTH_UNLOCK();
+        if (ret != 0) {
+            goto err;
+        }
+    }
+
+    ret = txn->commit(txn, 0);
+    txn = NULL;
+    if (ret != 0) {
+        goto err;
+    }
+
+    /* the handles are held until the events are counted */
+    for (i = 0, j = 0; i < n; i++) {
+        it = items[i];
+        ret = 0;
+        if ((src_rec.flags & QUEUE_COMPRESS) && (it->it_flags & ITEM_COMPRESSED)) {
+            ret = item_inflate(&it);
+        }
+        queue_meta_event(&src_rec, QUEUE_DEQUEUES, QUEUE_BYTES_OUT, it->nbytes - 2);
+        queue_meta_event(&dst_rec, QUEUE_ENQUEUES, QUEUE_BYTES_IN, it->nbytes - 2);
+        if (ret != 0) {
+            /* moved all the same, it just can't go back to the client */
+            if (settings.verbose > 1) {
+                fprintf(stderr, "bdb_move: %s\n", db_strerror(ret));
+            }
+            item_free(it);
+            continue;
+        }
+        items[j++] = it;
+    }
+    put_queue_db_handle(src, nsrc, &src_rec);
+    put_queue_db_handle(dst, ndst, &dst_rec);
+    *nmoved = n;
+    *nitems = j;
+    return 0;
+err:
+    item_free(it);
+    for (i = 0; i < n; i++) {
+        item_free(items[i]);
+    }
+    if (txn != NULL){
+        txn->abort(txn);
+    }
+    put_queue_db_handle(src, nsrc, &src_rec);
+    put_queue_db_handle(dst, ndst, &dst_rec);
+    if (settings.verbose > 1) {
+        fprintf(stderr, "bdb_move: %s\n", db_strerror(ret));
+    }
+    return ret == DB_NOTFOUND ? 1 : -1;
+}
+
+/*
+ * Leases. A leased message is consumed from its queue and written to
+ * lease.list, keyed by its receipt, in the same transaction, so it can't
+ * be lost between lget and ack. Acks are deleted from lease.list in
+ * batches by the lease thread (see lease.c).
+ */
+
+void bdb_lease_db_open(void){
+    int ret;
+    DBC *cursorp = NULL;
+    DBT dbkey, dbdata;
+    uint64_t receipt;
+    item *it = NULL;
+    int recovered = 0;
+
+    if ((ret = db_create(&lease_dbp, envp, 0)) != 0) {
+        fprintf(stderr, "db_create: %s\n", db_strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+
+    ret = lease_dbp->open(lease_dbp, NULL, "lease.list", NULL, DB_BTREE, DB_CREATE | DB_AUTO_COMMIT, 0664);
+    if (ret != 0) {
         goto err;
     }
 
+    /* leases that were in flight when we went down are redelivered */
+    for (;;) {
+        ret = lease_dbp->cursor(lease_dbp, NULL, &cursorp, 0);
+        if (ret != 0) {
+            goto err;
+        }
+
+        BDB_CLEANUP_DBT();
+        dbkey.data = &receipt;
+        dbkey.ulen = sizeof(receipt);
+        dbkey.flags = DB_DBT_USERMEM;
+        dbdata.flags = DB_DBT_MALLOC;  /* may be a message of any size */
+
+        ret = cursorp->get(cursorp, &dbkey, &dbdata, DB_FIRST);
+        cursorp->close(cursorp);
+        cursorp = NULL;
+        if (ret == DB_NOTFOUND) {
+            break;
+        }
+        if (ret != 0) {
+            goto err;
+        }
+        it = (item *)dbdata.data;
+        ret = bdb_lease_redeliver(receipt, it);
+        free(it);
+        if (ret != 0) {
+            ret = EINVAL;
+            goto err;
+        }
+        recovered++;
+    }
+
+    if (recovered > 0 || settings.verbose > 1) {
+        fprintf(stderr, "bdb_lease_db_open: %d leases redelivered\n", recovered);
+    }
+    return;
+
+err:
+    if (cursorp != NULL){
+        cursorp->close(cursorp);
+    }
+    fprintf(stderr, "bdb_lease_db_open: %s\n", db_strerror(ret));
+    exit(EXIT_FAILURE);
+}
+
+/* same as bdb_get(), but the message is kept in lease.list under receipt */
+item *bdb_lget(char *key, size_t nkey, uint64_t receipt){
+    item *it = NULL;
+    DBT dbkey, dbdata;
+    DB_TXN *txn = NULL;
+    queue_rec_t queue_rec;
+    DB *queue_dbp = NULL;
+    db_recno_t recno;
+    int ret;
+
+    it = item_alloc2();
+    if (it == 0) {
+        return NULL;
+    }
+
+    BDB_CLEANUP_DBT();
+    dbkey.data = &recno;
+    dbkey.ulen = sizeof(recno);
+    dbkey.flags = DB_DBT_USERMEM;
+    dbdata.ulen = bdb_settings.re_len;
+    dbdata.data = it;
+    dbdata.flags = DB_DBT_USERMEM;
+
     memset(&queue_rec, 0, sizeof(queue_rec_t));
-    ret = get_queue_db_handle(txn, key, nkey, &queue_rec);
+    ret = envp->txn_begin(envp, NULL, &txn, 0);
+    if (ret != 0) {
+        goto err;
+    }
 
+    ret = get_queue_db_handle(txn, key, nkey, &queue_rec);
     if (ret != 0) {
         goto err;
     }
@@ -649,8 +2413,17 @@ item *bdb_get(char *key, size_t nkey){
     queue_dbp = queue_rec.queue_dbp;
     ret = queue_dbp->get(queue_dbp, txn, &dbkey, &dbdata, DB_CONSUME);
     if (ret != 0){
+        if (ret == DB_NOTFOUND) {
+            queue_meta_event(&queue_rec, QUEUE_EMPTY_GETS, -1, 0);
+        }
         goto err;
     }
+    if (ITEM_ntotal(it) > bdb_settings.re_len) {
+        ret = chunk_join(txn, key, nkey, &it, true);
+        if (ret != 0) {
+            goto err;
+        }
+    }
     if (queue_rec.max_size) {
         UPDATE_QUEUE_LENGTH_LOCK();
         ret = update_queue_length(txn, key, nkey, -1);
@@ -660,181 +2433,144 @@ item *bdb_get(char *key, size_t nkey){
         }
     }
 
+    BDB_CLEANUP_DBT();
+    dbkey.data = &receipt;
+    dbkey.size = sizeof(receipt);
+    dbdata.data = it;
+    dbdata.size = ITEM_ntotal(it);
+    ret = lease_dbp->put(lease_dbp, txn, &dbkey, &dbdata, 0);
+    if (ret != 0) {
+        goto err;
+    }
+
     ret = txn->commit(txn, 0);
+    txn = NULL;
     if (ret != 0) {
         goto err;
     }
+    /* the lease keeps the message as stored, the client gets it plain */
+    if ((queue_rec.flags & QUEUE_COMPRESS) && (it->it_flags & ITEM_COMPRESSED)) {
+        ret = item_inflate(&it);
+        if (ret != 0) {
+            goto err;
+        }
+    }
+    queue_meta_event(&queue_rec, QUEUE_DEQUEUES, QUEUE_BYTES_OUT, it->nbytes - 2);
+    put_queue_db_handle(key, nkey, &queue_rec);
     return it;
 err:
     item_free(it);
-    it = NULL;
     if (txn != NULL){
         txn->abort(txn);
     }
+    put_queue_db_handle(key, nkey, &queue_rec);
     if (settings.verbose > 1) {
-        fprintf(stderr, "bdb_get: %s\n", db_strerror(ret));
+        fprintf(stderr, "bdb_lget: %s\n", db_strerror(ret));
     }
     return NULL;
 }
 
-/* 0 for Success
-   -1 for SERVER_ERROR
-*/
-int bdb_add(char *key, size_t nkey, item *it){
-    int ret;
-    DBT dbkey, dbdata;
+/* drops acked leases from lease.list, all in one transaction */
+int bdb_lease_delete(uint64_t *receipts, int nreceipts){
+    DBT dbkey;
     DB_TXN *txn = NULL;
-    queue_rec_t queue_rec;
-    DB *queue_dbp = NULL;
-    db_recno_t recno;
-    u_int32_t max_size = -1;
-
-
-    BDB_CLEANUP_DBT();
-    dbkey.data = &recno;
-    dbkey.ulen = sizeof(recno);
-    dbkey.flags = DB_DBT_USERMEM;
-    dbdata.data = it;
-    dbdata.size = ITEM_ntotal(it);
-
-    char* max_size_str = ITEM_data(it);
-
-    max_size = atoi(max_size_str);
-    if (strlen(max_size_str) < 1 ||
-        *max_size_str < '0' || *max_size_str > '9' || max_size < 0) {
-        if (settings.verbose > 1) {
-            fprintf(stderr, "bdb_add: max_size: %d is not valid!\n", max_size);
-        }
-        ret = -1;
-        goto err;
-    }
+    int i, ret;
 
     ret = envp->txn_begin(envp, NULL, &txn, 0);
     if (ret != 0) {
-        if (settings.verbose > 1) {
-            fprintf(stderr, "bdb_add: %s\n", db_strerror(ret));
-        }
-        ret = -1;
         goto err;
     }
 
-    memset(&queue_rec, 0, sizeof(queue_rec_t));
-    ret = get_queue_db_handle(txn, key, nkey, &queue_rec);
-    if (ret == 0) {
-        ret = -1;
-        goto err;
-    } else if (ret == DB_NOTFOUND) {
-        ret = create_queue_db(txn, key, nkey, &queue_dbp, max_size);
-        if (ret != 0) {
-            if (settings.verbose > 1) {
-                fprintf(stderr, "bdb_add: %s\n", db_strerror(ret));
-            }
-            ret = -1;
+    for (i = 0; i < nreceipts; i++) {
+        memset(&dbkey, 0, sizeof(dbkey));
+        dbkey.data = &receipts[i];
+        dbkey.size = sizeof(receipts[i]);
+        ret = lease_dbp->del(lease_dbp, txn, &dbkey, 0);
+        if (ret != 0 && ret != DB_NOTFOUND) {
             goto err;
         }
-    } else {
-        ret = -1;
-        goto err;
     }
 
     ret = txn->commit(txn, 0);
     if (ret != 0) {
-        if (settings.verbose > 1) {
-            fprintf(stderr, "bdb_add: %s\n", db_strerror(ret));
-        }
-        ret = -1;
         goto err;
     }
-
     return 0;
 err:
     if (txn != NULL){
         txn->abort(txn);
     }
-    return ret;
+    if (settings.verbose > 1) {
+        fprintf(stderr, "bdb_lease_delete: %s\n", db_strerror(ret));
+    }
+    return -1;
 }
 
-/* 0 for Success
-   -1 for SERVER_ERROR
-*/
-int bdb_put(char *key, size_t nkey, item *it){
-    int ret;
+/*
+ * Puts an expired lease's message back at the tail of its queue and drops
+ * the lease. The queue's size limit is not applied: the message was
+ * already admitted once. If the queue was deleted meanwhile, the message
+ * goes with it.
+ */
+int bdb_lease_redeliver(uint64_t receipt, item *it){
     DBT dbkey, dbdata;
     DB_TXN *txn = NULL;
     queue_rec_t queue_rec;
-    DB *queue_dbp = NULL;
-    unsigned int queue_size;
-    db_recno_t recno;
-
-    BDB_CLEANUP_DBT();
-    dbkey.data = &recno;
-    dbkey.ulen = sizeof(recno);
-    dbkey.flags = DB_DBT_USERMEM;
-    dbdata.data = it;
-    dbdata.size = ITEM_ntotal(it);
+    int ret;
 
+    memset(&queue_rec, 0, sizeof(queue_rec_t));
     ret = envp->txn_begin(envp, NULL, &txn, 0);
     if (ret != 0) {
         goto err;
     }
 
-    memset(&queue_rec, 0, sizeof(queue_rec_t));
-    ret = get_queue_db_handle(txn, key, nkey, &queue_rec);
-
-    if (ret != 0){
-        if (txn != NULL){
-            txn->abort(txn);
-        }
-        if (settings.verbose > 1) {
-            fprintf(stderr, "bdb_put: %s\n", db_strerror(ret));
-        }
-        return 1;
-    }
-
-    queue_dbp = queue_rec.queue_dbp;
-
-    if (queue_rec.max_size && (queue_rec.size + 1 > queue_rec.max_size)) {
-        if (txn != NULL){
-            txn->abort(txn);
+    ret = get_queue_db_handle(txn, ITEM_key(it), it->nkey, &queue_rec);
+    if (ret == 0) {
+        ret = queue_append(txn, &queue_rec, it);
+        if (ret != 0) {
+            goto err;
         }
-        if (settings.verbose > 1) {
-            fprintf(stderr, "bdb_put: queue size limited %d\n", queue_rec.max_size);
+        if (queue_rec.max_size) {
+            UPDATE_QUEUE_LENGTH_LOCK();
+            ret = update_queue_length(txn, ITEM_key(it), it->nkey, 1);
+            UPDATE_QUEUE_LENGTH_UNLOCK();
+            if (ret != 0) {
+                goto err;
+            }
         }
-        return -1;
-    }
-
-    ret = queue_dbp->put(queue_dbp, txn, &dbkey, &dbdata, DB_APPEND);
-    if (ret != 0) {
+    } else if (ret != DB_NOTFOUND) {
         goto err;
     }
 
-    if (queue_rec.max_size) {
-        UPDATE_QUEUE_LENGTH_LOCK();
-        ret = update_queue_length(txn, key, nkey, 1);
-        UPDATE_QUEUE_LENGTH_UNLOCK();
-        if (ret != 0) {
-            goto err;
-        }
+    BDB_CLEANUP_DBT();
+    dbkey.data = &receipt;
+    dbkey.size = sizeof(receipt);
+    ret = lease_dbp->del(lease_dbp, txn, &dbkey, 0);
+    if (ret != 0 && ret != DB_NOTFOUND) {
+        goto err;
     }
 
     ret = txn->commit(txn, 0);
     if (ret != 0) {
         goto err;
     }
-
+    put_queue_db_handle(ITEM_key(it), it->nkey, &queue_rec);
     return 0;
 err:
     if (txn != NULL){
         txn->abort(txn);
     }
+    put_queue_db_handle(ITEM_key(it), it->nkey, &queue_rec);
     if (settings.verbose > 1) {
-        fprintf(stderr, "bdb_put: %s\n", db_strerror(ret));
+        fprintf(stderr, "bdb_lease_redeliver: %s\n", db_strerror(ret));
     }
     return -1;
 }
 
 void start_chkpoint_thread(void){
-    if (bdb_settings.chkpoint_val > 0){
+    /* with -F alone it archives after the checkpoints db_checkpoint takes */
+    if (bdb_settings.chkpoint_val > 0 || bdb_settings.chkpoint_kbyte > 0 ||
+        bdb_settings.chkpoint_recovery > 0 || bdb_settings.log_retain >= 0){
         /* Start a checkpoint thread. */
         if ((errno = pthread_create(
             &chk_ptid, NULL, bdb_chkpoint_thread, (void *)envp)) != 0) {
@@ -872,39 +2608,370 @@ void start_dl_detect_thread(void){
     }
 }
 
+/*
+ * Checkpoints are taken when due: -C seconds after the last one, once -k
+ * kbytes of log were written since, or once recovery, which replays the
+ * log from the last checkpoint, would take an estimated -Y seconds. The
+ * estimate assumes replaying goes at the rate the last checkpoint wrote
+ * back what the log before it had dirtied. While requests are slower than
+ * usual a checkpoint would only add to it, so the limits are doubled
+ * until they are back to normal. Commands are timed as they are parsed,
+ * but the BDB work of set and add comes once their data is read, so the
+ * commits of both gets and puts are watched as well.
+ */
+
+#define CHKPOINT_BUSY_FACTOR 4          /* a second's p99 this many times the usual one */
+#define CHKPOINT_BUSY_MIN_NS 1000000    /* and at least 1ms, is slower than usual */
+
+static const int chkpoint_busy_phases[] = {
+    LATENCY_PROCESS_COMMAND, LATENCY_GET_COMMIT, LATENCY_PUT_COMMIT
+};
+#define CHKPOINT_BUSY_PHASES (int)(sizeof(chkpoint_busy_phases) / sizeof(chkpoint_busy_phases[0]))
+
+static pthread_mutex_t chkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    uint64_t count;
+    uint64_t deferred;          /* seconds a due checkpoint was put off */
+    time_t last_time;
+    uint64_t last_usec;
+    uint64_t replay_usec;       /* the time and log bytes of the last one */
+    uint64_t replay_distance;   /* that found any log, for the estimate */
+} chkpoint_stats;
+
+/* log bytes from the LSN of the last checkpoint to the end of the log */
+static uint64_t chkpoint_lsn_distance(const DB_LSN *ckp, const DB_LOG_STAT *log_stat) {
+    int64_t d;
+    u_int32_t file = ckp->file, offset = ckp->offset;
+
+    if (file == 0) {
+        file = 1;   /* no checkpoint yet: all of the log */
+        offset = 0;
+    }
+    d = ((int64_t)log_stat->st_cur_file - file) * log_stat->st_lg_size
+        + log_stat->st_cur_offset - offset;
+    return d > 0 ? (uint64_t)d : 0;
+}
+
+/* what is due, or NULL; the limits are scale times as high */
+static const char *chkpoint_due(time_t elapsed, uint64_t distance, uint64_t estimate_usec, int scale) {
+    if (bdb_settings.chkpoint_val > 0 && elapsed >= (time_t)bdb_settings.chkpoint_val * scale)
+        return "interval";
+    if (bdb_settings.chkpoint_kbyte > 0 && distance >= (uint64_t)bdb_settings.chkpoint_kbyte * 1024 * scale)
+        return "log";
+    if (bdb_settings.chkpoint_recovery > 0 &&
+        estimate_usec >= (uint64_t)bdb_settings.chkpoint_recovery * 1000000 * scale)
+        return "recovery";
+    return NULL;
+}
+
+/*
+ * Log archiving, after each checkpoint when -F is given, whether the
+ * checkpoint thread took it or a client with db_checkpoint: of the log files
+ * no longer needed for recovery, all but the newest -F are copied to -X,
+ * if given, and removed. What is left is added up for "stats bdb".
+ */
+
+static struct {
+    uint64_t files;             /* log files left after the last pass */
+    uint64_t bytes;
+    uint64_t removed_files;     /* in all */
+    uint64_t removed_bytes;
+    uint64_t copied_files;
+    uint64_t copied_bytes;
+    uint64_t errors;
+} archive_stats;                /* under chkpoint_lock */
+
+static int log_name_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* copies path into dir under the same name, through a temporary file */
+static int log_archive_copy(const char *path, const char *dir) {
+    char to[1024], tmp[1024], buf[65536];
+    const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    ssize_t n = 0;
+    int in, out, ret = 0;
+
+    if ((size_t)snprintf(to, sizeof(to), "%s/%s", dir, name) >= sizeof(to) ||
+        (size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", to) >= sizeof(tmp))
+        return ENAMETOOLONG;
+    if ((in = open(path, O_RDONLY)) < 0)
+        return errno;
+    if ((out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0640)) < 0) {
+        ret = errno;
+        close(in);
+        return ret;
+    }
+    errno = 0;
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        if (write(out, buf, n) != n) {
+            n = -1;
+            break;
+        }
+    }
+    if (n < 0 || fsync(out) != 0)
+        ret = errno ? errno : EIO;
+    close(in);
+    if (close(out) != 0 && ret == 0)
+        ret = errno;
+    if (ret == 0 && rename(tmp, to) != 0)
+        ret = errno;
+    if (ret != 0)
+        unlink(tmp);
+    return ret;
+}
+
+static void bdb_log_archive(DB_ENV *dbenv) {
+    char **list = NULL, **p;
+    struct stat st;
+    uint64_t files = 0, bytes = 0, removed_files = 0, removed_bytes = 0;
+    uint64_t copied_files = 0, copied_bytes = 0, errors = 0;
+    int ret, n = 0, i;
+
+    if ((ret = dbenv->log_archive(dbenv, &list, DB_ARCH_ABS)) != 0) {
+        dbenv->err(dbenv, ret, "log_archive");
+        errors++;
+        list = NULL;
+    }
+    if (list != NULL) {
+        for (p = list; *p != NULL; p++)
+            n++;
+        qsort(list, n, sizeof(char *), log_name_cmp);
+        for (i = 0; i < n - bdb_settings.log_retain; i++) {
+            if (stat(list[i], &st) != 0)
+                st.st_size = 0;
+            if (bdb_settings.log_archive_dir != NULL) {
+                if ((ret = log_archive_copy(list[i], bdb_settings.log_archive_dir)) != 0) {
+                    fprintf(stderr, "log_archive: copying %s to %s: %s\n", list[i],
+                            bdb_settings.log_archive_dir, strerror(ret));
+                    errors++;
+                    break;  /* and keep the rest, in order */
+                }
+                copied_files++;
+                copied_bytes += st.st_size;
+            }
+            if (unlink(list[i]) != 0) {
+                fprintf(stderr, "log_archive: removing %s: %s\n", list[i], strerror(errno));
+                errors++;
+                break;
+            }
+            removed_files++;
+            removed_bytes += st.st_size;
+            if (settings.verbose > 1) {
+                fprintf(stderr, "log_archive: %s %s\n", bdb_settings.log_archive_dir != NULL ?
+                        "archived" : "removed", list[i]);
+            }
+        }
+        free(list);
+        list = NULL;
+    }
+
+    if ((ret = dbenv->log_archive(dbenv, &list, DB_ARCH_ABS | DB_ARCH_LOG)) == 0) {
+        if (list != NULL) {
+            for (p = list; *p != NULL; p++) {
+                if (stat(*p, &st) == 0) {
+                    files++;
+                    bytes += st.st_size;
+                }
+            }
+            free(list);
+        }
+    } else {
+        dbenv->err(dbenv, ret, "log_archive");
+        errors++;
+    }
+
+    pthread_mutex_lock(&chkpoint_lock);
+    archive_stats.files = files;
+    archive_stats.bytes = bytes;
+    archive_stats.removed_files += removed_files;
+    archive_stats.removed_bytes += removed_bytes;
+    archive_stats.copied_files += copied_files;
+    archive_stats.copied_bytes += copied_bytes;
+    archive_stats.errors += errors;
+    pthread_mutex_unlock(&chkpoint_lock);
+}
+
 static void *bdb_chkpoint_thread(void *arg)
 {
     DB_ENV *dbenv;
-    int ret;
+    DB_LOG_STAT *log_stat;
+    DB_TXN_STAT *txn_stat;
+    DB_LSN ckp, archived;
+    uint64_t distance, estimate_usec, p99, start, usec;
+    uint64_t usual[CHKPOINT_BUSY_PHASES] = {0};
+    time_t last = time(NULL);
+    const char *due;
+    bool busy;
+    int ret, i;
     dbenv = arg;
     if (settings.verbose > 1) {
-        dbenv->errx(dbenv, "checkpoint thread created: %lu, every %d seconds",
-                           (u_long)pthread_self(), bdb_settings.chkpoint_val);
-    }
-    for (;; sleep(bdb_settings.chkpoint_val)) {
+        dbenv->errx(dbenv, "checkpoint thread created: %lu, every %d seconds, %u kbytes of log or %d seconds of recovery",
+                           (u_long)pthread_self(), bdb_settings.chkpoint_val,
+                           bdb_settings.chkpoint_kbyte, bdb_settings.chkpoint_recovery);
+    }
+    for (i = 0; i < CHKPOINT_BUSY_PHASES; i++)
+        latency_window(chkpoint_busy_phases[i], 0.99);
+    memset(&archived, 0, sizeof(archived));
+    for (;; sleep(1)) {
+        /* busy when any of them is slower than usual */
+        busy = false;
+        for (i = 0; i < CHKPOINT_BUSY_PHASES; i++) {
+            p99 = latency_window(chkpoint_busy_phases[i], 0.99);
+            if (usual[i] > 0 && p99 > usual[i] * CHKPOINT_BUSY_FACTOR && p99 > CHKPOINT_BUSY_MIN_NS)
+                busy = true;
+            else if (p99 > 0)
+                usual[i] = usual[i] == 0 ? p99 : usual[i] - usual[i] / 16 + p99 / 16;
+        }
+
+        distance = 0;
+        log_stat = NULL;
+        txn_stat = NULL;
+        if ((ret = dbenv->log_stat(dbenv, &log_stat, 0)) == 0 &&
+            (ret = dbenv->txn_stat(dbenv, &txn_stat, 0)) == 0) {
+            distance = chkpoint_lsn_distance(&txn_stat->st_last_ckp, log_stat);
+            ckp = txn_stat->st_last_ckp;
+        } else {
+            dbenv->err(dbenv, ret, "checkpoint thread");
+            ckp = archived;
+        }
+        free(log_stat);
+        free(txn_stat);
+
+        /* a checkpoint was taken since the last pass, by us or by a client */
+        if (bdb_settings.log_retain >= 0 &&
+            (ckp.file != archived.file || ckp.offset != archived.offset)) {
+            bdb_log_archive(dbenv);
+            archived = ckp;
+        }
+
+        pthread_mutex_lock(&chkpoint_lock);
+        /* with nothing to go by, the first checkpoint is taken to measure */
+        estimate_usec = chkpoint_stats.replay_distance > 0 ?
+            distance * chkpoint_stats.replay_usec / chkpoint_stats.replay_distance :
+            (distance > 0 ? UINT64_MAX : 0);
+        due = chkpoint_due(time(NULL) - last, distance, estimate_usec, busy ? 2 : 1);
+        if (due == NULL && busy && chkpoint_due(time(NULL) - last, distance, estimate_usec, 1) != NULL)
+            chkpoint_stats.deferred++;
+        pthread_mutex_unlock(&chkpoint_lock);
+        if (due == NULL)
+            continue;
+
+        start = latency_now();
         if ((ret = dbenv->txn_checkpoint(dbenv, 0, 0, 0)) != 0) {
             dbenv->err(dbenv, ret, "checkpoint thread");
+            continue;
+        }
+        usec = (latency_now() - start) / 1000;
+        last = time(NULL);
+
+        pthread_mutex_lock(&chkpoint_lock);
+        chkpoint_stats.count++;
+        chkpoint_stats.last_time = last;
+        chkpoint_stats.last_usec = usec;
+        if (distance > 0) {
+            chkpoint_stats.replay_usec = usec;
+            chkpoint_stats.replay_distance = distance;
+        }
+        pthread_mutex_unlock(&chkpoint_lock);
+        if (settings.verbose > 1) {
+            dbenv->errx(dbenv, "checkpoint thread: txn_checkpoint (%s) of %llu log bytes took %llu usec",
+                        due, (unsigned long long)distance, (unsigned long long)usec);
         }
-        dbenv->errx(dbenv, "checkpoint thread: a txn_checkpoint is done");
     }
     return (NULL);
 }
 
+/*
+ * The trickle thread keeps -e percent of the cache clean, and more when
+ * that is not enough. Each round it looks at how many dirty pages had to
+ * be written out to make room since the last: every one of them held up
+ * a request. If there were any, the clean target goes up and the rounds
+ * come twice as often. Otherwise, more dirty pages than the target allows
+ * mean the rounds are too far apart, and fewer let both ease back towards
+ * -e and -T.
+ */
+
+#define TRICKLE_MIN_MSEC 100        /* the shortest round */
+#define TRICKLE_STEP 5              /* percent the target goes up by */
+#define TRICKLE_MAX_PERCENT 95
+
+static pthread_mutex_t trickle_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    int percent;                /* the clean target now */
+    int msec;                   /* the round now */
+    uint64_t rounds;
+    uint64_t pages;             /* written, in all */
+    int last_pages;             /* written in the last round */
+} trickle_stats;
+
 static void *bdb_memp_trickle_thread(void *arg)
 {
     DB_ENV *dbenv;
-    int ret, nwrotep;
+    DB_MPOOL_STAT *mpool_stat;
+    struct timeval t;
+    uint64_t evicted, last_evicted = 0;
+    int ret, nwrotep, base, percent, msec, max_msec;
+    bool calm;
     dbenv = arg;
+    base = percent = bdb_settings.memp_trickle_percent;
+    max_msec = msec = bdb_settings.memp_trickle_val * 1000;
     if (settings.verbose > 1) {
         dbenv->errx(dbenv, "memp_trickle thread created: %lu, every %d seconds, %d%% pages should be clean.",
                            (u_long)pthread_self(), bdb_settings.memp_trickle_val,
                            bdb_settings.memp_trickle_percent);
     }
-    for (;; sleep(bdb_settings.memp_trickle_val)) {
-        if ((ret = dbenv->memp_trickle(dbenv, bdb_settings.memp_trickle_percent, &nwrotep)) != 0) {
+    if (dbenv->memp_stat(dbenv, &mpool_stat, NULL, 0) == 0) {
+        last_evicted = mpool_stat->st_rw_evict;
+        free(mpool_stat);
+    }
+    pthread_mutex_lock(&trickle_lock);
+    trickle_stats.percent = percent;
+    trickle_stats.msec = msec;
+    pthread_mutex_unlock(&trickle_lock);
+    while (!daemon_quit) {
+        t.tv_sec = msec / 1000;
+        t.tv_usec = (msec % 1000) * 1000;
+        (void)select(0, NULL, NULL, NULL, &t);
+
+        if ((ret = dbenv->memp_stat(dbenv, &mpool_stat, NULL, 0)) != 0) {
+            dbenv->err(dbenv, ret, "memp_trickle thread");
+            continue;
+        }
+        evicted = mpool_stat->st_rw_evict - last_evicted;
+        last_evicted = mpool_stat->st_rw_evict;
+        calm = (uint64_t)mpool_stat->st_page_dirty * 100 <= (uint64_t)mpool_stat->st_pages * (100 - percent);
+        free(mpool_stat);
+
+        if (evicted > 0) {
+            percent = percent + TRICKLE_STEP < TRICKLE_MAX_PERCENT ? percent + TRICKLE_STEP : TRICKLE_MAX_PERCENT;
+            if (percent < base)
+                percent = base;
+            msec = msec / 2 > TRICKLE_MIN_MSEC ? msec / 2 : TRICKLE_MIN_MSEC;
+        } else if (calm) {
+            if (percent > base)
+                percent--;
+            msec = msec + msec / 4 < max_msec ? msec + msec / 4 : max_msec;
+        } else {
+            msec = msec * 3 / 4 > TRICKLE_MIN_MSEC ? msec * 3 / 4 : TRICKLE_MIN_MSEC;
+        }
+
+        nwrotep = 0;
+        if ((ret = dbenv->memp_trickle(dbenv, percent, &nwrotep)) != 0) {
             dbenv->err(dbenv, ret, "memp_trickle thread");
         }
-        dbenv->errx(dbenv, "memp_trickle thread: writing %d dirty pages", nwrotep);
+
+        pthread_mutex_lock(&trickle_lock);
+        trickle_stats.percent = percent;
+        trickle_stats.msec = msec;
+        trickle_stats.rounds++;
+        trickle_stats.pages += nwrotep;
+        trickle_stats.last_pages = nwrotep;
+        pthread_mutex_unlock(&trickle_lock);
+        if (settings.verbose > 1) {
+            dbenv->errx(dbenv, "memp_trickle thread: writing %d dirty pages, %d%% clean, %llu dirty evictions, next in %d ms",
+                        nwrotep, percent, (unsigned long long)evicted, msec);
+        }
     }
     return (NULL);
 }
@@ -956,6 +3023,117 @@ static void bdb_msg_callback(const DB_ENV *dbenv, const char *msg){
 	fprintf(stderr, "[%s] [%s] \"%s\"\n", PACKAGE, time_str, msg);
 }
 
+/*
+ * Live numbers of the environment for "stats bdb": cache, log, locks,
+ * transactions, trickle writes, checkpoints, deleted queues and open
+ * queue handles, as "STAT name value" lines. A subsystem whose stat call
+ * fails is left out. Returns the bytes written to buf, which must hold
+ * BDB_ENV_STATS_SIZE.
+ */
+int print_bdb_env_stats(char *buf){
+    DB_MPOOL_STAT *mpool_stat = NULL;
+    DB_LOG_STAT *log_stat = NULL;
+    DB_LOCK_STAT *lock_stat = NULL;
+    DB_TXN_STAT *txn_stat = NULL;
+    uint64_t hits, misses;
+    char *pos = buf;
+    int ret;
+
+    if ((ret = envp->memp_stat(envp, &mpool_stat, NULL, 0)) == 0) {
+        hits = mpool_stat->st_cache_hit;
+        misses = mpool_stat->st_cache_miss;
+        pos += sprintf(pos, "STAT cache_hits %llu\r\n", (unsigned long long)hits);
+        pos += sprintf(pos, "STAT cache_misses %llu\r\n", (unsigned long long)misses);
+        pos += sprintf(pos, "STAT cache_hit_ratio %.4f\r\n",
+                       hits + misses ? (double)hits / (hits + misses) : 0.0);
+        pos += sprintf(pos, "STAT cache_pages %u\r\n", (unsigned int)mpool_stat->st_pages);
+        pos += sprintf(pos, "STAT cache_dirty_pages %u\r\n", (unsigned int)mpool_stat->st_page_dirty);
+        pos += sprintf(pos, "STAT cache_evicted_clean %llu\r\n", (unsigned long long)mpool_stat->st_ro_evict);
+        pos += sprintf(pos, "STAT cache_evicted_dirty %llu\r\n", (unsigned long long)mpool_stat->st_rw_evict);
+        pos += sprintf(pos, "STAT cache_pages_read %llu\r\n", (unsigned long long)mpool_stat->st_page_in);
+        pos += sprintf(pos, "STAT cache_pages_written %llu\r\n", (unsigned long long)mpool_stat->st_page_out);
+        pos += sprintf(pos, "STAT cache_pages_trickled %llu\r\n", (unsigned long long)mpool_stat->st_page_trickle);
+        free(mpool_stat);
+    } else if (settings.verbose > 1) {
+        fprintf(stderr, "envp->memp_stat: %s\n", db_strerror(ret));
+    }
+
+    if ((ret = envp->log_stat(envp, &log_stat, 0)) == 0) {
+        pos += sprintf(pos, "STAT log_bytes_written %llu\r\n",
+                       (unsigned long long)log_stat->st_w_mbytes * 1024 * 1024 + log_stat->st_w_bytes);
+        pos += sprintf(pos, "STAT log_writes %llu\r\n", (unsigned long long)log_stat->st_wcount);
+        pos += sprintf(pos, "STAT log_flushes %llu\r\n", (unsigned long long)log_stat->st_scount);
+        pos += sprintf(pos, "STAT log_current_file %u\r\n", (unsigned int)log_stat->st_cur_file);
+    } else if (settings.verbose > 1) {
+        fprintf(stderr, "envp->log_stat: %s\n", db_strerror(ret));
+    }
+
+    if ((ret = envp->lock_stat(envp, &lock_stat, 0)) == 0) {
+        pos += sprintf(pos, "STAT curr_locks %u\r\n", (unsigned int)lock_stat->st_nlocks);
+        pos += sprintf(pos, "STAT lock_waits %llu\r\n", (unsigned long long)lock_stat->st_lock_wait);
+        pos += sprintf(pos, "STAT lock_nowaits %llu\r\n", (unsigned long long)lock_stat->st_lock_nowait);
+        pos += sprintf(pos, "STAT lock_deadlocks %llu\r\n", (unsigned long long)lock_stat->st_ndeadlocks);
+        pos += sprintf(pos, "STAT lock_timeouts %llu\r\n", (unsigned long long)lock_stat->st_nlocktimeouts);
+        free(lock_stat);
+    } else if (settings.verbose > 1) {
+        fprintf(stderr, "envp->lock_stat: %s\n", db_strerror(ret));
+    }
+
+    if ((ret = envp->txn_stat(envp, &txn_stat, 0)) == 0) {
+        pos += sprintf(pos, "STAT txn_active %u\r\n", (unsigned int)txn_stat->st_nactive);
+        pos += sprintf(pos, "STAT txn_max_active %u\r\n", (unsigned int)txn_stat->st_maxnactive);
+        pos += sprintf(pos, "STAT txn_begins %llu\r\n", (unsigned long long)txn_stat->st_nbegins);
+        pos += sprintf(pos, "STAT txn_commits %llu\r\n", (unsigned long long)txn_stat->st_ncommits);
+        pos += sprintf(pos, "STAT txn_aborts %llu\r\n", (unsigned long long)txn_stat->st_naborts);
+        if (log_stat != NULL) {
+            pos += sprintf(pos, "STAT chkpoint_lsn_distance %llu\r\n",
+                           (unsigned long long)chkpoint_lsn_distance(&txn_stat->st_last_ckp, log_stat));
+        }
+        free(txn_stat);
+    } else if (settings.verbose > 1) {
+        fprintf(stderr, "envp->txn_stat: %s\n", db_strerror(ret));
+    }
+    free(log_stat);
+
+    pthread_mutex_lock(&trickle_lock);
+    pos += sprintf(pos, "STAT trickle_percent %d\r\n", trickle_stats.percent);
+    pos += sprintf(pos, "STAT trickle_interval_msec %d\r\n", trickle_stats.msec);
+    pos += sprintf(pos, "STAT trickle_rounds %llu\r\n", (unsigned long long)trickle_stats.rounds);
+    pos += sprintf(pos, "STAT trickle_pages %llu\r\n", (unsigned long long)trickle_stats.pages);
+    pos += sprintf(pos, "STAT trickle_last_pages %d\r\n", trickle_stats.last_pages);
+    pthread_mutex_unlock(&trickle_lock);
+
+    pthread_mutex_lock(&chkpoint_lock);
+    pos += sprintf(pos, "STAT chkpoints %llu\r\n", (unsigned long long)chkpoint_stats.count);
+    pos += sprintf(pos, "STAT chkpoint_deferred %llu\r\n", (unsigned long long)chkpoint_stats.deferred);
+    pos += sprintf(pos, "STAT chkpoint_last_time %lu\r\n", (unsigned long)chkpoint_stats.last_time);
+    pos += sprintf(pos, "STAT chkpoint_last_usec %llu\r\n", (unsigned long long)chkpoint_stats.last_usec);
+    if (bdb_settings.log_retain >= 0) {
+        pos += sprintf(pos, "STAT log_files %llu\r\n", (unsigned long long)archive_stats.files);
+        pos += sprintf(pos, "STAT log_disk_bytes %llu\r\n", (unsigned long long)archive_stats.bytes);
+        pos += sprintf(pos, "STAT log_removed_files %llu\r\n", (unsigned long long)archive_stats.removed_files);
+        pos += sprintf(pos, "STAT log_removed_bytes %llu\r\n", (unsigned long long)archive_stats.removed_bytes);
+        pos += sprintf(pos, "STAT log_archived_files %llu\r\n", (unsigned long long)archive_stats.copied_files);
+        pos += sprintf(pos, "STAT log_archived_bytes %llu\r\n", (unsigned long long)archive_stats.copied_bytes);
+        pos += sprintf(pos, "STAT log_archive_errors %llu\r\n", (unsigned long long)archive_stats.errors);
+    }
+    pthread_mutex_unlock(&chkpoint_lock);
+
+    pthread_mutex_lock(&reap_lock);
+    pos += sprintf(pos, "STAT deleted_queues_pending %u\r\n", reap_stats.pending);
+    pos += sprintf(pos, "STAT deleted_queues_reclaimed %llu\r\n", (unsigned long long)reap_stats.reclaimed);
+    pthread_mutex_unlock(&reap_lock);
+
+    pthread_mutex_lock(&queue_lru_lock);
+    pos += sprintf(pos, "STAT open_queues %u\r\n", queue_lru_stats.open);
+    pos += sprintf(pos, "STAT queue_handle_hits %llu\r\n", (unsigned long long)queue_lru_stats.hits);
+    pos += sprintf(pos, "STAT queue_handle_misses %llu\r\n", (unsigned long long)queue_lru_stats.misses);
+    pos += sprintf(pos, "STAT queue_handle_evictions %llu\r\n", (unsigned long long)queue_lru_stats.evictions);
+    pthread_mutex_unlock(&queue_lru_lock);
+
+    return pos - buf;
+}
+
 /* for atexit cleanup */
 void bdb_chkpoint(void)
 {
@@ -974,6 +3152,28 @@ void bdb_chkpoint(void)
 void bdb_db_close(void){
     int ret = 0;
 
+    /* close the chunk db */
+    if (chunk_dbp != NULL) {
+        ret = chunk_dbp->close(chunk_dbp, 0);
+        if (0 != ret){
+            fprintf(stderr, "chunk_dbp->close: %s\n", db_strerror(ret));
+        }else{
+            chunk_dbp = NULL;
+            fprintf(stderr, "chunk_dbp->close: OK\n");
+        }
+    }
+
+    /* close the lease db */
+    if (lease_dbp != NULL) {
+        ret = lease_dbp->close(lease_dbp, 0);
+        if (0 != ret){
+            fprintf(stderr, "lease_dbp->close: %s\n", db_strerror(ret));
+        }else{
+            lease_dbp = NULL;
+            fprintf(stderr, "lease_dbp->close: OK\n");
+        }
+    }
+
     /* close the queue list db */
     if (qlist_dbp != NULL) {
         close_queue_db_list();
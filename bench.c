@@ -0,0 +1,493 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *  MemcacheQ - Simple Queue Service over Memcache
+ *
+ *      http://memcacheq.googlecode.com
+ *
+ *  Copyright 2008 Steve Chu.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ *  mcq-bench: drives a running memcacheq with producer connections that
+ *  set and consumer connections that get, one thread per connection, and
+ *  reports their throughput and latency percentiles.
+ *
+ *  Every connection keeps <depth> commands in flight: it writes them
+ *  together, then reads their responses, and a command's latency runs
+ *  from the write to its own response.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_SAMPLES 65536     /* latencies kept per connection, for percentiles */
+#define BENCH_RBUF_SIZE 65536
+
+typedef struct {
+    const char *host;
+    const char *port;
+    int producers;
+    int consumers;
+    int queues;
+    const char *prefix;     /* queues are <prefix>0, <prefix>1, ... */
+    int msg_size;
+    int depth;              /* commands in flight per connection */
+    int batch;              /* queue names per get */
+    int seconds;
+    bool compress;
+} bench_config_t;
+
+static bench_config_t config = {
+    "127.0.0.1", "22201", 4, 4, 1, "bench", 1024, 1, 1, 10, false
+};
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    bool producer;
+    int fd;
+    char *rbuf;
+    int rstart, rend;
+    uint64_t ops;           /* commands answered */
+    uint64_t msgs;          /* messages stored or fetched */
+    uint64_t empty;         /* gets that found nothing */
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t nsamples;      /* latencies seen, some dropped from samples */
+    uint32_t *samples;      /* ns, a uniform sample of all the latencies */
+    unsigned int seed;
+} bench_conn_t;
+
+static volatile bool bench_stop;
+
+static uint64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bench_connect(void) {
+    struct addrinfo hints, *ai;
+    int fd, error, flag = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    error = getaddrinfo(config.host, config.port, &hints, &ai);
+    if (error != 0) {
+        fprintf(stderr, "getaddrinfo(): %s\n", gai_strerror(error));
+        return -1;
+    }
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == -1 || connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+        perror("connect()");
+        if (fd != -1)
+            close(fd);
+        freeaddrinfo(ai);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    freeaddrinfo(ai);
+    return fd;
+}
+
+static int bench_write(const int fd, const char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* makes sure n bytes are buffered from rstart on */
+static int bench_fill(bench_conn_t *bc, const int n) {
+    ssize_t got;
+
+    if (bc->rend - bc->rstart >= n)
+        return 0;
+    if (bc->rstart > 0) {
+        memmove(bc->rbuf, bc->rbuf + bc->rstart, bc->rend - bc->rstart);
+        bc->rend -= bc->rstart;
+        bc->rstart = 0;
+    }
+    while (bc->rend < n) {
+        got = read(bc->fd, bc->rbuf + bc->rend, BENCH_RBUF_SIZE - bc->rend);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        bc->rend += got;
+    }
+    return 0;
+}
+
+/* the next line, \r\n cut off, or NULL if the connection broke */
+static char *bench_line(bench_conn_t *bc) {
+    char *line, *el;
+    int n = 0;
+
+    for (;;) {
+        el = memchr(bc->rbuf + bc->rstart + n, '\n', bc->rend - bc->rstart - n);
+        if (el != NULL)
+            break;
+        n = bc->rend - bc->rstart;
+        if (n >= BENCH_RBUF_SIZE - 1 || bench_fill(bc, n + 1) != 0)
+            return NULL;
+    }
+    line = bc->rbuf + bc->rstart;
+    bc->rstart = el - bc->rbuf + 1;
+    if (el > line && el[-1] == '\r')
+        el--;
+    *el = '\0';
+    return line;
+}
+
+/* skips n bytes of data, which may be more than rbuf holds */
+static int bench_skip(bench_conn_t *bc, int n) {
+    int chunk;
+
+    while (n > 0) {
+        chunk = n < BENCH_RBUF_SIZE ? n : BENCH_RBUF_SIZE;
+        if (bench_fill(bc, chunk) != 0)
+            return -1;
+        bc->rstart += chunk;
+        n -= chunk;
+    }
+    return 0;
+}
+
+/* reservoir sampling keeps the percentiles fair however long the run */
+static void bench_sample(bench_conn_t *bc, const uint64_t ns) {
+    uint64_t slot;
+
+    if (bc->nsamples < BENCH_SAMPLES) {
+        slot = bc->nsamples;
+    } else {
+        slot = ((uint64_t)rand_r(&bc->seed) * (RAND_MAX + 1ULL) + rand_r(&bc->seed)) % (bc->nsamples + 1);
+    }
+    if (slot < BENCH_SAMPLES)
+        bc->samples[slot] = ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+    bc->nsamples++;
+}
+
+/* reads one set response, STORED or not */
+static int bench_read_set(bench_conn_t *bc) {
+    char *line = bench_line(bc);
+
+    if (line == NULL)
+        return -1;
+    if (strcmp(line, "STORED") == 0) {
+        bc->msgs++;
+        bc->bytes += config.msg_size;
+    } else {
+        bc->errors++;
+    }
+    return 0;
+}
+
+/* reads one get response: any number of VALUE lines and their data, then END */
+static int bench_read_get(bench_conn_t *bc) {
+    char *line;
+    int hits = 0, nbytes;
+
+    while ((line = bench_line(bc)) != NULL) {
+        if (strcmp(line, "END") == 0) {
+            if (hits == 0)
+                bc->empty++;
+            return 0;
+        }
+        /* VALUE <queue> <flags> <bytes> */
+        if (strncmp(line, "VALUE ", 6) != 0 || sscanf(line, "VALUE %*s %*u %d", &nbytes) != 1) {
+            bc->errors++;
+            return 0;   /* SERVER_ERROR and the like end the response */
+        }
+        if (bench_skip(bc, nbytes + 2) != 0)
+            return -1;
+        hits++;
+        bc->msgs++;
+        bc->bytes += nbytes;
+    }
+    return -1;
+}
+
+static void *bench_worker(void *arg) {
+    bench_conn_t *bc = (bench_conn_t *)arg;
+    char *cmd, *pos, *data = NULL;
+    size_t cmd_size;
+    uint64_t start, now;
+    int queue = bc->id % config.queues;
+    int i, b;
+
+    cmd_size = (size_t)config.depth * (config.msg_size + 64 + (strlen(config.prefix) + 12) * config.batch);
+    cmd = malloc(cmd_size);
+    bc->rbuf = malloc(BENCH_RBUF_SIZE);
+    bc->samples = malloc(sizeof(uint32_t) * BENCH_SAMPLES);
+    if (bc->producer)
+        data = malloc(config.msg_size);
+    if (cmd == NULL || bc->rbuf == NULL || bc->samples == NULL || (bc->producer && data == NULL)) {
+        fprintf(stderr, "malloc()\n");
+        exit(EXIT_FAILURE);
+    }
+    if (data != NULL) {
+        for (i = 0; i < config.msg_size; i++)
+            data[i] = 'a' + rand_r(&bc->seed) % 26;
+    }
+
+    /* the same commands go out every round, so build them once */
+    pos = cmd;
+    for (i = 0; i < config.depth; i++) {
+        if (bc->producer) {
+            pos += sprintf(pos, "set %s%d 0 0 %d\r\n", config.prefix, queue, config.msg_size);
+            memcpy(pos, data, config.msg_size);
+            pos += config.msg_size;
+            pos += sprintf(pos, "\r\n");
+        } else {
+            pos += sprintf(pos, "get");
+            for (b = 0; b < config.batch; b++)
+                pos += sprintf(pos, " %s%d", config.prefix, (queue + b) % config.queues);
+            pos += sprintf(pos, "\r\n");
+        }
+        queue = (queue + 1) % config.queues;
+    }
+
+    while (!bench_stop) {
+        start = bench_now();
+        if (bench_write(bc->fd, cmd, pos - cmd) != 0) {
+            perror("write()");
+            break;
+        }
+        for (i = 0; i < config.depth; i++) {
+            if ((bc->producer ? bench_read_set(bc) : bench_read_get(bc)) != 0) {
+                fprintf(stderr, "connection %d: lost the server\n", bc->id);
+                bench_stop = true;
+                break;
+            }
+            now = bench_now();
+            bench_sample(bc, now - start);
+            bc->ops++;
+        }
+    }
+
+    free(cmd);
+    free(data);
+    return NULL;
+}
+
+static int bench_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* totals and latency percentiles for the producers or the consumers */
+static void bench_report(const char *role, bench_conn_t *conns, const int nconns, const double seconds) {
+    static const double quantiles[] = { 0.50, 0.90, 0.99, 0.999 };
+    uint64_t ops = 0, msgs = 0, empty = 0, errors = 0, bytes = 0;
+    uint32_t *merged;
+    size_t n = 0, i;
+    int c, q;
+
+    if (nconns == 0)
+        return;
+    for (c = 0; c < nconns; c++) {
+        ops += conns[c].ops;
+        msgs += conns[c].msgs;
+        empty += conns[c].empty;
+        errors += conns[c].errors;
+        bytes += conns[c].bytes;
+        n += conns[c].nsamples < BENCH_SAMPLES ? conns[c].nsamples : BENCH_SAMPLES;
+    }
+
+    printf("%-9s %10.0f ops/s %10.0f msgs/s %8.2f MB/s  (%llu ops, %llu empty, %llu errors)\n",
+           role, ops / seconds, msgs / seconds, bytes / seconds / (1024 * 1024),
+           (unsigned long long)ops, (unsigned long long)empty, (unsigned long long)errors);
+    if (n == 0)
+        return;
+
+    merged = malloc(sizeof(uint32_t) * n);
+    if (merged == NULL) {
+        fprintf(stderr, "malloc()\n");
+        return;
+    }
+    /*
+     * Connections kept equal numbers of samples however many ops they
+     * did, which is close enough when they run alike.
+     */
+    for (c = 0, n = 0; c < nconns; c++) {
+        i = conns[c].nsamples < BENCH_SAMPLES ? conns[c].nsamples : BENCH_SAMPLES;
+        memcpy(merged + n, conns[c].samples, sizeof(uint32_t) * i);
+        n += i;
+    }
+    qsort(merged, n, sizeof(uint32_t), bench_cmp);
+
+    printf("%-9s latency usec:", role);
+    for (q = 0; q < 4; q++)
+        printf(" p%g %.1f", quantiles[q] * 100, merged[(size_t)(quantiles[q] * (n - 1))] / 1000.0);
+    printf(" max %.1f\n", merged[n - 1] / 1000.0);
+    free(merged);
+}
+
+/* "add"s every queue; one that exists already is fine */
+static int bench_create_queues(void) {
+    bench_conn_t bc;
+    char cmd[512];
+    int q, len, ret = 0;
+
+    memset(&bc, 0, sizeof(bc));
+    bc.fd = bench_connect();
+    bc.rbuf = malloc(BENCH_RBUF_SIZE);
+    if (bc.fd == -1 || bc.rbuf == NULL)
+        return -1;
+
+    for (q = 0; q < config.queues && ret == 0; q++) {
+        len = snprintf(cmd, sizeof(cmd), "add %s%d 0 0 %d\r\n0%s\r\n", config.prefix, q,
+                       config.compress ? 10 : 1, config.compress ? " compress" : "");
+        if (bench_write(bc.fd, cmd, len) != 0 || bench_line(&bc) == NULL)
+            ret = -1;
+    }
+
+    close(bc.fd);
+    free(bc.rbuf);
+    return ret;
+}
+
+static void usage(void) {
+    printf("Usage: mcq-bench [options]\n"
+           "-s <host>     server to drive, default is 127.0.0.1\n"
+           "-p <num>      its TCP port, default is 22201\n"
+           "-P <num>      producer connections, default is 4\n"
+           "-C <num>      consumer connections, default is 4\n"
+           "-q <num>      number of queues, default is 1\n"
+           "-k <prefix>   queue name prefix, default is 'bench'\n"
+           "-z            create the queues with compress\n"
+           "-b <num>      message size in bytes, default is 1024\n"
+           "-d <num>      commands in flight per connection, default is 1\n"
+           "-g <num>      queues per get, default is 1\n"
+           "-T <num>      seconds to run, default is 10\n"
+           "-h            print this help and exit\n");
+}
+
+int main(int argc, char **argv) {
+    bench_conn_t *conns;
+    uint64_t start;
+    double seconds;
+    int c, i, nconns;
+
+    while ((c = getopt(argc, argv, "s:p:P:C:q:k:zb:d:g:T:h")) != -1) {
+        switch (c) {
+        case 's':
+            config.host = optarg;
+            break;
+        case 'p':
+            config.port = optarg;
+            break;
+        case 'P':
+            config.producers = atoi(optarg);
+            break;
+        case 'C':
+            config.consumers = atoi(optarg);
+            break;
+        case 'q':
+            config.queues = atoi(optarg);
+            break;
+        case 'k':
+            config.prefix = optarg;
+            break;
+        case 'z':
+            config.compress = true;
+            break;
+        case 'b':
+            config.msg_size = atoi(optarg);
+            break;
+        case 'd':
+            config.depth = atoi(optarg);
+            break;
+        case 'g':
+            config.batch = atoi(optarg);
+            break;
+        case 'T':
+            config.seconds = atoi(optarg);
+            break;
+        case 'h':
+            usage();
+            return EXIT_SUCCESS;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (config.producers < 0 || config.consumers < 0 || config.producers + config.consumers == 0
+        || config.queues < 1 || config.msg_size < 1 || config.depth < 1 || config.batch < 1
+        || config.seconds < 1 || strlen(config.prefix) > 200) {
+        fprintf(stderr, "bad option value, see -h\n");
+        return EXIT_FAILURE;
+    }
+
+    if (bench_create_queues() != 0) {
+        fprintf(stderr, "can't create the queues on %s:%s\n", config.host, config.port);
+        return EXIT_FAILURE;
+    }
+
+    nconns = config.producers + config.consumers;
+    conns = calloc(nconns, sizeof(bench_conn_t));
+    if (conns == NULL) {
+        fprintf(stderr, "calloc()\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < nconns; i++) {
+        conns[i].id = i < config.producers ? i : i - config.producers;
+        conns[i].producer = i < config.producers;
+        conns[i].seed = i + 1;
+        conns[i].fd = bench_connect();
+        if (conns[i].fd == -1)
+            return EXIT_FAILURE;
+    }
+
+    start = bench_now();
+    for (i = 0; i < nconns; i++) {
+        if (pthread_create(&conns[i].thread, NULL, bench_worker, &conns[i]) != 0) {
+            perror("pthread_create()");
+            return EXIT_FAILURE;
+        }
+    }
+    sleep(config.seconds);
+    bench_stop = true;
+    for (i = 0; i < nconns; i++)
+        pthread_join(conns[i].thread, NULL);
+    seconds = (bench_now() - start) / 1e9;
+
+    printf("%d producers, %d consumers, %d queues, %d byte messages, depth %d, %d per get, %.1f seconds\n",
+           config.producers, config.consumers, config.queues, config.msg_size,
+           config.depth, config.batch, seconds);
+    bench_report("producer", conns, config.producers, seconds);
+    bench_report("consumer", conns + config.producers, config.consumers, seconds);
+
+    for (i = 0; i < nconns; i++) {
+        close(conns[i].fd);
+        free(conns[i].rbuf);
+        free(conns[i].samples);
+    }
+    free(conns);
+    return EXIT_SUCCESS;
+}
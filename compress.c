@@ -0,0 +1,184 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *  MemcacheQ - Simple Queue Service over Memcache
+ *
+ *      http://memcacheq.googlecode.com
+ *
+ *  Copyright 2008 Steve Chu.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ *  Message compression for queues created with "compress": a greedy LZ77
+ *  with a 4-byte hash and a 64KB window, writing the LZ4 block format, so
+ *  it trades ratio for speed the same way and stored messages can be read
+ *  by any LZ4 block decoder.
+ *
+ */
+
+#include "memcacheq.h"
+#include <string.h>
+
+#define LZ_HASH_LOG 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_LOG)
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5      /* a block ends with this many literals */
+#define LZ_MF_LIMIT 12          /* no match starts this close to the end */
+
+static inline uint32_t lz_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(const uint32_t v) {
+    return (v * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+/* writes a length's overflow past the token's 15 as 255, 255, ..., rest */
+static inline unsigned char *lz_put_length(unsigned char *op, size_t len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/* bytes a sequence may take, for the bounds check */
+#define LZ_SEQ_BOUND(nlit, mlen) (1 + (nlit) / 255 + 1 + (nlit) + 2 + (mlen) / 255 + 1)
+
+/*
+ * Compresses src into dst. Returns the compressed length, or 0 if it
+ * doesn't fit in dst_size, in which case the data is best stored as is.
+ */
+size_t lz_compress(const char *src, const size_t src_size, char *dst, const size_t dst_size) {
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *const oend = op + dst_size;
+    uint32_t table[LZ_HASH_SIZE];
+    size_t ip = 0, anchor = 0, ref, mlen, nlit;
+    uint32_t seq, h;
+
+    memset(table, 0, sizeof(table));
+
+    if (src_size > LZ_MF_LIMIT) {
+        const size_t limit = src_size - LZ_MF_LIMIT;
+        const size_t match_end = src_size - LZ_LAST_LITERALS;
+
+        while (ip < limit) {
+            seq = lz_read32(in + ip);
+            h = lz_hash(seq);
+            ref = table[h];
+            table[h] = (uint32_t)ip;
+
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(in + ref) != seq) {
+                /* step faster through data that doesn't match */
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            for (mlen = LZ_MIN_MATCH; ip + mlen < match_end && in[ref + mlen] == in[ip + mlen]; mlen++)
+                ;
+
+            nlit = ip - anchor;
+            if (LZ_SEQ_BOUND(nlit, mlen) > (size_t)(oend - op))
+                return 0;
+
+            *op++ = (unsigned char)(((nlit < 15 ? nlit : 15) << 4)
+                                    | (mlen - LZ_MIN_MATCH < 15 ? mlen - LZ_MIN_MATCH : 15));
+            if (nlit >= 15)
+                op = lz_put_length(op, nlit - 15);
+            memcpy(op, in + anchor, nlit);
+            op += nlit;
+            *op++ = (unsigned char)((ip - ref) & 0xff);
+            *op++ = (unsigned char)((ip - ref) >> 8);
+            if (mlen - LZ_MIN_MATCH >= 15)
+                op = lz_put_length(op, mlen - LZ_MIN_MATCH - 15);
+
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+
+    /* the rest goes out as literals */
+    nlit = src_size - anchor;
+    if (LZ_SEQ_BOUND(nlit, 0) > (size_t)(oend - op))
+        return 0;
+    *op++ = (unsigned char)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15)
+        op = lz_put_length(op, nlit - 15);
+    memcpy(op, in + anchor, nlit);
+    op += nlit;
+
+    return op - (unsigned char *)dst;
+}
+
+/*
+ * Decompresses src into dst. Every length and offset is checked, so a
+ * damaged block gets -1 rather than a write out of bounds. Returns the
+ * decompressed length.
+ */
+int lz_decompress(const char *src, const size_t src_size, char *dst, const size_t dst_size) {
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *const iend = ip + src_size;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *const ostart = op;
+    unsigned char *const oend = op + dst_size;
+    const unsigned char *match;
+    size_t nlit, mlen, offset;
+    unsigned int token, b;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        nlit = token >> 4;
+        if (nlit == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                nlit += b;
+            } while (b == 255);
+        }
+        if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        if (ip == iend)
+            break;      /* the last sequence has no match */
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - ostart))
+            return -1;
+
+        mlen = token & 15;
+        if (mlen == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (mlen > (size_t)(oend - op))
+            return -1;
+
+        /* the match may overlap what it produces, so copy forward */
+        match = op - offset;
+        if (offset >= mlen) {
+            memcpy(op, match, mlen);
+            op += mlen;
+        } else {
+            while (mlen-- > 0)
+                *op++ = *match++;
+        }
+    }
+
+    return (int)(op - ostart);
+}
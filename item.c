@@ -122,20 +122,31 @@ item *item_alloc1(char *key, const size_t nkey, const int flags, const int nbyte
     char suffix[40];
     size_t ntotal = item_make_header(nkey + 1, flags, nbytes, suffix, &nsuffix);
 
-    if(ntotal > bdb_settings.re_len){
-        return NULL;
-    }
-
-    it = item_from_freelist();
-    if (it == NULL){
-        return NULL;
-    }
-    if (settings.verbose > 1) {
-        fprintf(stderr, "alloc a item buffer from freelist.\n");
+    if (ntotal > bdb_settings.re_len) {
+        /* stored in chunks by bdb_put(), but read in whole first */
+        if (ntotal > ITEM_SIZE_MAX) {
+            return NULL;
+        }
+        it = (item *)malloc(ntotal);
+        if (it == NULL) {
+            return NULL;
+        }
+        if (settings.verbose > 1) {
+            fprintf(stderr, "alloc a large item buffer of %lu bytes.\n", (unsigned long)ntotal);
+        }
+    } else {
+        it = item_from_freelist();
+        if (it == NULL){
+            return NULL;
+        }
+        if (settings.verbose > 1) {
+            fprintf(stderr, "alloc a item buffer from freelist.\n");
+        }
     }
 
     it->nkey = nkey;
     it->nbytes = nbytes;
+    it->it_flags = 0;
     strcpy(ITEM_key(it), key);
     memcpy(ITEM_suffix(it), suffix, (size_t)nsuffix);
     it->nsuffix = nsuffix;
@@ -167,6 +178,12 @@ int item_free(item *it) {
     if (NULL == it)
         return 0;
 
+    /* large items are malloc()ed to size, they don't fit the freelist */
+    if (ITEM_ntotal(it) > bdb_settings.re_len) {
+        free(it);
+        return 0;
+    }
+
     if (0 != item_add_to_freelist(it)) {
         if (settings.verbose > 1) {
             fprintf(stderr, "add a item buffer to freelist fail, use free() directly.\n");
@@ -0,0 +1,221 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *  MemcacheQ - Simple Queue Service over Memcache
+ *
+ *      http://memcacheq.googlecode.com
+ *
+ *  Copyright 2008 Steve Chu.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ *  Latency histograms for "stats latency". Each worker thread records
+ *  into its own set of histograms, one per LATENCY_* phase, without
+ *  locks; readers merge them across threads. Other threads, such as the
+ *  lease thread, record nothing.
+ *
+ *  A histogram is log-linear, as in HdrHistogram: every power of two of
+ *  nanoseconds is split into LATENCY_SUB_BUCKETS equal buckets, so any
+ *  value is reported within 1/LATENCY_SUB_BUCKETS of its size.
+ *
+ */
+
+#include "memcacheq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t counts[LATENCY_PHASES][LATENCY_BUCKETS];
+    uint64_t pending[LATENCY_PHASES];   /* ns since the last latency_take() */
+} latency_thread_t;
+
+static const char *const latency_phase_names[LATENCY_PHASES] = {
+    "process_command",
+    "parse",
+    "transmit",
+    "get_txn_begin",
+    "get_qlist",
+    "get_consume",
+    "get_commit",
+    "put_txn_begin",
+    "put_qlist",
+    "put_append",
+    "put_commit"
+};
+
+static latency_thread_t *latency_threads;
+static int latency_nthreads;
+
+static inline int latency_bucket(const uint64_t ns) {
+    int msb, shift;
+
+    if (ns < LATENCY_SUB_BUCKETS)
+        return (int)ns;
+    msb = 63 - __builtin_clzll(ns);
+    shift = msb - LATENCY_SUB_BITS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS + (int)((ns >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/* the highest value that lands in bucket b */
+static uint64_t latency_bucket_value(const int b) {
+    int shift;
+
+    if (b < LATENCY_SUB_BUCKETS)
+        return b;
+    shift = b / LATENCY_SUB_BUCKETS - 1;
+    return (((uint64_t)(LATENCY_SUB_BUCKETS + b % LATENCY_SUB_BUCKETS) + 1) << shift) - 1;
+}
+
+/* one set of histograms per worker thread, see thread_index() */
+void latency_init(int nthreads) {
+    latency_threads = (latency_thread_t *)calloc(nthreads, sizeof(latency_thread_t));
+    if (latency_threads == NULL) {
+        perror("calloc()");
+        exit(EXIT_FAILURE);
+    }
+    latency_nthreads = nthreads;
+}
+
+/* nanoseconds on a clock that doesn't jump with the time of day */
+uint64_t latency_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Records the time since start for phase. Returns the current time, so
+ * the next phase can start from it without reading the clock again.
+ */
+uint64_t latency_mark(const int phase, const uint64_t start) {
+    uint64_t now = latency_now();
+    int thread;
+
+    if (latency_threads == NULL)
+        return now;     /* before latency_init() */
+    thread = thread_index();
+    if (thread >= 0 && thread < latency_nthreads) {
+        latency_threads[thread].counts[phase][latency_bucket(now > start ? now - start : 0)]++;
+        latency_threads[thread].pending[phase] += now > start ? now - start : 0;
+    }
+    return now;
+}
+
+/*
+ * Hands the calling thread's time per phase since the last call to the
+ * slow log, in ns, and starts over. phases may be NULL to just start over.
+ */
+void latency_take(uint64_t *phases) {
+    int thread = thread_index();
+
+    if (latency_threads == NULL || thread < 0 || thread >= latency_nthreads) {
+        if (phases != NULL)
+            memset(phases, 0, sizeof(uint64_t) * LATENCY_PHASES);
+        return;
+    }
+    if (phases != NULL)
+        memcpy(phases, latency_threads[thread].pending, sizeof(uint64_t) * LATENCY_PHASES);
+    memset(latency_threads[thread].pending, 0, sizeof(uint64_t) * LATENCY_PHASES);
+}
+
+/*
+ * The q quantile, in ns, of what phase recorded since the last call, or 0
+ * if it recorded nothing. The histograms of the last call are kept here,
+ * so there can be only one caller: the checkpoint thread, which looks at
+ * how requests are doing once a second.
+ */
+uint64_t latency_window(const int phase, const double q) {
+    static uint64_t *last;
+    uint64_t n, total = 0, seen = 0, rank;
+    int t, b, found = -1;
+
+    if (latency_threads == NULL)
+        return 0;
+    if (last == NULL) {
+        last = (uint64_t *)calloc(LATENCY_PHASES * LATENCY_BUCKETS, sizeof(uint64_t));
+        if (last == NULL)
+            return 0;
+    }
+    for (b = 0; b < LATENCY_BUCKETS; b++) {
+        for (n = 0, t = 0; t < latency_nthreads; t++)
+            n += latency_threads[t].counts[phase][b];
+        /* after a reset the counts go down: take them as they are */
+        total += n >= last[phase * LATENCY_BUCKETS + b] ? n - last[phase * LATENCY_BUCKETS + b] : n;
+    }
+    rank = (uint64_t)(q * total + 0.5);
+    if (rank == 0)
+        rank = 1;
+    for (b = 0; b < LATENCY_BUCKETS; b++) {
+        for (n = 0, t = 0; t < latency_nthreads; t++)
+            n += latency_threads[t].counts[phase][b];
+        seen += n >= last[phase * LATENCY_BUCKETS + b] ? n - last[phase * LATENCY_BUCKETS + b] : n;
+        last[phase * LATENCY_BUCKETS + b] = n;
+        if (found < 0 && total > 0 && seen >= rank)
+            found = b;
+    }
+    return found < 0 ? 0 : latency_bucket_value(found);
+}
+
+/* lets writers race: a count lost to a reset is of no consequence */
+void latency_reset(void) {
+    if (latency_threads != NULL)
+        memset(latency_threads, 0, sizeof(latency_thread_t) * latency_nthreads);
+}
+
+/*
+ * "STAT <phase>_count", then _p50, _p99 and _p999 in microseconds, for
+ * every phase that has been recorded, then END. Returns a buffer the
+ * caller frees, or NULL when out of memory.
+ */
+char *latency_stats(int *bytes) {
+    static const double quantiles[] = { 0.50, 0.99, 0.999 };
+    static const char *const quantile_names[] = { "p50", "p99", "p999" };
+    uint64_t *merged, total, seen, rank;
+    char *buf, *pos;
+    int phase, t, b, q;
+
+    buf = pos = (char *)malloc(LATENCY_PHASES * 4 * 64 + 8);
+    merged = (uint64_t *)malloc(sizeof(uint64_t) * LATENCY_BUCKETS);
+    if (buf == NULL || merged == NULL) {
+        free(buf);
+        free(merged);
+        return NULL;
+    }
+
+    for (phase = 0; phase < LATENCY_PHASES; phase++) {
+        total = 0;
+        for (b = 0; b < LATENCY_BUCKETS; b++) {
+            merged[b] = 0;
+            for (t = 0; t < latency_nthreads; t++)
+                merged[b] += latency_threads[t].counts[phase][b];
+            total += merged[b];
+        }
+        if (total == 0)
+            continue;
+
+        pos += sprintf(pos, "STAT %s_count %llu\r\n", latency_phase_names[phase],
+                       (unsigned long long)total);
+        for (q = 0, b = 0, seen = 0; q < 3; q++) {
+            rank = (uint64_t)(quantiles[q] * total + 0.5);
+            if (rank == 0)
+                rank = 1;
+            while (seen + merged[b] < rank) {
+                seen += merged[b];
+                b++;
+            }
+            pos += sprintf(pos, "STAT %s_%s %.1f\r\n", latency_phase_names[phase], quantile_names[q],
+                           latency_bucket_value(b) / 1000.0);
+        }
+    }
+    pos += sprintf(pos, "END\r\n");
+    free(merged);
+
+    *bytes = pos - buf;
+    return buf;
+}
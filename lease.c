@@ -0,0 +1,324 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *  MemcacheQ - Simple Queue Service over Memcache
+ *
+ *      http://memcacheq.googlecode.com
+ *
+ *  Copyright 2008 Steve Chu.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ *  Leased dequeue: "lget" hands out a message together with a receipt and
+ *  keeps a copy of it here until "ack <receipt>" or until the lease runs
+ *  out, in which case the message goes back to its queue.
+ *
+ *  Live leases sit in a hash table by receipt and in a timer wheel by
+ *  expiry time. The lease thread turns the wheel every LEASE_TICK_MS,
+ *  redelivers what expired and deletes the acked leases from lease.list
+ *  in one transaction per tick.
+ *
+ */
+
+#include "memcacheq.h"
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define LEASE_TICK_MS 100
+#define LEASE_WHEEL_SLOTS 512         /* one turn of the wheel is 51.2s */
+#define LEASE_HASH_POWER 14
+#define LEASE_HASH_SIZE (1 << LEASE_HASH_POWER)
+#define LEASE_ACKED_INITIAL 256
+
+typedef struct _lease lease_t;
+struct _lease {
+    lease_t  *hnext;          /* hash chain */
+    lease_t  *wnext;          /* timer wheel slot list */
+    lease_t  *wprev;
+    uint64_t receipt;
+    uint64_t expiry;          /* in ms, see lease_now() */
+    int      slot;            /* timer wheel slot the lease is linked to */
+    item     *it;             /* copy of the message, for redelivery */
+};
+
+static pthread_mutex_t lease_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t lease_ptid;
+
+static lease_t *lease_hash[LEASE_HASH_SIZE];
+static lease_t *lease_wheel[LEASE_WHEEL_SLOTS];
+static uint64_t wheel_tick;   /* next tick the lease thread will expire */
+static uint64_t next_receipt;
+
+/* receipts acked since the last tick, still to be deleted from lease.list */
+static uint64_t *acked;
+static int acked_size;
+static int acked_used;
+
+static void *lease_thread(void *arg);
+
+/* milliseconds on a clock that doesn't jump with the time of day */
+static uint64_t lease_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline lease_t **lease_bucket(const uint64_t receipt) {
+    return &lease_hash[receipt & (LEASE_HASH_SIZE - 1)];
+}
+
+/* lease_lock must be held for the wheel functions */
+static void wheel_link(lease_t *l) {
+    /* round up, so a lease never runs out early */
+    uint64_t tick = (l->expiry + LEASE_TICK_MS - 1) / LEASE_TICK_MS;
+    lease_t **slot;
+
+    if (tick < wheel_tick)
+        tick = wheel_tick;
+    l->slot = tick % LEASE_WHEEL_SLOTS;
+    slot = &lease_wheel[l->slot];
+
+    l->wprev = NULL;
+    l->wnext = *slot;
+    if (*slot != NULL)
+        (*slot)->wprev = l;
+    *slot = l;
+}
+
+static void wheel_unlink(lease_t *l) {
+    if (l->wprev != NULL) {
+        l->wprev->wnext = l->wnext;
+    } else {
+        assert(lease_wheel[l->slot] == l);
+        lease_wheel[l->slot] = l->wnext;
+    }
+    if (l->wnext != NULL)
+        l->wnext->wprev = l->wprev;
+}
+
+static lease_t *hash_remove(const uint64_t receipt) {
+    lease_t **pos = lease_bucket(receipt);
+    lease_t *l;
+
+    for (l = *pos; l != NULL; pos = &l->hnext, l = l->hnext) {
+        if (l->receipt == receipt) {
+            *pos = l->hnext;
+            return l;
+        }
+    }
+    return NULL;
+}
+
+void lease_init(void) {
+    wheel_tick = lease_now() / LEASE_TICK_MS;
+
+    /*
+     * Receipts of a previous run are gone with its leases; start from the
+     * clock so they are never handed out again.
+     */
+    next_receipt = (uint64_t)time(NULL) << 20;
+
+    acked_size = LEASE_ACKED_INITIAL;
+    acked_used = 0;
+    acked = (uint64_t *)malloc(sizeof(uint64_t) * acked_size);
+    if (acked == NULL) {
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+uint64_t lease_new_receipt(void) {
+    uint64_t receipt;
+
+    pthread_mutex_lock(&lease_lock);
+    receipt = ++next_receipt;
+    pthread_mutex_unlock(&lease_lock);
+    return receipt;
+}
+
+/*
+ * Starts tracking a message handed out by bdb_lget(). The item is copied,
+ * the caller keeps its own. Returns 0 on success, -1 when out of memory.
+ */
+int lease_add(uint64_t receipt, item *it, unsigned int lease_ms) {
+    lease_t *l;
+    lease_t **bucket;
+
+    l = (lease_t *)malloc(sizeof(lease_t));
+    if (l == NULL)
+        return -1;
+    l->it = (item *)malloc(ITEM_ntotal(it));
+    if (l->it == NULL) {
+        free(l);
+        return -1;
+    }
+    memcpy(l->it, it, ITEM_ntotal(it));
+    l->receipt = receipt;
+    l->expiry = lease_now() + lease_ms;
+
+    pthread_mutex_lock(&lease_lock);
+    bucket = lease_bucket(receipt);
+    l->hnext = *bucket;
+    *bucket = l;
+    wheel_link(l);
+    pthread_mutex_unlock(&lease_lock);
+
+    STATS_LOCK();
+    stats.curr_leases++;
+    STATS_UNLOCK();
+    return 0;
+}
+
+/*
+ * Ends a lease for good. Returns 0 if it was live, 1 if there is no such
+ * lease (never given out, acked already, or expired and redelivered).
+ */
+int lease_ack(uint64_t receipt) {
+    lease_t *l;
+    bool queued = true;
+
+    pthread_mutex_lock(&lease_lock);
+    l = hash_remove(receipt);
+    if (l == NULL) {
+        pthread_mutex_unlock(&lease_lock);
+        return 1;
+    }
+    wheel_unlink(l);
+
+    if (acked_used == acked_size) {
+        uint64_t *new_acked = realloc(acked, sizeof(uint64_t) * acked_size * 2);
+        if (new_acked != NULL) {
+            acked = new_acked;
+            acked_size *= 2;
+        }
+    }
+    if (acked_used < acked_size) {
+        acked[acked_used++] = receipt;
+    } else {
+        queued = false;
+    }
+    pthread_mutex_unlock(&lease_lock);
+
+    /* no room to batch it, so pay for a transaction of its own */
+    if (!queued)
+        bdb_lease_delete(&receipt, 1);
+
+    STATS_LOCK();
+    stats.curr_leases--;
+    STATS_UNLOCK();
+
+    free(l->it);
+    free(l);
+    return 0;
+}
+
+void start_lease_thread(void) {
+    if ((errno = pthread_create(&lease_ptid, NULL, lease_thread, NULL)) != 0) {
+        fprintf(stderr, "failed spawning lease thread: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void *lease_thread(void *arg) {
+    uint64_t *batch = NULL;
+    int batch_size = 0, nbatch;
+    lease_t *expired, *l, *next;
+    uint64_t now, now_tick;
+    unsigned int nexpired;
+
+    if (settings.verbose > 1) {
+        fprintf(stderr, "lease thread created: %lu, every %d milliseconds\n",
+                (unsigned long)pthread_self(), LEASE_TICK_MS);
+    }
+
+    while (!daemon_quit) {
+        usleep(LEASE_TICK_MS * 1000);
+
+        expired = NULL;
+        now = lease_now();
+        now_tick = now / LEASE_TICK_MS;
+
+        pthread_mutex_lock(&lease_lock);
+
+        /* take the acked receipts, leaving an array of the same size behind */
+        nbatch = acked_used;
+        if (nbatch > 0) {
+            uint64_t *tmp = batch;
+            int tmp_size = batch_size;
+            batch = acked;
+            batch_size = acked_size;
+            if (tmp == NULL) {
+                tmp_size = LEASE_ACKED_INITIAL;
+                tmp = (uint64_t *)malloc(sizeof(uint64_t) * tmp_size);
+            }
+            if (tmp != NULL) {
+                acked = tmp;
+                acked_size = tmp_size;
+                acked_used = 0;
+            } else {
+                /* keep appending to the old array, flush it next tick */
+                acked = batch;
+                batch = NULL;
+                batch_size = 0;
+                nbatch = 0;
+            }
+        }
+
+        /* turn the wheel; a full turn is as far as we ever need to go */
+        if (now_tick - wheel_tick >= LEASE_WHEEL_SLOTS)
+            wheel_tick = now_tick - LEASE_WHEEL_SLOTS + 1;
+        for (; wheel_tick <= now_tick; wheel_tick++) {
+            for (l = lease_wheel[wheel_tick % LEASE_WHEEL_SLOTS]; l != NULL; l = next) {
+                next = l->wnext;
+                if (l->expiry > now)
+                    continue;   /* due on a later turn */
+                wheel_unlink(l);
+                hash_remove(l->receipt);
+                l->wnext = expired;
+                expired = l;
+            }
+        }
+
+        pthread_mutex_unlock(&lease_lock);
+
+        if (nbatch > 0)
+            bdb_lease_delete(batch, nbatch);
+
+        nexpired = 0;
+        for (l = expired; l != NULL; l = next) {
+            next = l->wnext;
+            if (bdb_lease_redeliver(l->receipt, l->it) != 0) {
+                /* try again on the next tick */
+                l->expiry = now;
+                pthread_mutex_lock(&lease_lock);
+                l->hnext = *lease_bucket(l->receipt);
+                *lease_bucket(l->receipt) = l;
+                wheel_link(l);
+                pthread_mutex_unlock(&lease_lock);
+                continue;
+            }
+            if (settings.verbose > 1) {
+                fprintf(stderr, "lease %llu expired, redelivered to %s\n",
+                        (unsigned long long)l->receipt, ITEM_key(l->it));
+            }
+            free(l->it);
+            free(l);
+            nexpired++;
+        }
+
+        if (nexpired > 0) {
+            STATS_LOCK();
+            stats.lease_expired += nexpired;
+            stats.curr_leases -= nexpired;
+            STATS_UNLOCK();
+        }
+    }
+
+    return (NULL);
+}
@@ -18,6 +18,11 @@
  *
  */
 
+/* for recvmmsg() and sendmmsg() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "memcacheq.h"
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -48,6 +53,12 @@
 #include <assert.h>
 #include <limits.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #ifdef HAVE_MALLOC_H
 /* OpenBSD has a malloc.h, but warns to use stdlib.h instead */
 #ifndef __OpenBSD__
@@ -75,6 +86,8 @@ static int server_socket(const int port, const bool is_udp);
 static int try_read_command(conn *c);
 static int try_read_network(conn *c);
 static int try_read_udp(conn *c);
+static struct udp_rx *udp_rx_new(void);
+static void udp_rx_free(struct udp_rx *rx);
 
 /* stats */
 static void stats_reset(void);
@@ -90,7 +103,7 @@ static void conn_init(void);
 static void accept_new_conns(const bool do_accept);
 static bool update_event(conn *c, const int new_flags);
 static void complete_nread(conn *c);
-static void process_command(conn *c, char *command);
+static void process_command(conn *c, char *command, const size_t length);
 static int transmit(conn *c);
 static int ensure_iov_space(conn *c);
 static int add_iov(conn *c, const void *buf, int len);
@@ -106,6 +119,8 @@ struct bdb_settings bdb_settings;
 struct bdb_version bdb_version;
 DB_ENV *envp = NULL;
 DB *qlist_dbp = NULL;
+DB *lease_dbp = NULL;
+DB *chunk_dbp = NULL;
 
 int daemon_quit = 0;
 
@@ -118,11 +133,27 @@ static struct event_base *main_base;
 #define TRANSMIT_SOFT_ERROR 2
 #define TRANSMIT_HARD_ERROR 3
 
+/** Flush corked responses once this many iovecs are queued. */
+#define CORK_IOV_HIGHWAT IOV_MAX
+
 static void stats_init(void) {
     stats.curr_conns = stats.total_conns = stats.conn_structs = 0;
     stats.get_cmds = stats.set_cmds = 0;
+    stats.peek_cmds = stats.peek_hits = 0;
+    stats.move_cmds = stats.move_hits = stats.move_inflate_fails = 0;
+    stats.lget_cmds = stats.lget_hits = 0;
+    stats.ack_cmds = stats.ack_hits = 0;
+    stats.lease_expired = 0;
+    stats.curr_leases = 0;
+    stats.noreply_fails = 0;
     stats.bytes_read = stats.bytes_written = 0;
 
+    stats.udp_packets = (uint64_t *)calloc(settings.num_threads, sizeof(uint64_t));
+    if (stats.udp_packets == NULL) {
+        perror("calloc()");
+        exit(EXIT_FAILURE);
+    }
+
     /* make the time we started always be 2 seconds before we really
        did, so time(0) - time.started is never zero.  if so, things
        like 'settings.oldest_live' which act as booleans as well as
@@ -135,8 +166,16 @@ static void stats_reset(void) {
     stats.total_conns = 0;
     stats.get_cmds = stats.set_cmds = 0;
     stats.get_hits = stats.set_hits = 0;
+    stats.peek_cmds = stats.peek_hits = 0;
+    stats.move_cmds = stats.move_hits = stats.move_inflate_fails = 0;
+    stats.lget_cmds = stats.lget_hits = 0;
+    stats.ack_cmds = stats.ack_hits = 0;
+    stats.lease_expired = 0;
+    stats.noreply_fails = 0;
     stats.bytes_read = stats.bytes_written = 0;
+    memset(stats.udp_packets, 0, sizeof(uint64_t) * settings.num_threads);
     STATS_UNLOCK();
+    latency_reset();
 }
 
 static void settings_init(void) {
@@ -148,6 +187,7 @@ static void settings_init(void) {
     settings.maxconns = 1024;         /* to limit connections-related memory to about 5MB */
     settings.verbose = 0;
     settings.socketpath = NULL;       /* by default, not using a unix socket */
+    settings.slowlog_usec = 0;        /* no slow log */
 #ifdef USE_THREADS
     settings.num_threads = 4;
 #else
@@ -308,6 +348,7 @@ conn *conn_new(const int sfd, const int init_state, const int event_flags,
     c->state = init_state;
     c->rlbytes = 0;
     c->rbytes = c->wbytes = 0;
+    c->wbused = 0;
     c->wcurr = c->wbuf;
     c->rcurr = c->rbuf;
     c->ritem = 0;
@@ -316,10 +357,22 @@ conn *conn_new(const int sfd, const int init_state, const int event_flags,
     c->iovused = 0;
     c->msgcurr = 0;
     c->msgused = 0;
+    c->corked = false;
 
     c->write_and_go = conn_read;
     c->write_and_free = 0;
     c->item = 0;
+    c->noreply = false;
+    c->thread = 0;
+    c->slow.start = 0;
+
+    if (is_udp && c->udp_rx == NULL && (c->udp_rx = udp_rx_new()) == NULL) {
+        if (conn_add_to_freelist(c)) {
+            conn_free(c);
+        }
+        fprintf(stderr, "malloc()\n");
+        return NULL;
+    }
 
     event_set(&c->event, sfd, event_flags, event_handler, (void *)c);
     event_base_set(base, &c->event);
@@ -378,6 +431,8 @@ void conn_free(conn *c) {
             free(c->ilist);
         if (c->iov)
             free(c->iov);
+        if (c->udp_rx)
+            udp_rx_free(c->udp_rx);
         free(c);
     }
 }
@@ -438,6 +493,14 @@ static void conn_shrink(conn *c) {
         c->rcurr = c->rbuf;
     }
 
+    if (c->wsize > DATA_BUFFER_SIZE) {
+        char *newbuf = (char *)realloc((void *)c->wbuf, DATA_BUFFER_SIZE);
+        if (newbuf) {
+            c->wbuf = newbuf;
+            c->wsize = DATA_BUFFER_SIZE;
+        }
+    }
+
     if (c->isize > ITEM_LIST_HIGHWAT) {
         item **newbuf = (item**) realloc((void *)c->ilist, ITEM_LIST_INITIAL * sizeof(c->ilist[0]));
         if (newbuf) {
@@ -475,7 +538,8 @@ static void conn_set_state(conn *c, int state) {
     assert(c != NULL);
 
     if (state != c->state) {
-        if (state == conn_read) {
+        /* corked responses still point into our buffers */
+        if (state == conn_read && !c->corked) {
             conn_shrink(c);
         }
         c->state = state;
@@ -519,6 +583,32 @@ static int ensure_iov_space(conn *c) {
  * Returns 0 on success, -1 on out-of-memory.
  */
 
+/*
+ * Where the outgoing iovs stand. A response that fails partway is taken
+ * back to its mark with iov_rollback() before its items are freed, so
+ * nothing points at them and the error line can go out in its place.
+ */
+typedef struct {
+    int msgused;
+    int iovused;
+    int msgbytes;
+    size_t msg_iovlen;      /* of the last msghdr */
+} iov_mark_t;
+
+static void iov_mark(conn *c, iov_mark_t *mark) {
+    mark->msgused = c->msgused;
+    mark->iovused = c->iovused;
+    mark->msgbytes = c->msgbytes;
+    mark->msg_iovlen = c->msglist[c->msgused - 1].msg_iovlen;
+}
+
+static void iov_rollback(conn *c, const iov_mark_t *mark) {
+    c->msgused = mark->msgused;
+    c->iovused = mark->iovused;
+    c->msgbytes = mark->msgbytes;
+    c->msglist[c->msgused - 1].msg_iovlen = mark->msg_iovlen;
+}
+
 static int add_iov(conn *c, const void *buf, int len) {
     struct msghdr *m;
     int leftover;
@@ -609,31 +699,157 @@ static int build_udp_headers(conn *c) {
 }
 
 
+/*
+ * Makes room for another "bytes" in a connection's write buffer behind the
+ * responses already corked there, pointing their iovecs at the new buffer.
+ *
+ * Returns 0 on success, -1 on out-of-memory.
+ */
+static int ensure_wbuf_space(conn *c, const int bytes) {
+    char *new_wbuf;
+    int i, new_size = c->wsize;
+
+    assert(c != NULL);
+
+    while (new_size - c->wbused < bytes)
+        new_size *= 2;
+    if (new_size == c->wsize)
+        return 0;
+
+    if ((new_wbuf = (char *)malloc(new_size)) == NULL)
+        return -1;
+    memcpy(new_wbuf, c->wbuf, c->wbused);
+
+    for (i = 0; i < c->iovused; i++) {
+        char *base = (char *)c->iov[i].iov_base;
+        if (base >= c->wbuf && base < c->wbuf + c->wsize)
+            c->iov[i].iov_base = new_wbuf + (base - c->wbuf);
+    }
+
+    free(c->wbuf);
+    c->wbuf = new_wbuf;
+    c->wsize = new_size;
+    return 0;
+}
+
 static void out_string(conn *c, const char *str) {
     size_t len;
 
     assert(c != NULL);
 
+    if (c->noreply) {
+        if (settings.verbose > 1)
+            fprintf(stderr, ">%d NOREPLY %s\n", c->sfd, str);
+        c->noreply = false;
+        conn_set_state(c, conn_read);
+        c->write_and_go = conn_read;
+        return;
+    }
+
     if (settings.verbose > 1)
         fprintf(stderr, ">%d %s\n", c->sfd, str);
 
     len = strlen(str);
-    if ((len + 2) > c->wsize) {
+    if ((len + 2) > DATA_BUFFER_SIZE) {
         /* ought to be always enough. just fail for simplicity */
         str = "SERVER_ERROR output line too long";
         len = strlen(str);
     }
+    if (ensure_wbuf_space(c, len + 2) != 0) {
+        /* dropping a corked response would desync the client */
+        if (settings.verbose > 0)
+            fprintf(stderr, "Couldn't grow output buffer\n");
+        conn_set_state(c, conn_closing);
+        return;
+    }
 
-    memcpy(c->wbuf, str, len);
-    memcpy(c->wbuf + len, "\r\n", 2);
+    memcpy(c->wbuf + c->wbused, str, len);
+    memcpy(c->wbuf + c->wbused + len, "\r\n", 2);
     c->wbytes = len + 2;
-    c->wcurr = c->wbuf;
+    c->wcurr = c->wbuf + c->wbused;
 
     conn_set_state(c, conn_write);
     c->write_and_go = conn_read;
     return;
 }
 
+/*
+ * Leaves the response just queued in the msghdr list and goes back for the
+ * next pipelined command, so a whole batch of responses goes out with one
+ * sendmsg(). conn_read flushes the batch once no complete command is left
+ * in rbuf or CORK_IOV_HIGHWAT iovecs are pending. UDP responses are never corked, they
+ * each need their own set of headers.
+ *
+ * Returns true if the response was corked.
+ */
+static bool cork_response(conn *c) {
+    assert(c != NULL);
+
+    if (c->udp)
+        return false;
+
+    if (c->state == conn_write)
+        c->wbused = (c->wcurr - c->wbuf) + c->wbytes;
+    c->corked = true;
+    conn_set_state(c, conn_read);
+    return true;
+}
+
+/*
+ * Logs the command kept in c->slow if it took -W microseconds or more from
+ * coming in until now, when its response has been sent.
+ */
+static void slowlog_response_sent(conn *c) {
+    uint64_t now;
+
+    if (c->slow.start == 0)
+        return;
+    now = latency_now();
+    if (now - c->slow.start >= (uint64_t)settings.slowlog_usec * 1000) {
+        c->slow.total_usec = (now - c->slow.start) / 1000;
+        c->slow.usec[SLOWLOG_TRANSMIT] = (now - c->slow.done) / 1000;
+        c->slow.when = time(NULL);
+        slowlog_add(&c->slow);
+    }
+    c->slow.start = 0;
+}
+
+/*
+ * Called when a command is done and its response queued. Of the commands
+ * whose responses go out together, the one that took longest is kept for
+ * the slow log, with its BDB phases as latency_mark() recorded them.
+ */
+static void slowlog_command_done(conn *c, const char *command, const size_t ncommand,
+                                 const char *queue, const size_t nqueue) {
+    uint64_t phases[LATENCY_PHASES];
+    uint64_t now = latency_now();
+    size_t n;
+
+    latency_take(phases);
+    if (c->slow.start != 0 && now - c->cmd_start < c->slow.done - c->slow.start)
+        return;
+
+    c->slow.start = c->cmd_start;
+    c->slow.done = now;
+    c->slow.nbytes = c->cmd_bytes;
+    c->slow.usec[SLOWLOG_TXN_BEGIN] = (phases[LATENCY_GET_TXN_BEGIN] + phases[LATENCY_PUT_TXN_BEGIN]) / 1000;
+    c->slow.usec[SLOWLOG_QLIST] = (phases[LATENCY_GET_QLIST] + phases[LATENCY_PUT_QLIST]) / 1000;
+    c->slow.usec[SLOWLOG_DATA] = (phases[LATENCY_GET_CONSUME] + phases[LATENCY_PUT_APPEND]) / 1000;
+    c->slow.usec[SLOWLOG_COMMIT] = (phases[LATENCY_GET_COMMIT] + phases[LATENCY_PUT_COMMIT]) / 1000;
+    c->slow.usec[SLOWLOG_TRANSMIT] = 0;
+
+    n = ncommand < sizeof(c->slow.command) ? ncommand : sizeof(c->slow.command) - 1;
+    memcpy(c->slow.command, command, n);
+    c->slow.command[n] = '\0';
+    n = nqueue < SLOWLOG_QUEUE_MAX ? nqueue : SLOWLOG_QUEUE_MAX;
+    memcpy(c->slow.queue, queue, n);
+    c->slow.queue[n] = '\0';
+
+    /* nothing to send, as with noreply */
+    if (c->state == conn_read && !c->corked)
+        slowlog_response_sent(c);
+}
+
 /*
  * we get here after reading the value in set/add/replace commands. The command
  * has been stored in c->item_comm, and the item is ready in c->item.
@@ -647,12 +863,15 @@ static void complete_nread(conn *c) {
     char *key = ITEM_key(it);
     size_t nkey = (size_t)it->nkey;
     int comm = c->item_comm;
+    bool noreply = c->noreply;
 
+    c->cmd_bytes = it->nbytes - 2;
     STATS_LOCK();
     stats.set_cmds++;
     STATS_UNLOCK();
 
     if (strncmp(ITEM_data(it) + it->nbytes - 2, "\r\n", 2) != 0) {
+        ret = -1;
         out_string(c, "CLIENT_ERROR bad data chunk");
     } else {
         if (comm == NREAD_ADD) {
@@ -672,6 +891,14 @@ static void complete_nread(conn *c) {
             out_string(c, "NOT_STORED");
         }
     }
+    if (ret != 0 && noreply) {
+        STATS_LOCK();
+        stats.noreply_fails++;
+        STATS_UNLOCK();
+    }
+
+    if (settings.slowlog_usec > 0)
+        slowlog_command_done(c, comm == NREAD_ADD ? "add" : "set", 3, key, nkey);
 
     item_free(c->item);
     c->item = 0;
@@ -687,63 +914,193 @@ typedef struct token_s {
 #define KEY_TOKEN 1
 #define KEY_MAX_LENGTH 250
 
-#define MAX_TOKENS 8
+/* max_tokens of a command that takes any number of tokens */
+#define TOKENS_UNBOUNDED ((size_t)-1)
 
 /*
- * Tokenize the command string by replacing whitespace with '\0' and update
- * the token array tokens with pointer to start of each token and length.
- * Returns total number of tokens.  The last valid token is the terminal
- * token (value points to the first unprocessed character of the string and
- * length zero).
- *
- * Usage example:
- *
- *  while(tokenize_command(command, ncommand, tokens, max_tokens) > 0) {
- *      for(int ix = 0; tokens[ix].length != 0; ix++) {
- *          ...
- *      }
- *      ncommand = tokens[ix].value - command;
- *      command  = tokens[ix].value;
- *   }
+ * Worst case is a line of one-byte tokens: one token per two bytes, plus
+ * the terminal token.
+ */
+#define TOKENS_FOR_LINE(length) ((length) / 2 + 2)
+
+/* lines up to this many tokens are tokenized into an array on the stack */
+#define TOKENS_ON_STACK 128
+
+/*
+ * The tokenizer compares a block of the line against ' ' and '\0' at a
+ * time and walks the resulting bit masks, instead of testing byte by byte.
+ * Which block size is used is decided at compile time; build with -mavx2
+ * (or -march=native) to get the 32-byte version on x86-64.
  */
-static size_t tokenize_command(char *command, token_t *tokens, const size_t max_tokens) {
-    char *s, *e;
+#if defined(__AVX2__)
+#define TOKENIZE_IMPL "avx2"
+#define TOKENIZE_BLOCK 32
+
+static inline uint32_t block_mask(const char *p, const char ch) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(ch)));
+}
+#elif defined(__SSE2__)
+#define TOKENIZE_IMPL "sse2"
+#define TOKENIZE_BLOCK 16
+
+static inline uint32_t block_mask(const char *p, const char ch) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(ch)));
+}
+#else
+#define TOKENIZE_IMPL "scalar"
+#endif
+
+/*
+ * Tokenize the command line of the given length by replacing the space
+ * after each token with '\0', filling tokens with a pointer to the start
+ * of each token and its length. A '\0' inside the line ends it early.
+ * tokens must have room for TOKENS_FOR_LINE(length) entries, so the whole
+ * line is always tokenized in one pass. Returns the total number of
+ * tokens, including the terminal token (value NULL and length zero).
+ */
+static size_t tokenize_line(char *line, size_t length, token_t *tokens) {
     size_t ntokens = 0;
+    size_t i = 0;
+    char *start = NULL; /* start of the token being scanned, if any */
+
+    assert(line != NULL && tokens != NULL);
+
+#ifdef TOKENIZE_BLOCK
+    for (; i + TOKENIZE_BLOCK <= length; i += TOKENIZE_BLOCK) {
+        uint32_t spaces = block_mask(line + i, ' ');
+        uint32_t nuls = block_mask(line + i, '\0');
+        uint32_t inside, prev, starts, ends;
+
+        if (nuls != 0) {
+            /* the line ends inside this block, leave it to the scalar loop */
+            length = i + __builtin_ctz(nuls);
+            break;
+        }
 
-    assert(command != NULL && tokens != NULL && max_tokens > 1);
+        /* bit k of prev: byte k-1 is part of a token */
+        inside = ~spaces & (uint32_t)(((uint64_t)1 << TOKENIZE_BLOCK) - 1);
+        prev = (inside << 1) | (start != NULL);
+        starts = inside & ~prev;
+        ends = spaces & prev;
 
-    for (s = e = command; ntokens < max_tokens - 1; ++e) {
-        if (*e == ' ') {
-            if (s != e) {
-                tokens[ntokens].value = s;
-                tokens[ntokens].length = e - s;
+        /* starts and ends alternate, so follow whichever comes next */
+        for (;;) {
+            if (start == NULL) {
+                if (starts == 0)
+                    break;
+                start = line + i + __builtin_ctz(starts);
+                starts &= starts - 1;
+            } else {
+                char *e;
+                if (ends == 0)
+                    break;
+                e = line + i + __builtin_ctz(ends);
+                ends &= ends - 1;
+                tokens[ntokens].value = start;
+                tokens[ntokens].length = e - start;
                 ntokens++;
                 *e = '\0';
+                start = NULL;
             }
-            s = e + 1;
         }
-        else if (*e == '\0') {
-            if (s != e) {
-                tokens[ntokens].value = s;
-                tokens[ntokens].length = e - s;
+    }
+#endif
+
+    for (; i < length; i++) {
+        if (line[i] == ' ') {
+            if (start != NULL) {
+                tokens[ntokens].value = start;
+                tokens[ntokens].length = line + i - start;
                 ntokens++;
+                line[i] = '\0';
+                start = NULL;
             }
-
-            break; /* string end */
+        } else if (line[i] == '\0') {
+            break;
+        } else if (start == NULL) {
+            start = line + i;
         }
     }
+    if (start != NULL) {
+        tokens[ntokens].value = start;
+        tokens[ntokens].length = line + i - start;
+        ntokens++;
+    }
 
-    /*
-     * If we scanned the whole string, the terminal value pointer is null,
-     * otherwise it is the first unprocessed character.
-     */
-    tokens[ntokens].value =  *e == '\0' ? NULL : e;
+    tokens[ntokens].value = NULL;
     tokens[ntokens].length = 0;
     ntokens++;
 
     return ntokens;
 }
 
+/*
+ * Checks for the "noreply" option, which must be the last token of the
+ * command line, and flags the connection so the reply is suppressed.
+ */
+static inline bool set_noreply_maybe(conn *c, token_t *tokens, size_t ntokens) {
+    int noreply_index = ntokens - 2;
+
+    if (tokens[noreply_index].value &&
+        strcmp(tokens[noreply_index].value, "noreply") == 0) {
+        c->noreply = true;
+    }
+    return c->noreply;
+}
+
+/* a failure the client asked not to hear about is still counted */
+static inline void noreply_fail_maybe(conn *c) {
+    if (c->noreply) {
+        STATS_LOCK();
+        stats.noreply_fails++;
+        STATS_UNLOCK();
+    }
+}
+
+/*
+ * Command dispatch. Commands are looked up in tables indexed by the length
+ * of their name, so a lookup costs one index and a couple of compares,
+ * leading byte first, instead of a strcmp() per known command. To add a
+ * command, put it into the array for its name length.
+ */
+typedef void (*command_handler)(conn *c, token_t *tokens, const size_t ntokens);
+
+typedef struct command_s {
+    const char      *name;
+    size_t          length;
+    size_t          min_tokens; /* valid token counts, with the terminal token */
+    size_t          max_tokens;
+    command_handler handler;
+} command_t;
+
+#define COMMAND(name, min, max, handler) { name, sizeof(name) - 1, min, max, handler }
+#define COMMAND_END { NULL, 0, 0, 0, NULL }
+#define COMMAND_TABLE_SIZE(table) (sizeof(table) / sizeof(table[0]))
+
+/*
+ * Returns the command named by token if it accepts ntokens tokens, NULL
+ * otherwise.
+ */
+static inline const command_t *lookup_command(const command_t *const *table, const size_t table_size,
+                                              const token_t *token, const size_t ntokens) {
+    const command_t *cmd;
+
+    if (token->length >= table_size || table[token->length] == NULL)
+        return NULL;
+
+    for (cmd = table[token->length]; cmd->name != NULL; cmd++) {
+        if (cmd->name[0] == token->value[0] &&
+            memcmp(cmd->name + 1, token->value + 1, token->length - 1) == 0) {
+            if (ntokens < cmd->min_tokens || ntokens > cmd->max_tokens)
+                return NULL;
+            return cmd;
+        }
+    }
+    return NULL;
+}
+
 /* set up a connection to write a buffer then free it, used for stats */
 static void write_and_free(conn *c, char *buf, int bytes) {
     if (buf) {
@@ -757,10 +1114,261 @@ static void write_and_free(conn *c, char *buf, int bytes) {
     }
 }
 
+static void process_stat_reset(conn *c, token_t *tokens, const size_t ntokens) {
+    stats_reset();
+    out_string(c, "RESET");
+}
+
+static void process_stat_bdb(conn *c, token_t *tokens, const size_t ntokens) {
+    char *buf, *pos;
+
+    /* the settings, then what the environment has been doing */
+    buf = pos = (char *)malloc(1024 + BDB_ENV_STATS_SIZE +
+                               (bdb_settings.log_archive_dir != NULL ? strlen(bdb_settings.log_archive_dir) : 0));
+    if (buf == NULL) {
+        out_string(c, "SERVER_ERROR out of memory writing stats");
+        return;
+    }
+    pos += sprintf(pos, "STAT db_ver %d.%d.%d\r\n", bdb_version.majver, bdb_version.minver, bdb_version.patch);
+    pos += sprintf(pos, "STAT cache_size %u\r\n", bdb_settings.cache_size);
+    pos += sprintf(pos, "STAT page_size %u\r\n", bdb_settings.page_size);
+    pos += sprintf(pos, "STAT txn_lg_bsize %u\r\n", bdb_settings.txn_lg_bsize);
+    pos += sprintf(pos, "STAT txn_nosync %d\r\n", bdb_settings.txn_nosync);
+    pos += sprintf(pos, "STAT dldetect_val %d\r\n", bdb_settings.dldetect_val);
+    pos += sprintf(pos, "STAT chkpoint_val %d\r\n", bdb_settings.chkpoint_val);
+    pos += sprintf(pos, "STAT chkpoint_kbyte %u\r\n", bdb_settings.chkpoint_kbyte);
+    pos += sprintf(pos, "STAT chkpoint_recovery %d\r\n", bdb_settings.chkpoint_recovery);
+    pos += sprintf(pos, "STAT log_retain %d\r\n", bdb_settings.log_retain);
+    pos += sprintf(pos, "STAT log_archive_dir %s\r\n", bdb_settings.log_archive_dir != NULL ?
+                   bdb_settings.log_archive_dir : "-");
+    pos += sprintf(pos, "STAT memp_trickle_val %d\r\n", bdb_settings.memp_trickle_val);
+    pos += sprintf(pos, "STAT memp_trickle_percent %d\r\n", bdb_settings.memp_trickle_percent);
+    pos += sprintf(pos, "STAT max_open_queues %u\r\n", bdb_settings.max_open_queues);
+    pos += print_bdb_env_stats(pos);
+    pos += sprintf(pos, "END\r\n");
+    write_and_free(c, buf, pos - buf);
+}
+
+/*
+ * stats queue [<prefix> [<offset> [<limit>]]], a prefix of "*" matches
+ * all. "stats queues" takes the same and adds each queue's counters.
+ */
+static void stat_queue_list(conn *c, token_t *tokens, const size_t ntokens, const bool detail) {
+    char *prefix = "";
+    size_t nprefix = 0;
+    unsigned long offset = 0, limit = 0;
+    char *endptr, *buf;
+    int bytes;
+
+    if (ntokens > 6) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+    if (ntokens > 3 && strcmp(tokens[2].value, "*") != 0) {
+        prefix = tokens[2].value;
+        nprefix = tokens[2].length;
+    }
+    if (ntokens > 4) {
+        offset = strtoul(tokens[3].value, &endptr, 10);
+        if (*endptr != '\0') {
+            out_string(c, "CLIENT_ERROR bad command line format");
+            return;
+        }
+    }
+    if (ntokens > 5) {
+        limit = strtoul(tokens[4].value, &endptr, 10);
+        if (*endptr != '\0') {
+            out_string(c, "CLIENT_ERROR bad command line format");
+            return;
+        }
+    }
+
+    buf = bdb_queue_stats(prefix, nprefix, offset, limit, detail, &bytes);
+    if (buf == NULL) {
+        out_string(c, "SERVER_ERROR out of memory writing stats");
+        return;
+    }
+    write_and_free(c, buf, bytes);
+}
+
+static void process_stat_queue(conn *c, token_t *tokens, const size_t ntokens) {
+    stat_queue_list(c, tokens, ntokens, false);
+}
+
+static void process_stat_queues(conn *c, token_t *tokens, const size_t ntokens) {
+    stat_queue_list(c, tokens, ntokens, true);
+}
+
+#ifdef HAVE_MALLOC_H
+#ifdef HAVE_STRUCT_MALLINFO
+static void process_stat_malloc(conn *c, token_t *tokens, const size_t ntokens) {
+    char temp[512];
+    struct mallinfo info;
+    char *pos = temp;
+
+    info = mallinfo();
+    pos += sprintf(pos, "STAT arena_size %d\r\n", info.arena);
+    pos += sprintf(pos, "STAT free_chunks %d\r\n", info.ordblks);
+    pos += sprintf(pos, "STAT fastbin_blocks %d\r\n", info.smblks);
+    pos += sprintf(pos, "STAT mmapped_regions %d\r\n", info.hblks);
+    pos += sprintf(pos, "STAT mmapped_space %d\r\n", info.hblkhd);
+    pos += sprintf(pos, "STAT max_total_alloc %d\r\n", info.usmblks);
+    pos += sprintf(pos, "STAT fastbin_space %d\r\n", info.fsmblks);
+    pos += sprintf(pos, "STAT total_alloc %d\r\n", info.uordblks);
+    pos += sprintf(pos, "STAT total_free %d\r\n", info.fordblks);
+    pos += sprintf(pos, "STAT releasable_space %d\r\nEND", info.keepcost);
+    out_string(c, temp);
+}
+#endif /* HAVE_STRUCT_MALLINFO */
+#endif /* HAVE_MALLOC_H */
+
+#if !defined(WIN32) || !defined(__APPLE__)
+static void process_stat_maps(conn *c, token_t *tokens, const size_t ntokens) {
+    char *wbuf;
+    int wsize = 8192; /* should be enough */
+    int fd;
+    int res;
+
+    if ((wbuf = (char *)malloc(wsize)) == NULL) {
+        out_string(c, "SERVER_ERROR out of memory writing stats maps");
+        return;
+    }
+
+    fd = open("/proc/self/maps", O_RDONLY);
+    if (fd == -1) {
+        out_string(c, "SERVER_ERROR cannot open the maps file");
+        free(wbuf);
+        return;
+    }
+
+    res = read(fd, wbuf, wsize - 6);  /* 6 = END\r\n\0 */
+    if (res == wsize - 6) {
+        out_string(c, "SERVER_ERROR buffer overflow");
+        free(wbuf); close(fd);
+        return;
+    }
+    if (res == 0 || res == -1) {
+        out_string(c, "SERVER_ERROR can't read the maps file");
+        free(wbuf); close(fd);
+        return;
+    }
+    memcpy(wbuf + res, "END\r\n", 5);
+    write_and_free(c, wbuf, res + 5);
+    close(fd);
+}
+#endif
+
+static void process_stat_threads(conn *c, token_t *tokens, const size_t ntokens) {
+    char *buf, *pos;
+    int i;
+
+    /* one line per thread, so size it by the thread count */
+    buf = malloc(64 * (settings.num_threads + 1));
+    if (buf == NULL) {
+        out_string(c, "SERVER_ERROR out of memory writing stats");
+        return;
+    }
+    pos = buf;
+
+    STATS_LOCK();
+    pos += sprintf(pos, "STAT threads %u\r\n", settings.num_threads);
+    for (i = 0; i < settings.num_threads; i++) {
+        pos += sprintf(pos, "STAT thread_%d_udp_packets %llu\r\n",
+                       i, (unsigned long long)stats.udp_packets[i]);
+    }
+    STATS_UNLOCK();
+    pos += sprintf(pos, "END\r\n");
+    write_and_free(c, buf, pos - buf);
+}
+
+static void process_stat_latency(conn *c, token_t *tokens, const size_t ntokens) {
+    char *buf;
+    int bytes;
+
+    buf = latency_stats(&bytes);
+    if (buf == NULL) {
+        out_string(c, "SERVER_ERROR out of memory writing stats");
+        return;
+    }
+    write_and_free(c, buf, bytes);
+}
+
+static void process_stat_slowlog(conn *c, token_t *tokens, const size_t ntokens) {
+    char *buf;
+    int bytes;
+
+    buf = slowlog_stats(&bytes);
+    if (buf == NULL) {
+        out_string(c, "SERVER_ERROR out of memory writing stats");
+        return;
+    }
+    write_and_free(c, buf, bytes);
+}
+
+static void process_stat_compress(conn *c, token_t *tokens, const size_t ntokens) {
+    char *buf;
+    int bytes;
+
+    buf = bdb_compress_stats(&bytes);
+    if (buf == NULL) {
+        out_string(c, "SERVER_ERROR out of memory writing stats");
+        return;
+    }
+    write_and_free(c, buf, bytes);
+}
+
+/* "stats <subcommand>" dispatch table, see command_table below. */
+static const command_t stat_commands_3[] = {
+    COMMAND("bdb",    3, TOKENS_UNBOUNDED, process_stat_bdb),
+    COMMAND_END
+};
+static const command_t stat_commands_4[] = {
+#if !defined(WIN32) || !defined(__APPLE__)
+    COMMAND("maps",   3, TOKENS_UNBOUNDED, process_stat_maps),
+#endif
+    COMMAND_END
+};
+static const command_t stat_commands_5[] = {
+    COMMAND("queue",  3, TOKENS_UNBOUNDED, process_stat_queue),
+    COMMAND("reset",  3, TOKENS_UNBOUNDED, process_stat_reset),
+    COMMAND_END
+};
+static const command_t stat_commands_6[] = {
+    COMMAND("queues", 3, TOKENS_UNBOUNDED, process_stat_queues),
+#ifdef HAVE_MALLOC_H
+#ifdef HAVE_STRUCT_MALLINFO
+    COMMAND("malloc", 3, TOKENS_UNBOUNDED, process_stat_malloc),
+#endif
+#endif
+    COMMAND_END
+};
+static const command_t stat_commands_7[] = {
+    COMMAND("latency", 3, TOKENS_UNBOUNDED, process_stat_latency),
+    COMMAND("slowlog", 3, TOKENS_UNBOUNDED, process_stat_slowlog),
+    COMMAND("threads", 3, TOKENS_UNBOUNDED, process_stat_threads),
+    COMMAND_END
+};
+static const command_t stat_commands_8[] = {
+    COMMAND("compress", 3, TOKENS_UNBOUNDED, process_stat_compress),
+    COMMAND_END
+};
+
+static const command_t *const stat_command_table[] = {
+    NULL, NULL, NULL,
+    stat_commands_3,
+    stat_commands_4,
+    stat_commands_5,
+    stat_commands_6,
+    stat_commands_7,
+    stat_commands_8
+};
+
+/* room for this many lines in the reply to a plain "stats" */
+#define STATS_LINES 48
+
 static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
     time_t now = time(0);
-    char *command;
-    char *subcommand;
+    const command_t *cmd;
 
     assert(c != NULL);
 
@@ -769,18 +1377,23 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
         return;
     }
 
-    command = tokens[COMMAND_TOKEN].value;
-
-    if (ntokens == 2 && strcmp(command, "stats") == 0) {
-        char temp[1024];
+    if (ntokens == 2) {
         pid_t pid = getpid();
-        char *pos = temp;
+        char *buf, *pos;
 
 #ifndef WIN32
         struct rusage usage;
         getrusage(RUSAGE_SELF, &usage);
 #endif /* !WIN32 */
 
+        /* no line is longer than 64 bytes, whatever the counters */
+        buf = malloc(64 * STATS_LINES + sizeof(VERSION));
+        if (buf == NULL) {
+            out_string(c, "SERVER_ERROR out of memory writing stats");
+            return;
+        }
+        pos = buf;
+
         STATS_LOCK();
         pos += sprintf(pos, "STAT pid %u\r\n", pid);
         pos += sprintf(pos, "STAT uptime %ld\r\n", now - stats.started);
@@ -798,225 +1411,472 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
         pos += sprintf(pos, "STAT get_hits %llu\r\n", stats.get_hits);
         pos += sprintf(pos, "STAT set_cmds %llu\r\n", stats.set_cmds);
         pos += sprintf(pos, "STAT set_hits %llu\r\n", stats.set_hits);
+        pos += sprintf(pos, "STAT peek_cmds %llu\r\n", stats.peek_cmds);
+        pos += sprintf(pos, "STAT peek_hits %llu\r\n", stats.peek_hits);
+        pos += sprintf(pos, "STAT move_cmds %llu\r\n", stats.move_cmds);
+        pos += sprintf(pos, "STAT move_hits %llu\r\n", stats.move_hits);
+        pos += sprintf(pos, "STAT move_inflate_fails %llu\r\n", stats.move_inflate_fails);
+        pos += sprintf(pos, "STAT lget_cmds %llu\r\n", stats.lget_cmds);
+        pos += sprintf(pos, "STAT lget_hits %llu\r\n", stats.lget_hits);
+        pos += sprintf(pos, "STAT ack_cmds %llu\r\n", stats.ack_cmds);
+        pos += sprintf(pos, "STAT ack_hits %llu\r\n", stats.ack_hits);
+        pos += sprintf(pos, "STAT lease_expired %llu\r\n", stats.lease_expired);
+        pos += sprintf(pos, "STAT curr_leases %u\r\n", stats.curr_leases);
+        pos += sprintf(pos, "STAT noreply_fails %llu\r\n", stats.noreply_fails);
         pos += sprintf(pos, "STAT bytes_read %llu\r\n", stats.bytes_read);
         pos += sprintf(pos, "STAT bytes_written %llu\r\n", stats.bytes_written);
         pos += sprintf(pos, "STAT threads %u\r\n", settings.num_threads);
-        pos += sprintf(pos, "END");
         STATS_UNLOCK();
-        out_string(c, temp);
+        pos += sprintf(pos, "END\r\n");
+        write_and_free(c, buf, pos - buf);
         return;
     }
 
-    subcommand = tokens[SUBCOMMAND_TOKEN].value;
-
-    if (strcmp(subcommand, "reset") == 0) {
-        stats_reset();
-        out_string(c, "RESET");
+    cmd = lookup_command(stat_command_table, COMMAND_TABLE_SIZE(stat_command_table),
+                         &tokens[SUBCOMMAND_TOKEN], ntokens);
+    if (cmd != NULL) {
+        cmd->handler(c, tokens, ntokens);
         return;
     }
 
-    if (strcmp(subcommand, "bdb") == 0) {
-        char temp[512];
-        char *pos = temp;
-        int ret;
-        pos += sprintf(pos, "STAT db_ver %d.%d.%d\r\n", bdb_version.majver, bdb_version.minver, bdb_version.patch);
-        pos += sprintf(pos, "STAT cache_size %u\r\n", bdb_settings.cache_size);
-        pos += sprintf(pos, "STAT page_size %u\r\n", bdb_settings.page_size);
-        pos += sprintf(pos, "STAT txn_lg_bsize %u\r\n", bdb_settings.txn_lg_bsize);
-        pos += sprintf(pos, "STAT txn_nosync %d\r\n", bdb_settings.txn_nosync);
-        pos += sprintf(pos, "STAT dldetect_val %d\r\n", bdb_settings.dldetect_val);
-        pos += sprintf(pos, "STAT chkpoint_val %d\r\n", bdb_settings.chkpoint_val);
-        pos += sprintf(pos, "STAT memp_trickle_val %d\r\n", bdb_settings.memp_trickle_val);
-        pos += sprintf(pos, "STAT memp_trickle_percent %d\r\n", bdb_settings.memp_trickle_percent);
-        pos += sprintf(pos, "END");
-        out_string(c, temp);
+    out_string(c, "ERROR");
+}
+
+static inline void process_get_command(conn *c, token_t *tokens, const size_t ntokens) {
+    char *key;
+    size_t nkey;
+    int i = c->ileft; /* items of corked responses come first */
+    item *it = NULL;
+    token_t *key_token = &tokens[KEY_TOKEN];
+    int stats_get_cmds   = 0;
+    int stats_get_hits   = 0;
+    assert(c != NULL);
+
+    while(key_token->length != 0) {
+
+        key = key_token->value;
+        nkey = key_token->length;
+
+        if(nkey > KEY_MAX_LENGTH) {
+            STATS_LOCK();
+            stats.get_cmds   += stats_get_cmds;
+            stats.get_hits   += stats_get_hits;
+            STATS_UNLOCK();
+            out_string(c, "CLIENT_ERROR bad command line format");
+            return;
+        }
+
+        stats_get_cmds++;
+
+        it = bdb_get(key, nkey);
+
+        if (it) {
+            if (i >= c->isize) {
+                item **new_list = realloc(c->ilist, sizeof(item *) * c->isize * 2);
+                if (new_list) {
+                    c->isize *= 2;
+                    c->ilist = new_list;
+                } else {
+                    item_free(it);
+                    it = NULL;
+                    break;
+                }
+            }
+
+            /*
+             * Construct the response. Each hit adds three elements to the
+             * outgoing data list:
+             *   "VALUE "
+             *   key
+             *   " " + flags + " " + data length + "\r\n" + data (with \r\n)
+             */
+
+            if (add_iov(c, "VALUE ", 6) != 0 ||
+               add_iov(c, ITEM_key(it), it->nkey) != 0 ||
+               add_iov(c, ITEM_suffix(it), it->nsuffix + it->nbytes) != 0)
+               {
+                   item_free(it);
+                   it = NULL;
+                   break;
+               }
+
+            if (settings.verbose > 1)
+                fprintf(stderr, ">%d sending key %s\n", c->sfd, ITEM_key(it));
+
+            stats_get_hits++;
+            c->cmd_bytes += it->nbytes - 2;
+            *(c->ilist + i) = it;
+            i++;
+
+        }
+
+        key_token++;
+    }
+
+    c->icurr = c->ilist;
+    c->ileft = i;
+
+    if (settings.verbose > 1)
+        fprintf(stderr, ">%d END\n", c->sfd);
+
+    /*
+        If the loop was terminated because of out-of-memory, it is not
+        reliable to add END\r\n to the buffer, because it might not end
+        in \r\n. So we send SERVER_ERROR instead.
+    */
+    if (key_token->length != 0 || add_iov(c, "END\r\n", 5) != 0
+        || (c->udp && build_udp_headers(c) != 0)) {
+        out_string(c, "SERVER_ERROR out of memory writing get response");
+    }
+    else if (!cork_response(c)) {
+        conn_set_state(c, conn_mwrite);
+        c->msgcurr = 0;
+    }
+
+    STATS_LOCK();
+    stats.get_cmds   += stats_get_cmds;
+    stats.get_hits   += stats_get_hits;
+    STATS_UNLOCK();
+
+    return;
+}
+
+/*
+ * lget <queue> <lease_ms>: like get, but the message stays leased to the
+ * client for lease_ms and comes back to the queue unless it is acked in
+ * time. The receipt to ack it with follows the length on the VALUE line.
+ */
+static void process_lget_command(conn *c, token_t *tokens, const size_t ntokens) {
+    char *key;
+    size_t nkey;
+    unsigned long lease_ms;
+    uint64_t receipt;
+    item *it;
+    char *endptr, *header;
+    int nheader;
+    iov_mark_t mark;
+
+    assert(c != NULL);
+
+    key = tokens[KEY_TOKEN].value;
+    nkey = tokens[KEY_TOKEN].length;
+    lease_ms = strtoul(tokens[2].value, &endptr, 10);
+
+    if (nkey > KEY_MAX_LENGTH || *endptr != '\0' || lease_ms == 0
+        || lease_ms > LEASE_MAX_MS) {
+        out_string(c, "CLIENT_ERROR bad command line format");
         return;
     }
 
-    if (strcmp(subcommand, "queue") == 0) {
-        char temp[512];
-        int ret;
-        ret = print_queue_db_list(temp, 512);
-        if (ret == 0)
-            out_string(c, temp);
-        else
-            out_string(c, "END");
+    STATS_LOCK();
+    stats.lget_cmds++;
+    STATS_UNLOCK();
+
+    receipt = lease_new_receipt();
+    it = bdb_lget(key, nkey, receipt);
+    if (it == NULL) {
+        out_string(c, "END");
         return;
     }
 
-#ifdef HAVE_MALLOC_H
-#ifdef HAVE_STRUCT_MALLINFO
-    if (strcmp(subcommand, "malloc") == 0) {
-        char temp[512];
-        struct mallinfo info;
-        char *pos = temp;
-
-        info = mallinfo();
-        pos += sprintf(pos, "STAT arena_size %d\r\n", info.arena);
-        pos += sprintf(pos, "STAT free_chunks %d\r\n", info.ordblks);
-        pos += sprintf(pos, "STAT fastbin_blocks %d\r\n", info.smblks);
-        pos += sprintf(pos, "STAT mmapped_regions %d\r\n", info.hblks);
-        pos += sprintf(pos, "STAT mmapped_space %d\r\n", info.hblkhd);
-        pos += sprintf(pos, "STAT max_total_alloc %d\r\n", info.usmblks);
-        pos += sprintf(pos, "STAT fastbin_space %d\r\n", info.fsmblks);
-        pos += sprintf(pos, "STAT total_alloc %d\r\n", info.uordblks);
-        pos += sprintf(pos, "STAT total_free %d\r\n", info.fordblks);
-        pos += sprintf(pos, "STAT releasable_space %d\r\nEND", info.keepcost);
-        out_string(c, temp);
+    if (lease_add(receipt, it, lease_ms) != 0) {
+        /* can't track it, so hand it straight back to the queue */
+        bdb_lease_redeliver(receipt, it);
+        item_free(it);
+        out_string(c, "SERVER_ERROR out of memory");
         return;
     }
-#endif /* HAVE_STRUCT_MALLINFO */
-#endif /* HAVE_MALLOC_H */
 
-#if !defined(WIN32) || !defined(__APPLE__)
-    if (strcmp(subcommand, "maps") == 0) {
-        char *wbuf;
-        int wsize = 8192; /* should be enough */
-        int fd;
-        int res;
+    STATS_LOCK();
+    stats.lget_hits++;
+    STATS_UNLOCK();
+    c->cmd_bytes = it->nbytes - 2;
 
-        if ((wbuf = (char *)malloc(wsize)) == NULL) {
-            out_string(c, "SERVER_ERROR out of memory writing stats maps");
-            return;
-        }
+    /*
+     * The suffix " <flags> <bytes>\r\n" is rebuilt with the receipt at the
+     * end, in wbuf, after whatever corked responses already sit there.
+     */
+    if (ensure_wbuf_space(c, it->nsuffix + 24) != 0)
+        goto oom;
+    header = c->wbuf + c->wbused;
+    memcpy(header, ITEM_suffix(it), it->nsuffix - 2);
+    nheader = it->nsuffix - 2;
+    nheader += sprintf(header + nheader, " %llu\r\n", (unsigned long long)receipt);
+
+    if (c->ileft >= c->isize) {
+        item **new_list = realloc(c->ilist, sizeof(item *) * c->isize * 2);
+        if (new_list == NULL)
+            goto oom;
+        c->isize *= 2;
+        c->ilist = new_list;
+    }
+
+    iov_mark(c, &mark);
+    if (add_iov(c, "VALUE ", 6) != 0 ||
+        add_iov(c, ITEM_key(it), it->nkey) != 0 ||
+        add_iov(c, header, nheader) != 0 ||
+        add_iov(c, ITEM_data(it), it->nbytes) != 0 ||
+        add_iov(c, "END\r\n", 5) != 0 ||
+        (c->udp && build_udp_headers(c) != 0)) {
+        iov_rollback(c, &mark);
+        goto oom;
+    }
+    c->wbused += nheader;
 
-        fd = open("/proc/self/maps", O_RDONLY);
-        if (fd == -1) {
-            out_string(c, "SERVER_ERROR cannot open the maps file");
-            free(wbuf);
-            return;
-        }
+    if (settings.verbose > 1)
+        fprintf(stderr, ">%d leasing key %s as %llu\n", c->sfd, ITEM_key(it),
+                (unsigned long long)receipt);
 
-        res = read(fd, wbuf, wsize - 6);  /* 6 = END\r\n\0 */
-        if (res == wsize - 6) {
-            out_string(c, "SERVER_ERROR buffer overflow");
-            free(wbuf); close(fd);
-            return;
-        }
-        if (res == 0 || res == -1) {
-            out_string(c, "SERVER_ERROR can't read the maps file");
-            free(wbuf); close(fd);
-            return;
-        }
-        memcpy(wbuf + res, "END\r\n", 5);
-        write_and_free(c, wbuf, res + 5);
-        close(fd);
+    c->ilist[c->ileft++] = it;
+    c->icurr = c->ilist;
+
+    if (!cork_response(c)) {
+        conn_set_state(c, conn_mwrite);
+        c->msgcurr = 0;
+    }
+    return;
+
+oom:
+    /* the lease stands, the message comes back when it runs out */
+    item_free(it);
+    out_string(c, "SERVER_ERROR out of memory writing lget response");
+}
+
+/* ack <receipt>: the leased message is done with, drop it for good */
+static void process_ack_command(conn *c, token_t *tokens, const size_t ntokens) {
+    unsigned long long receipt;
+    char *endptr;
+
+    assert(c != NULL);
+
+    set_noreply_maybe(c, tokens, ntokens);
+    receipt = strtoull(tokens[1].value, &endptr, 10);
+    if (*endptr != '\0') {
+        noreply_fail_maybe(c);
+        out_string(c, "CLIENT_ERROR bad command line format");
         return;
     }
-#endif
 
-    out_string(c, "ERROR");
+    STATS_LOCK();
+    stats.ack_cmds++;
+    STATS_UNLOCK();
+
+    if (lease_ack(receipt) == 0) {
+        STATS_LOCK();
+        stats.ack_hits++;
+        STATS_UNLOCK();
+        out_string(c, "DELETED");
+    } else {
+        noreply_fail_maybe(c);
+        out_string(c, "NOT_FOUND");
+    }
 }
 
-/* ntokens is overwritten here... shrug.. */
-static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens) {
+/*
+ * peek <queue> [n]: returns the first n messages of the queue (1 by
+ * default) in the same format as get, without consuming them.
+ */
+static void process_peek_command(conn *c, token_t *tokens, const size_t ntokens) {
     char *key;
     size_t nkey;
-    int i = 0;
-    item *it = NULL;
-    token_t *key_token = &tokens[KEY_TOKEN];
-    int stats_get_cmds   = 0;
-    int stats_get_hits   = 0;
+    item *items[PEEK_MAX_ITEMS];
+    long n = 1;
+    int nitems, i, j;
+    char *endptr;
+    iov_mark_t mark;
+
     assert(c != NULL);
 
-    do {
-        while(key_token->length != 0) {
+    key = tokens[KEY_TOKEN].value;
+    nkey = tokens[KEY_TOKEN].length;
 
-            key = key_token->value;
-            nkey = key_token->length;
+    if (ntokens == 4) {
+        n = strtol(tokens[2].value, &endptr, 10);
+        if (*endptr != '\0' || n <= 0) {
+            out_string(c, "CLIENT_ERROR bad command line format");
+            return;
+        }
+        if (n > PEEK_MAX_ITEMS)
+            n = PEEK_MAX_ITEMS;
+    }
 
-            if(nkey > KEY_MAX_LENGTH) {
-                STATS_LOCK();
-                stats.get_cmds   += stats_get_cmds;
-                stats.get_hits   += stats_get_hits;
-                STATS_UNLOCK();
-                out_string(c, "CLIENT_ERROR bad command line format");
-                return;
-            }
+    if (nkey > KEY_MAX_LENGTH) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+
+    nitems = bdb_peek(key, nkey, items, n);
+    if (nitems < 0) {
+        out_string(c, "SERVER_ERROR peek failed");
+        return;
+    }
+
+    STATS_LOCK();
+    stats.peek_cmds++;
+    stats.peek_hits += nitems;
+    STATS_UNLOCK();
+
+    iov_mark(c, &mark);
+    i = c->ileft; /* items of corked responses come first */
+    for (j = 0; j < nitems; j++) {
+        item *it = items[j];
+
+        if (i >= c->isize) {
+            item **new_list = realloc(c->ilist, sizeof(item *) * c->isize * 2);
+            if (new_list == NULL)
+                break;
+            c->isize *= 2;
+            c->ilist = new_list;
+        }
+
+        if (add_iov(c, "VALUE ", 6) != 0 ||
+            add_iov(c, ITEM_key(it), it->nkey) != 0 ||
+            add_iov(c, ITEM_suffix(it), it->nsuffix + it->nbytes) != 0)
+            break;
+
+        if (settings.verbose > 1)
+            fprintf(stderr, ">%d peeking key %s\n", c->sfd, ITEM_key(it));
+
+        *(c->ilist + i) = it;
+        i++;
+    }
+
+    if (j < nitems || add_iov(c, "END\r\n", 5) != 0
+        || (c->udp && build_udp_headers(c) != 0)) {
+        /* out of memory: none of this response goes out, so none of its
+           items stay in ilist */
+        iov_rollback(c, &mark);
+        for (j = 0; j < nitems; j++)
+            item_free(items[j]);
+        out_string(c, "SERVER_ERROR out of memory writing peek response");
+        return;
+    }
+
+    c->icurr = c->ilist;
+    c->ileft = i;
+
+    if (!cork_response(c)) {
+        conn_set_state(c, conn_mwrite);
+        c->msgcurr = 0;
+    }
+}
+
+/*
+ * move <src> <dst> [n] [get]: moves the first n messages of src (1 by
+ * default) to the tail of dst in one transaction. Answers MOVED and how
+ * many, or with "get" the messages themselves, in the same format as get.
+ */
+static void process_move_command(conn *c, token_t *tokens, const size_t ntokens) {
+    char *src, *dst;
+    size_t nsrc, ndst;
+    item *items[MOVE_MAX_ITEMS];
+    long n = 1;
+    bool values = false;
+    int nmoved, nitems, ret, i, j;
+    char *endptr;
+    char temp[32];
+    size_t nbytes = 0;
+    iov_mark_t mark;
+
+    assert(c != NULL);
+
+    src = tokens[KEY_TOKEN].value;
+    nsrc = tokens[KEY_TOKEN].length;
+    dst = tokens[2].value;
+    ndst = tokens[2].length;
 
-            stats_get_cmds++;
+    if (ntokens >= 5 && strcmp(tokens[ntokens - 2].value, "get") == 0) {
+        values = true;
+    }
+    if (ntokens - values == 5) {
+        n = strtol(tokens[3].value, &endptr, 10);
+        if (*endptr != '\0' || n <= 0) {
+            out_string(c, "CLIENT_ERROR bad command line format");
+            return;
+        }
+        if (n > MOVE_MAX_ITEMS)
+            n = MOVE_MAX_ITEMS;
+    } else if (ntokens - values != 4) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
 
-            it = bdb_get(key, nkey);
+    /* onto itself, a move would consume what it just appended */
+    if (nsrc > KEY_MAX_LENGTH || ndst > KEY_MAX_LENGTH
+        || (nsrc == ndst && memcmp(src, dst, nsrc) == 0)) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
 
-            if (it) {
-                if (i >= c->isize) {
-                    item **new_list = realloc(c->ilist, sizeof(item *) * c->isize * 2);
-                    if (new_list) {
-                        c->isize *= 2;
-                        c->ilist = new_list;
-                    } else {
-                        item_free(it);
-                        it = NULL;
-                        break;
-                    }
-                }
+    ret = bdb_move(src, nsrc, dst, ndst, items, n, &nmoved, &nitems);
+    if (ret == 1) {
+        out_string(c, "NOT_FOUND");
+        return;
+    }
+    if (ret != 0) {
+        out_string(c, "SERVER_ERROR move failed");
+        return;
+    }
 
-                /*
-                 * Construct the response. Each hit adds three elements to the
-                 * outgoing data list:
-                 *   "VALUE "
-                 *   key
-                 *   " " + flags + " " + data length + "\r\n" + data (with \r\n)
-                 */
-
-                if (add_iov(c, "VALUE ", 6) != 0 ||
-                   add_iov(c, ITEM_key(it), it->nkey) != 0 ||
-                   add_iov(c, ITEM_suffix(it), it->nsuffix + it->nbytes) != 0)
-                   {
-                       item_free(it);
-                       it = NULL;
-                       break;
-                   }
-
-                if (settings.verbose > 1)
-                    fprintf(stderr, ">%d sending key %s\n", c->sfd, ITEM_key(it));
-
-                stats_get_hits++;
-                *(c->ilist + i) = it;
-                i++;
+    STATS_LOCK();
+    stats.move_cmds++;
+    stats.move_hits += nmoved;
+    stats.move_inflate_fails += nmoved - nitems;
+    STATS_UNLOCK();
 
-            }
+    if (!values) {
+        for (j = 0; j < nitems; j++)
+            item_free(items[j]);
+        snprintf(temp, sizeof(temp), "MOVED %d", nmoved);
+        out_string(c, temp);
+        return;
+    }
 
-            key_token++;
-        }
+    iov_mark(c, &mark);
+    i = c->ileft; /* items of corked responses come first */
+    for (j = 0; j < nitems; j++) {
+        item *it = items[j];
 
-        /*
-         * If the command string hasn't been fully processed, get the next set
-         * of tokens.
-         */
-        if(key_token->value != NULL) {
-            ntokens = tokenize_command(key_token->value, tokens, MAX_TOKENS);
-            key_token = tokens;
+        if (i >= c->isize) {
+            item **new_list = realloc(c->ilist, sizeof(item *) * c->isize * 2);
+            if (new_list == NULL)
+                break;
+            c->isize *= 2;
+            c->ilist = new_list;
         }
 
-    } while(key_token->value != NULL);
+        if (add_iov(c, "VALUE ", 6) != 0 ||
+            add_iov(c, ITEM_key(it), it->nkey) != 0 ||
+            add_iov(c, ITEM_suffix(it), it->nsuffix + it->nbytes) != 0)
+            break;
 
-    c->icurr = c->ilist;
-    c->ileft = i;
+        if (settings.verbose > 1)
+            fprintf(stderr, ">%d moved to key %s\n", c->sfd, ITEM_key(it));
 
-    if (settings.verbose > 1)
-        fprintf(stderr, ">%d END\n", c->sfd);
+        nbytes += it->nbytes - 2;
+        *(c->ilist + i) = it;
+        i++;
+    }
 
-    /*
-        If the loop was terminated because of out-of-memory, it is not
-        reliable to add END\r\n to the buffer, because it might not end
-        in \r\n. So we send SERVER_ERROR instead.
-    */
-    if (key_token->value != NULL || add_iov(c, "END\r\n", 5) != 0
+    if (j < nitems || add_iov(c, "END\r\n", 5) != 0
         || (c->udp && build_udp_headers(c) != 0)) {
-        out_string(c, "SERVER_ERROR out of memory writing get response");
+        /* out of memory: the messages stay moved, but none of them goes
+           out in this response */
+        iov_rollback(c, &mark);
+        for (j = 0; j < nitems; j++)
+            item_free(items[j]);
+        out_string(c, "SERVER_ERROR out of memory writing move response");
+        return;
     }
-    else {
+
+    c->cmd_bytes += nbytes;
+    c->icurr = c->ilist;
+    c->ileft = i;
+
+    if (!cork_response(c)) {
         conn_set_state(c, conn_mwrite);
         c->msgcurr = 0;
     }
-
-    STATS_LOCK();
-    stats.get_cmds   += stats_get_cmds;
-    stats.get_hits   += stats_get_hits;
-    STATS_UNLOCK();
-
-    return;
 }
 
 static void process_update_command(conn *c, token_t *tokens, const size_t ntokens, int comm) {
@@ -1029,7 +1889,13 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
 
     assert(c != NULL);
 
+    if (ntokens == 7 && !set_noreply_maybe(c, tokens, ntokens)) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+
     if (tokens[KEY_TOKEN].length > KEY_MAX_LENGTH) {
+        noreply_fail_maybe(c);
         out_string(c, "CLIENT_ERROR bad command line format");
         return;
     }
@@ -1042,6 +1908,7 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
     vlen = strtol(tokens[4].value, NULL, 10);
 
     if(errno == ERANGE || ((flags == 0 || exptime == 0) && errno == EINVAL)) {
+        noreply_fail_maybe(c);
         out_string(c, "CLIENT_ERROR bad command line format");
         return;
     }
@@ -1049,10 +1916,18 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
     it = item_alloc1(key, nkey, flags, vlen+2);
 
     if (it == NULL) {
-        out_string(c, "SERVER_ERROR out of memory storing object");
         /* swallow the data line */
-        c->write_and_go = conn_swallow;
         c->sbytes = vlen + 2;
+        if (c->noreply) {
+            c->noreply = false;
+            STATS_LOCK();
+            stats.noreply_fails++;
+            STATS_UNLOCK();
+            conn_set_state(c, conn_swallow);
+            return;
+        }
+        out_string(c, "SERVER_ERROR out of memory storing object");
+        c->write_and_go = conn_swallow;
         return;
     }
 
@@ -1068,13 +1943,19 @@ static void process_delete_command(conn *c, token_t *tokens, const size_t ntoken
     size_t nkey;
     int ret;
     assert(c != NULL);
+    set_noreply_maybe(c, tokens, ntokens);
     key = tokens[KEY_TOKEN].value;
     nkey = tokens[KEY_TOKEN].length;
     if(nkey > KEY_MAX_LENGTH) {
+        noreply_fail_maybe(c);
         out_string(c, "CLIENT_ERROR bad command line format");
         return;
     }
-    switch (ret = delete_queue_db(key, nkey)) {
+    ret = delete_queue_db(key, nkey);
+    if (ret != 0) {
+        noreply_fail_maybe(c);
+    }
+    switch (ret) {
     case 0:
         out_string(c, "DELETED");
         break;
@@ -1090,6 +1971,36 @@ static void process_delete_command(conn *c, token_t *tokens, const size_t ntoken
     return;
 }
 
+static void process_purge_command(conn *c, token_t *tokens, const size_t ntokens) {
+    char *key;
+    size_t nkey;
+    int ret;
+    assert(c != NULL);
+    set_noreply_maybe(c, tokens, ntokens);
+    key = tokens[KEY_TOKEN].value;
+    nkey = tokens[KEY_TOKEN].length;
+    if(nkey > KEY_MAX_LENGTH) {
+        noreply_fail_maybe(c);
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+    ret = purge_queue_db(key, nkey);
+    if (ret != 0) {
+        noreply_fail_maybe(c);
+    }
+    switch (ret) {
+    case 0:
+        out_string(c, "PURGED");
+        break;
+    case 1:
+        out_string(c, "NOT_FOUND");
+        break;
+    default:
+        out_string(c, "SERVER_ERROR while purge a queue");
+    }
+    return;
+}
+
 static void process_verbosity_command(conn *c, token_t *tokens, const size_t ntokens) {
     unsigned int level;
 
@@ -1105,47 +2016,130 @@ static void process_verbosity_command(conn *c, token_t *tokens, const size_t nto
     return;
 }
 
-static void process_bdb_command(conn *c, token_t *tokens, const size_t ntokens) {
-	int ret;
+static void process_db_archive_command(conn *c, token_t *tokens, const size_t ntokens) {
+    int ret;
     assert(c != NULL);
 
-    if (strcmp(tokens[COMMAND_TOKEN].value, "db_archive") == 0){
-        if(0 != (ret = envp->log_archive(envp, NULL, DB_ARCH_REMOVE))){
-            if (settings.verbose > 1) {
-                fprintf(stderr, "envp->log_archive: %s\n", db_strerror(ret));
-			}
-            out_string(c, "ERROR");
-        }else{
-            out_string(c, "OK");
+    if(0 != (ret = envp->log_archive(envp, NULL, DB_ARCH_REMOVE))){
+        if (settings.verbose > 1) {
+            fprintf(stderr, "envp->log_archive: %s\n", db_strerror(ret));
         }
-        return;
+        out_string(c, "ERROR");
+    }else{
+        out_string(c, "OK");
+    }
+}
 
-    }else if (strcmp(tokens[COMMAND_TOKEN].value, "db_checkpoint") == 0){
-        if(0 != (ret = envp->txn_checkpoint(envp, 0, 0, 0))){
-            if (settings.verbose > 1) {
-                fprintf(stderr, "envp->txn_checkpoint: %s\n", db_strerror(ret));
-			}
-            out_string(c, "ERROR");
-        }else{
-            out_string(c, "OK");
-        }
-        return;
+static void process_db_checkpoint_command(conn *c, token_t *tokens, const size_t ntokens) {
+    int ret;
+    assert(c != NULL);
 
-    }else {
+    if(0 != (ret = envp->txn_checkpoint(envp, 0, 0, 0))){
+        if (settings.verbose > 1) {
+            fprintf(stderr, "envp->txn_checkpoint: %s\n", db_strerror(ret));
+        }
         out_string(c, "ERROR");
+    }else{
+        out_string(c, "OK");
     }
-    return;
 }
 
+static void process_set_command(conn *c, token_t *tokens, const size_t ntokens) {
+    process_update_command(c, tokens, ntokens, NREAD_SET);
+}
+
+static void process_add_command(conn *c, token_t *tokens, const size_t ntokens) {
+    process_update_command(c, tokens, ntokens, NREAD_ADD);
+}
+
+static void process_version_command(conn *c, token_t *tokens, const size_t ntokens) {
+    out_string(c, "VERSION " VERSION);
+}
 
-static void process_command(conn *c, char *command) {
+static void process_quit_command(conn *c, token_t *tokens, const size_t ntokens) {
+    if (c->corked) {
+        /* an empty response that sends the corked ones, then closes */
+        c->wcurr = c->wbuf + c->wbused;
+        c->wbytes = 0;
+        conn_set_state(c, conn_write);
+        c->write_and_go = conn_closing;
+    } else {
+        conn_set_state(c, conn_closing);
+    }
+}
 
-    token_t tokens[MAX_TOKENS];
+/* command dispatch table, indexed by the length of the command name */
+static const command_t commands_3[] = {
+    COMMAND("get",           3, TOKENS_UNBOUNDED, process_get_command),
+    COMMAND("set",           6, 7,                process_set_command),
+    COMMAND("add",           6, 7,                process_add_command),
+    COMMAND("ack",           3, 4,                process_ack_command),
+    COMMAND_END
+};
+static const command_t commands_4[] = {
+    COMMAND("lget",          4, 4,                process_lget_command),
+    COMMAND("move",          4, 6,                process_move_command),
+    COMMAND("peek",          3, 4,                process_peek_command),
+    COMMAND("quit",          2, 2,                process_quit_command),
+    COMMAND_END
+};
+static const command_t commands_5[] = {
+    COMMAND("stats",         2, TOKENS_UNBOUNDED, process_stat),
+    COMMAND("purge",         3, 4,                process_purge_command),
+    COMMAND_END
+};
+static const command_t commands_6[] = {
+    COMMAND("delete",        3, 5,                process_delete_command),
+    COMMAND_END
+};
+static const command_t commands_7[] = {
+    COMMAND("version",       2, 2,                process_version_command),
+    COMMAND_END
+};
+static const command_t commands_9[] = {
+    COMMAND("verbosity",     3, 3,                process_verbosity_command),
+    COMMAND_END
+};
+static const command_t commands_10[] = {
+    COMMAND("db_archive",    2, 2,                process_db_archive_command),
+    COMMAND_END
+};
+static const command_t commands_13[] = {
+    COMMAND("db_checkpoint", 2, 2,                process_db_checkpoint_command),
+    COMMAND_END
+};
+
+static const command_t *const command_table[] = {
+    NULL, NULL, NULL,
+    commands_3,
+    commands_4,
+    commands_5,
+    commands_6,
+    commands_7,
+    NULL,
+    commands_9,
+    commands_10,
+    NULL, NULL,
+    commands_13
+};
+
+static void process_command(conn *c, char *command, const size_t length) {
+
+    token_t stack_tokens[TOKENS_ON_STACK];
+    token_t *tokens = stack_tokens;
     size_t ntokens;
-    int comm;
+    const command_t *cmd;
+    uint64_t start, t;
 
     assert(c != NULL);
 
+    start = latency_now();
+    if (settings.slowlog_usec > 0) {
+        c->cmd_start = start;
+        c->cmd_bytes = 0;
+        latency_take(NULL);
+    }
+
     if (settings.verbose > 1)
         fprintf(stderr, "<%d %s\n", c->sfd, command);
 
@@ -1154,53 +2148,43 @@ static void process_command(conn *c, char *command) {
      * directly into it, then continue in nread_complete().
      */
 
-    c->msgcurr = 0;
-    c->msgused = 0;
-    c->iovused = 0;
-    if (add_msghdr(c) != 0) {
-        out_string(c, "SERVER_ERROR out of memory preparing response");
-        return;
+    if (!c->corked) {
+        c->msgcurr = 0;
+        c->msgused = 0;
+        c->iovused = 0;
+        if (add_msghdr(c) != 0) {
+            out_string(c, "SERVER_ERROR out of memory preparing response");
+            return;
+        }
     }
 
-    ntokens = tokenize_command(command, tokens, MAX_TOKENS);
-    if (ntokens >= 3 &&
-        (strcmp(tokens[COMMAND_TOKEN].value, "get") == 0) ) {
-
-        process_get_command(c, tokens, ntokens);
-
-    } else if ((ntokens == 6 ) &&
-            (((strcmp(tokens[COMMAND_TOKEN].value, "add") == 0) && (comm = NREAD_ADD)) ||
-             ((strcmp(tokens[COMMAND_TOKEN].value, "set") == 0) && (comm = NREAD_SET)) )) {
-        process_update_command(c, tokens, ntokens, comm);
-    } else if (ntokens >= 3 && ntokens <= 4 && (strcmp(tokens[COMMAND_TOKEN].value, "delete") == 0)) {
-
-        process_delete_command(c, tokens, ntokens);
-
-    } else if (ntokens >= 2 && (strcmp(tokens[COMMAND_TOKEN].value, "stats") == 0)) {
-
-        process_stat(c, tokens, ntokens);
-
-    } else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "version") == 0)) {
-
-        out_string(c, "VERSION " VERSION);
-
-    } else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "quit") == 0)) {
-
-        conn_set_state(c, conn_closing);
-
-    } else if (ntokens == 3 && (strcmp(tokens[COMMAND_TOKEN].value, "verbosity") == 0)) {
-
-        process_verbosity_command(c, tokens, ntokens);
-
-    } else if (ntokens == 2 &&
-              ((strcmp(tokens[COMMAND_TOKEN].value, "db_archive") == 0 ) ||
-               (strcmp(tokens[COMMAND_TOKEN].value, "db_checkpoint") == 0 ))) {
-
-        process_bdb_command(c, tokens, ntokens);
+    /* long multi-gets don't fit on the stack */
+    if (TOKENS_FOR_LINE(length) > TOKENS_ON_STACK) {
+        tokens = malloc(sizeof(token_t) * TOKENS_FOR_LINE(length));
+        if (tokens == NULL) {
+            out_string(c, "SERVER_ERROR out of memory");
+            return;
+        }
+    }
 
+    t = latency_now();
+    ntokens = tokenize_line(command, length, tokens);
+    cmd = lookup_command(command_table, COMMAND_TABLE_SIZE(command_table),
+                         &tokens[COMMAND_TOKEN], ntokens);
+    latency_mark(LATENCY_PARSE, t);
+    if (cmd != NULL) {
+        cmd->handler(c, tokens, ntokens);
     } else {
         out_string(c, "ERROR");
     }
+    /* set and add are done once their data is in, see complete_nread() */
+    if (settings.slowlog_usec > 0 && c->state != conn_nread)
+        slowlog_command_done(c, tokens[COMMAND_TOKEN].value, tokens[COMMAND_TOKEN].length,
+                             ntokens > 2 ? tokens[KEY_TOKEN].value : "", ntokens > 2 ? tokens[KEY_TOKEN].length : 0);
+
+    if (tokens != stack_tokens)
+        free(tokens);
+    latency_mark(LATENCY_PROCESS_COMMAND, start);
     return;
 }
 
@@ -1226,7 +2210,7 @@ static int try_read_command(conn *c) {
 
     assert(cont <= (c->rcurr + c->rbytes));
 
-    process_command(c, c->rcurr);
+    process_command(c, c->rcurr, el - c->rcurr);
 
     c->rbytes -= (cont - c->rcurr);
     c->rcurr = cont;
@@ -1236,42 +2220,255 @@ static int try_read_command(conn *c) {
     return 1;
 }
 
+/*
+ * UDP receive side. Datagrams are read UDP_RECV_BATCH at a time with
+ * recvmmsg() and handed to the state machine one by one. Requests that
+ * span several datagrams are held in one of UDP_REASM_SLOTS slots until
+ * all their packets are in.
+ */
+typedef struct {
+    struct sockaddr addr;       /* who sent it, with request_id the key */
+    socklen_t addr_size;
+    int     request_id;
+    int     total;              /* packets the request has */
+    int     received;           /* packets we have */
+    time_t  started;
+    char    *parts[UDP_REASM_MAX_PACKETS];
+    int     lens[UDP_REASM_MAX_PACKETS];
+} udp_reasm_t;
+
+struct udp_rx {
+    char    *bufs[UDP_RECV_BATCH];
+    int     lens[UDP_RECV_BATCH];
+    struct sockaddr addrs[UDP_RECV_BATCH];
+    socklen_t addr_sizes[UDP_RECV_BATCH];
+    int     count;              /* datagrams in the batch */
+    int     next;               /* next one to hand out */
+    udp_reasm_t reasm[UDP_REASM_SLOTS];
+};
+
+static struct udp_rx *udp_rx_new(void) {
+    struct udp_rx *rx;
+    char *buf;
+    int i;
+
+    rx = (struct udp_rx *)calloc(1, sizeof(struct udp_rx));
+    buf = (char *)malloc((size_t)UDP_RECV_BATCH * UDP_READ_BUFFER_SIZE);
+    if (rx == NULL || buf == NULL) {
+        free(rx);
+        free(buf);
+        return NULL;
+    }
+    for (i = 0; i < UDP_RECV_BATCH; i++)
+        rx->bufs[i] = buf + (size_t)i * UDP_READ_BUFFER_SIZE;
+    return rx;
+}
+
+static void udp_reasm_clear(udp_reasm_t *r) {
+    int i;
+
+    for (i = 0; i < r->total; i++) {
+        if (r->parts[i] != NULL) {
+            free(r->parts[i]);
+            r->parts[i] = NULL;
+        }
+    }
+    r->total = 0;
+    r->received = 0;
+}
+
+static void udp_rx_free(struct udp_rx *rx) {
+    int i;
+
+    for (i = 0; i < UDP_REASM_SLOTS; i++)
+        udp_reasm_clear(&rx->reasm[i]);
+    free(rx->bufs[0]);
+    free(rx);
+}
+
+/*
+ * Reads the next batch of datagrams into c->udp_rx.
+ * Returns the number read, 0 if there was nothing to read.
+ */
+static int udp_read_batch(conn *c) {
+    struct udp_rx *rx = c->udp_rx;
+    int i, res;
+    uint64_t nread = 0;
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr msgs[UDP_RECV_BATCH];
+    struct iovec iovs[UDP_RECV_BATCH];
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < UDP_RECV_BATCH; i++) {
+        iovs[i].iov_base = rx->bufs[i];
+        iovs[i].iov_len = UDP_READ_BUFFER_SIZE;
+        msgs[i].msg_hdr.msg_name = &rx->addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(rx->addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    res = recvmmsg(c->sfd, msgs, UDP_RECV_BATCH, 0, NULL);
+    if (res <= 0)
+        return 0;
+    for (i = 0; i < res; i++) {
+        rx->lens[i] = msgs[i].msg_len;
+        rx->addr_sizes[i] = msgs[i].msg_hdr.msg_namelen;
+        nread += msgs[i].msg_len;
+    }
+#else
+    rx->addr_sizes[0] = sizeof(rx->addrs[0]);
+    res = recvfrom(c->sfd, rx->bufs[0], UDP_READ_BUFFER_SIZE,
+                   0, &rx->addrs[0], &rx->addr_sizes[0]);
+    if (res <= 0)
+        return 0;
+    rx->lens[0] = res;
+    nread = res;
+    res = 1;
+#endif
+
+    rx->count = res;
+    rx->next = 0;
+
+    STATS_LOCK();
+    stats.bytes_read += nread;
+    stats.udp_packets[c->thread] += res;
+    STATS_UNLOCK();
+    return res;
+}
+
+/*
+ * Files one packet of a multi-packet request away. Once the request is
+ * complete, it is copied into rbuf and 1 is returned; 0 means more
+ * packets are needed, -1 that the request can't be taken.
+ */
+static int udp_reassemble(conn *c, const char *buf, const int len,
+                          const int seq, const int total) {
+    struct udp_rx *rx = c->udp_rx;
+    udp_reasm_t *r = NULL, *victim = NULL;
+    time_t now = time(NULL);
+    int i, size;
+
+    if (total > UDP_REASM_MAX_PACKETS || seq >= total)
+        return -1;
+
+    for (i = 0; i < UDP_REASM_SLOTS; i++) {
+        udp_reasm_t *slot = &rx->reasm[i];
+        if (slot->total != 0 &&
+            slot->request_id == c->request_id &&
+            slot->addr_size == c->request_addr_size &&
+            memcmp(&slot->addr, &c->request_addr, c->request_addr_size) == 0) {
+            r = slot;
+            break;
+        }
+        if (slot->total != 0 && now - slot->started > UDP_REASM_TIMEOUT)
+            udp_reasm_clear(slot);
+        /* a free slot if there is one, the oldest request otherwise */
+        if (victim == NULL || (victim->total != 0 &&
+            (slot->total == 0 || slot->started < victim->started)))
+            victim = slot;
+    }
+
+    if (r == NULL) {
+        /* a new request, it takes a free slot or the oldest one */
+        r = victim;
+        udp_reasm_clear(r);
+        r->addr = c->request_addr;
+        r->addr_size = c->request_addr_size;
+        r->request_id = c->request_id;
+        r->total = total;
+        r->started = now;
+    } else if (r->total != total) {
+        udp_reasm_clear(r);
+        return -1;
+    }
+
+    if (r->parts[seq] != NULL)
+        return 0;   /* duplicate */
+    if ((r->parts[seq] = (char *)malloc(len > 0 ? len : 1)) == NULL) {
+        udp_reasm_clear(r);
+        return -1;
+    }
+    memcpy(r->parts[seq], buf, len);
+    r->lens[seq] = len;
+    if (++r->received < r->total)
+        return 0;
+
+    for (size = 0, i = 0; i < r->total; i++)
+        size += r->lens[i];
+    if (size > c->rsize) {
+        char *new_rbuf = (char *)realloc(c->rbuf, size);
+        if (new_rbuf == NULL) {
+            udp_reasm_clear(r);
+            return -1;
+        }
+        c->rbuf = new_rbuf;
+        c->rsize = size;
+    }
+    for (size = 0, i = 0; i < r->total; i++) {
+        memcpy(c->rbuf + size, r->parts[i], r->lens[i]);
+        size += r->lens[i];
+    }
+    udp_reasm_clear(r);
+
+    c->rbytes = size;
+    c->rcurr = c->rbuf;
+    return 1;
+}
+
 /*
  * read a UDP request.
  * return 0 if there's nothing to read.
  */
 static int try_read_udp(conn *c) {
-    int res;
+    struct udp_rx *rx;
 
     assert(c != NULL);
+    assert(c->udp_rx != NULL);
 
-    c->request_addr_size = sizeof(c->request_addr);
-    res = recvfrom(c->sfd, c->rbuf, c->rsize,
-                   0, &c->request_addr, &c->request_addr_size);
-    if (res > 8) {
-        unsigned char *buf = (unsigned char *)c->rbuf;
-        STATS_LOCK();
-        stats.bytes_read += res;
-        STATS_UNLOCK();
+    rx = c->udp_rx;
+    for (;;) {
+        unsigned char *buf;
+        int res, seq, total;
+
+        if (rx->next == rx->count && udp_read_batch(c) == 0)
+            return 0;
+
+        buf = (unsigned char *)rx->bufs[rx->next];
+        res = rx->lens[rx->next];
+        c->request_addr = rx->addrs[rx->next];
+        c->request_addr_size = rx->addr_sizes[rx->next];
+        rx->next++;
+
+        if (res <= UDP_HEADER_SIZE)
+            continue;
 
         /* Beginning of UDP packet is the request ID; save it. */
         c->request_id = buf[0] * 256 + buf[1];
-
-        /* If this is a multi-packet request, drop it. */
-        if (buf[4] != 0 || buf[5] != 1) {
-            out_string(c, "SERVER_ERROR multi-packet request not supported");
-            return 0;
-        }
+        seq = buf[2] * 256 + buf[3];
+        total = buf[4] * 256 + buf[5];
 
         /* Don't care about any of the rest of the header. */
-        res -= 8;
-        memmove(c->rbuf, c->rbuf + 8, res);
+        buf += UDP_HEADER_SIZE;
+        res -= UDP_HEADER_SIZE;
 
-        c->rbytes += res;
-        c->rcurr = c->rbuf;
-        return 1;
+        if (total == 1 && seq == 0) {
+            memcpy(c->rbuf, buf, res);
+            c->rbytes = res;
+            c->rcurr = c->rbuf;
+            return 1;
+        }
+
+        switch (udp_reassemble(c, (char *)buf, res, seq, total)) {
+        case 1:
+            return 1;
+        case -1:
+            c->rbytes = 0;
+            out_string(c, "SERVER_ERROR multi-packet request too large");
+            return 1;
+        }
+        /* more packets to come, look at the next datagram */
     }
-    return 0;
 }
 
 /*
@@ -1395,6 +2592,38 @@ void accept_new_conns(const bool do_accept) {
  *   TRANSMIT_SOFT_ERROR Can't write any more right now.
  *   TRANSMIT_HARD_ERROR Can't write (c->state is set to conn_closing)
  */
+#ifdef HAVE_SENDMMSG
+/*
+ * Sends up to UDP_SEND_BATCH of the pending UDP packets with one
+ * sendmmsg(). Returns the number of packets sent, or -1 with errno set.
+ */
+static int send_udp_batch(conn *c) {
+    struct mmsghdr msgs[UDP_SEND_BATCH];
+    uint64_t written = 0;
+    int i, n, res;
+
+    n = c->msgused - c->msgcurr;
+    if (n > UDP_SEND_BATCH)
+        n = UDP_SEND_BATCH;
+    for (i = 0; i < n; i++) {
+        msgs[i].msg_hdr = c->msglist[c->msgcurr + i];
+        msgs[i].msg_len = 0;
+    }
+
+    res = sendmmsg(c->sfd, msgs, n, 0);
+    if (res > 0) {
+        for (i = 0; i < res; i++)
+            written += msgs[i].msg_len;
+        c->msgcurr += res;
+
+        STATS_LOCK();
+        stats.bytes_written += written;
+        STATS_UNLOCK();
+    }
+    return res;
+}
+#endif
+
 static int transmit(conn *c) {
     assert(c != NULL);
 
@@ -1406,8 +2635,23 @@ static int transmit(conn *c) {
     if (c->msgcurr < c->msgused) {
         ssize_t res;
         struct msghdr *m = &c->msglist[c->msgcurr];
-
+        uint64_t t = latency_now();
+
+#ifdef HAVE_SENDMMSG
+        if (c->udp && c->msgused - c->msgcurr > 1) {
+            /* the packets of a UDP response go out together */
+            res = send_udp_batch(c);
+            latency_mark(LATENCY_TRANSMIT, t);
+            if (res > 0)
+                return TRANSMIT_INCOMPLETE;
+        } else {
+            res = sendmsg(c->sfd, m, 0);
+            latency_mark(LATENCY_TRANSMIT, t);
+        }
+#else
         res = sendmsg(c->sfd, m, 0);
+        latency_mark(LATENCY_TRANSMIT, t);
+#endif
         if (res > 0) {
             STATS_LOCK();
             stats.bytes_written += res;
@@ -1493,9 +2737,20 @@ static void drive_machine(conn *c) {
             break;
 
         case conn_read:
+            if (c->corked && c->iovused >= CORK_IOV_HIGHWAT) {
+                conn_set_state(c, conn_mwrite);
+                c->msgcurr = 0;
+                break;
+            }
             if (try_read_command(c) != 0) {
                 continue;
             }
+            /* no complete command left in rbuf, send the corked batch */
+            if (c->corked) {
+                conn_set_state(c, conn_mwrite);
+                c->msgcurr = 0;
+                break;
+            }
             if ((c->udp ? try_read_udp(c) : try_read_network(c)) != 0) {
                 continue;
             }
@@ -1605,9 +2860,10 @@ static void drive_machine(conn *c) {
             /*
              * We want to write out a simple response. If we haven't already,
              * assemble it into a msgbuf list (this will be a single-entry
-             * list for TCP or a two-entry list for UDP).
+             * list for TCP or a two-entry list for UDP). Responses to
+             * pipelined commands are appended behind the corked ones.
              */
-            if (c->iovused == 0 || (c->udp && c->iovused == 1)) {
+            if (c->corked || c->iovused == 0 || (c->udp && c->iovused == 1)) {
                 if (add_iov(c, c->wcurr, c->wbytes) != 0 ||
                     (c->udp && build_udp_headers(c) != 0)) {
                     if (settings.verbose > 0)
@@ -1615,6 +2871,11 @@ static void drive_machine(conn *c) {
                     conn_set_state(c, conn_closing);
                     break;
                 }
+                if (!c->write_and_free && c->write_and_go == conn_read &&
+                    cork_response(c)) {
+                    break;
+                }
+                c->corked = false;
             }
 
             /* fall through... */
@@ -1622,13 +2883,17 @@ static void drive_machine(conn *c) {
         case conn_mwrite:
             switch (transmit(c)) {
             case TRANSMIT_COMPLETE:
+                /* corked get responses may ride along with a simple one */
+                while (c->ileft > 0) {
+                    item *it = *(c->icurr);
+                    item_free(it);
+                    c->icurr++;
+                    c->ileft--;
+                }
+                c->corked = false;
+                c->wbused = 0;
+                slowlog_response_sent(c);
                 if (c->state == conn_mwrite) {
-                    while (c->ileft > 0) {
-                        item *it = *(c->icurr);
-                        item_free(it);
-                        c->icurr++;
-                        c->ileft--;
-                    }
                     conn_set_state(c, conn_read);
                 } else if (c->state == conn_write) {
                     if (c->write_and_free) {
@@ -1741,8 +3006,36 @@ static void maximize_sndbuf(const int sfd) {
         fprintf(stderr, "<%d send buffer was %d, now %d\n", sfd, old_size, last_good);
 }
 
+/*
+ * Opens one more UDP socket on the address of a SO_REUSEPORT one, so that
+ * another worker thread gets a socket of its own. Returns -1 on failure.
+ */
+static int server_socket_reuseport(struct addrinfo *ai) {
+#ifdef SO_REUSEPORT
+    int sfd;
+    int flags = 1;
+
+    if ((sfd = new_socket(ai)) == -1)
+        return -1;
+
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+    if (setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags)) != 0 ||
+        bind(sfd, ai->ai_addr, ai->ai_addrlen) == -1) {
+        if (settings.verbose > 0)
+            perror("SO_REUSEPORT socket");
+        close(sfd);
+        return -1;
+    }
+    maximize_sndbuf(sfd);
+    return sfd;
+#else
+    return -1;
+#endif
+}
+
 static int server_socket(const int port, const bool is_udp) {
     int sfd;
+    bool reuseport = false;
     struct linger ling = {0, 0};
     struct addrinfo *ai;
     struct addrinfo *next;
@@ -1791,6 +3084,11 @@ static int server_socket(const int port, const bool is_udp) {
         setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
         if (is_udp) {
             maximize_sndbuf(sfd);
+#ifdef SO_REUSEPORT
+            /* a socket per worker thread; the kernel spreads flows over them */
+            reuseport = settings.num_threads > 1 &&
+                setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags)) == 0;
+#endif
         } else {
             setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
             setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
@@ -1821,8 +3119,14 @@ static int server_socket(const int port, const bool is_udp) {
         int c;
 
         for (c = 0; c < settings.num_threads; c++) {
+            int thread_sfd = sfd;
+
+            /* a thread that can't have its own socket shares the first one */
+            if (c > 0 && reuseport && (thread_sfd = server_socket_reuseport(next)) == -1)
+                thread_sfd = sfd;
+
             /* this is guaranteed to hit all threads because we round-robin */
-            dispatch_conn_new(sfd, conn_read, EV_READ | EV_PERSIST,
+            dispatch_conn_new(thread_sfd, conn_read, EV_READ | EV_PERSIST,
                               UDP_READ_BUFFER_SIZE, 1);
         }
       } else {
@@ -1939,17 +3243,29 @@ static void usage(void) {
 #ifdef USE_THREADS
     printf("-t <num>      number of threads to use, default 4\n");
 #endif
+    printf("-W <num>      log requests that take <num> microseconds or more to \"stats slowlog\",\n"
+           "              0 for disable, default is 0\n");
     printf("--------------------BerkeleyDB Options-------------------------------\n");
     printf("-m <num>      in-memmory cache size of BerkeleyDB in megabytes, default is 64MB\n");
     printf("-A <num>      underlying page size in bytes, default is 4096, (512B ~ 64KB, power-of-two)\n");
     printf("-H <dir>      env home of database, default is '/data1/memcacheq'\n");
     printf("-L <num>      log buffer size in kbytes, default is 32KB\n");
     printf("-C <num>      do checkpoint every <num> seconds, 0 for disable, default is 5 minutes\n");
-    printf("-T <num>      do memp_trickle every <num> seconds, 0 for disable, default is 30 seconds\n");
-    printf("-e <num>      percent of the pages in the cache that should be clean, default is 60%%\n");
+    printf("-k <num>      also once <num> kbytes of log are written since the last, 0 for disable, default is 0\n");
+    printf("-Y <num>      also once recovery would take about <num> seconds, 0 for disable, default is 0\n");
+    printf("-F <num>      after each checkpoint, remove the log files recovery no longer needs\n"
+           "              but the newest <num>, default is off\n");
+    printf("-X <dir>      with -F, copy those log files to <dir> before removing them\n");
+    printf("-T <num>      do memp_trickle every <num> seconds, more often when dirty pages get evicted,\n"
+           "              0 for disable, default is 30 seconds\n");
+    printf("-e <num>      percent of the pages in the cache that should be clean, more when dirty pages\n"
+           "              get evicted, default is 60%%\n");
     /* queue only */
     printf("-E <num>      how many pages in a single db file, default is 131072, 0 for disable\n");
     printf("-B <num>      specify the message body length in bytes, default is 1024\n");
+    printf("              (longer messages, up to 1MB, are split across several records)\n");
+    printf("-Q <num>      keep at most <num> queues open, closing the least recently used,\n"
+           "              0 for no limit, default is 0\n");
 
     printf("-D <num>      do deadlock detecting every <num> millisecond, 0 for disable, default is 100ms\n");
     printf("-N            enable DB_TXN_NOSYNC to gain big performance improved, default is off\n");
@@ -2162,7 +3478,7 @@ int main (int argc, char **argv) {
     setbuf(stderr, NULL);
 
     /* process arguments */
-    while ((c = getopt(argc, argv, "a:U:p:s:c:hivl:dru:P:t:f:H:m:A:L:C:T:e:D:E:B:NMSR:O:")) != -1) {
+    while ((c = getopt(argc, argv, "a:U:p:s:c:hivl:dru:P:t:f:H:m:A:L:C:T:e:D:E:B:NMSR:O:W:Q:k:Y:F:X:")) != -1) {
         switch (c) {
         case 'a':
             /* access for unix domain socket, as octal mask (like chmod)*/
@@ -2181,6 +3497,9 @@ int main (int argc, char **argv) {
         case 'c':
             settings.maxconns = atoi(optarg);
             break;
+        case 'W':
+            settings.slowlog_usec = strtoul(optarg, NULL, 10);
+            break;
         case 'h':
             usage();
             exit(EXIT_SUCCESS);
@@ -2230,6 +3549,18 @@ int main (int argc, char **argv) {
         case 'C':
             bdb_settings.chkpoint_val = atoi(optarg);
             break;
+        case 'k':
+            bdb_settings.chkpoint_kbyte = atoi(optarg);
+            break;
+        case 'Y':
+            bdb_settings.chkpoint_recovery = atoi(optarg);
+            break;
+        case 'F':
+            bdb_settings.log_retain = atoi(optarg);
+            break;
+        case 'X':
+            bdb_settings.log_archive_dir = optarg;
+            break;
         case 'T':
             bdb_settings.memp_trickle_val = atoi(optarg);
             break;
@@ -2253,6 +3584,9 @@ int main (int argc, char **argv) {
         case 'N':
             bdb_settings.txn_nosync = 1;
             break;
+        case 'Q':
+            bdb_settings.max_open_queues = atoi(optarg);
+            break;
 
         default:
             fprintf(stderr, "Illegal argument \"%c\"\n", c);
@@ -2339,6 +3673,7 @@ int main (int argc, char **argv) {
     /* initialize other stuff */
     item_init();
     stats_init();
+    latency_init(settings.num_threads);
     conn_init();
 
     /*
@@ -2393,11 +3728,16 @@ int main (int argc, char **argv) {
     /* here we init bdb env and open db */
     bdb_env_init();
     bdb_qlist_db_open();
+    bdb_chunk_db_open();
+    bdb_lease_db_open();
+    lease_init();
 
     /* start checkpoint and deadlock detect thread */
     start_chkpoint_thread();
     start_memp_trickle_thread();
     start_dl_detect_thread();
+    start_lease_thread();
+    start_reap_thread();
 
     /* enter the event loop */
     event_base_loop(main_base, 0);
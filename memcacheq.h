@@ -34,6 +34,16 @@
 #define UDP_READ_BUFFER_SIZE 65536
 #define UDP_MAX_PAYLOAD_SIZE 1400
 #define UDP_HEADER_SIZE 8
+
+/** Datagrams read per recvmmsg() call, packets sent per sendmmsg() call. */
+#define UDP_RECV_BATCH 16
+#define UDP_SEND_BATCH 64
+
+/** Multi-packet requests reassembled at a time on each UDP connection. */
+#define UDP_REASM_SLOTS 8
+#define UDP_REASM_MAX_PACKETS 64
+/** Seconds a partly received request is kept around. */
+#define UDP_REASM_TIMEOUT 5
 #define MAX_SENDBUF_SIZE (256 * 1024 * 1024)
 /* I'm told the max legnth of a 64-bit num converted to string is 20 bytes.
  * Plus a few for spaces, \r\n, \0 */
@@ -42,6 +52,21 @@
 /** Initial size of list of items being returned by "get". */
 #define ITEM_LIST_INITIAL 200
 
+/**
+ * Largest message a set takes. Messages that don't fit in one queue record
+ * (-B) are split across chunk records, see bdb.c.
+ */
+#define ITEM_SIZE_MAX (1024 * 1024)
+
+/** Most messages a single "peek" returns. */
+#define PEEK_MAX_ITEMS 100
+
+/** Most messages a single "move" takes. */
+#define MOVE_MAX_ITEMS 100
+
+/** Longest lease "lget" grants, in milliseconds. */
+#define LEASE_MAX_MS (12 * 3600 * 1000)
+
 /** Initial size of the sendmsg() scatter/gather array. */
 #define IOV_LIST_INITIAL 400
 
@@ -85,9 +110,22 @@ struct stats {
     uint64_t      get_hits;
     uint64_t      set_cmds;
     uint64_t      set_hits;
+    uint64_t      peek_cmds;
+    uint64_t      peek_hits;
+    uint64_t      move_cmds;
+    uint64_t      move_hits;        /* messages moved */
+    uint64_t      move_inflate_fails; /* moved, but didn't decompress for the reply */
+    uint64_t      lget_cmds;
+    uint64_t      lget_hits;
+    uint64_t      ack_cmds;
+    uint64_t      ack_hits;
+    uint64_t      lease_expired;    /* leases redelivered after their timeout */
+    unsigned int  curr_leases;
+    uint64_t      noreply_fails;    /* failed set/add/delete with no reply sent */
     time_t        started;          /* when the process was started */
     uint64_t      bytes_read;
     uint64_t      bytes_written;
+    uint64_t      *udp_packets;     /* datagrams read, per worker thread */
 };
 
 #define MAX_VERBOSITY_LEVEL 2
@@ -101,6 +139,7 @@ struct settings {
     char *socketpath;   /* path to unix socket if using local socket */
     int access;  /* access mask (a la chmod) for unix domain socket */
     int num_threads;        /* number of libevent threads to run */
+    unsigned int slowlog_usec;  /* slow log threshold, 0 for no slow log */
 };
 
 extern struct stats stats;
@@ -120,22 +159,33 @@ struct bdb_settings {
     int txn_nosync;    /* DB_TXN_NOSYNC flag, if 1 will lose transaction's durability for performance */
     int dldetect_val; /* do deadlock detect every *db_lock_detect_val* millisecond, 0 for disable */
     int chkpoint_val;  /* do checkpoint every *db_chkpoint_val* second, 0 for disable */
+    u_int32_t chkpoint_kbyte; /* or once this much log is written since the last, 0 for disable */
+    int chkpoint_recovery; /* or once recovery would take this many seconds, 0 for disable */
+    int log_retain;    /* after a checkpoint, drop log files not needed for recovery but this many newest, -1 for disable */
+    char *log_archive_dir; /* copy the log files there before dropping them, NULL to just remove them */
     int memp_trickle_val;  /* do memp_trickle every *memp_trickle_val* second, 0 for disable */
     int memp_trickle_percent; /* percent of the pages in the cache that should be clean.*/
     u_int32_t db_flags; /* database open flags */
     u_int32_t env_flags; /* env open flags */
     u_int32_t re_len;
     u_int32_t q_extentsize;
+    unsigned int max_open_queues; /* queue handles kept open, the least recently used are closed, 0 for no limit */
 };
 
 /* queue record, for updating queue length*/
 /* added by xunxin*/
 typedef struct {
-    DB* queue_dbp;
+    DB* queue_dbp;      /* as filled in by get_queue_db_handle(), stale in queue.list */
     u_int32_t max_size;
     u_int32_t size;
+    u_int32_t flags;    /* QUEUE_* flags, 0 for queues from older versions */
 } queue_rec_t;
 
+/* messages are compressed when that saves space */
+#define QUEUE_COMPRESS 1
+/* a deleted queue whose files are still to be reclaimed, see delete_queue_db() */
+#define QUEUE_DEAD 2
+
 
 extern struct bdb_settings bdb_settings;
 extern struct bdb_version bdb_version;
@@ -144,6 +194,7 @@ typedef struct _stritem {
     int             nbytes;     /* size of data */
     uint8_t         nsuffix;    /* length of flags-and-length string */
     uint8_t         nkey;       /* key length, w/terminating null and padding */
+    uint8_t         it_flags;   /* ITEM_* flags below, stored with the item */
     void * end[];
     /* then null-terminated key */
     /* then " flags length\r\n" (no terminating null) */
@@ -156,6 +207,9 @@ typedef struct msg_queue_t {
   /*char pads[80];*/
 } msg_queue_t;
 
+/* the data is lz_compress()ed, behind its uncompressed length */
+#define ITEM_COMPRESSED 1
+
 #define ITEM_key(item) ((char*)&((item)->end[0]))
 
 /* warning: don't use these macros with a function, as it evals its arg twice */
@@ -173,6 +227,29 @@ enum conn_states {
     conn_mwrite,     /** writing out many items sequentially */
 };
 
+/* a slow log entry, see slowlog.c */
+enum slowlog_phase {
+    SLOWLOG_TXN_BEGIN,
+    SLOWLOG_QLIST,      /* queue.list lookup, lock waits included */
+    SLOWLOG_DATA,       /* DB_CONSUME or DB_APPEND, lock waits included */
+    SLOWLOG_COMMIT,
+    SLOWLOG_TRANSMIT,   /* from the response being ready until it was sent */
+    SLOWLOG_PHASES
+};
+
+#define SLOWLOG_QUEUE_MAX 64    /* longer queue names are cut short */
+
+typedef struct {
+    uint64_t start;         /* latency_now() when the command came in, 0 if none */
+    uint64_t done;          /* latency_now() when its response was ready */
+    uint32_t usec[SLOWLOG_PHASES];
+    uint32_t total_usec;
+    uint32_t nbytes;        /* message bytes stored or fetched */
+    time_t   when;
+    char     command[16];
+    char     queue[SLOWLOG_QUEUE_MAX + 1];
+} slowlog_entry_t;
+
 typedef struct conn conn;
 struct conn {
     int    sfd;
@@ -190,6 +267,7 @@ struct conn {
     char   *wcurr;
     int    wsize;
     int    wbytes;
+    int    wbused;  /** bytes of wbuf held by corked responses */
     int    write_and_go; /** which state to go into after finishing current write */
     void   *write_and_free; /** free this memory after finishing writing */
 
@@ -206,6 +284,7 @@ struct conn {
 
     void   *item;     /* for commands set/add/replace  */
     int    item_comm; /* which one is it: set/add/replace */
+    bool   noreply;   /* don't send a reply for the current command */
 
     /* data for the swallow state */
     int    sbytes;    /* how many bytes to swallow */
@@ -220,6 +299,7 @@ struct conn {
     int    msgused;   /* number of elements used in msglist[] */
     int    msgcurr;   /* element in msglist[] being transmitted now */
     int    msgbytes;  /* number of bytes in current msg */
+    bool   corked;    /* responses are queued in msglist but not sent yet */
 
     item   **ilist;   /* list of items to write out */
     int    isize;
@@ -233,6 +313,13 @@ struct conn {
     socklen_t request_addr_size;
     unsigned char *hdrbuf; /* udp packet headers */
     int    hdrsize;   /* number of headers' worth of space is allocated */
+    struct udp_rx *udp_rx; /* datagrams read ahead, requests being reassembled */
+    int    thread;    /* index of the worker thread that serves this conn */
+
+    /* data for the slow log */
+    uint64_t cmd_start; /* latency_now() when the current command came in */
+    uint32_t cmd_bytes; /* message bytes the current command moved */
+    slowlog_entry_t slow; /* slowest command whose response is still to go out */
     conn   *next;     /* Used for generating a list of conn structures */
 };
 
@@ -245,19 +332,35 @@ void bdb_settings_init(void);
 void bdb_env_init(void);
 
 void bdb_qlist_db_open(void);
+void bdb_chunk_db_open(void);
 int delete_queue_db(char *queue_name, size_t queue_name_size);
-int print_queue_db_list(char *buf, size_t buf_size);
+int purge_queue_db(char *queue_name, size_t queue_name_size);
+char *bdb_queue_stats(const char *prefix, size_t nprefix, unsigned int offset, unsigned int limit,
+                      const bool detail, int *bytes);
+char *bdb_compress_stats(int *bytes);
 item *bdb_get(char *key, size_t nkey);
+int bdb_peek(char *key, size_t nkey, item **items, int max_items);
 int bdb_add(char *key, size_t nkey, item *it);
 int bdb_put(char *key, size_t nkey, item *it);
+int bdb_move(char *src, size_t nsrc, char *dst, size_t ndst, item **items, int max_items,
+             int *nmoved, int *nitems);
+void bdb_lease_db_open(void);
+item *bdb_lget(char *key, size_t nkey, uint64_t receipt);
+int bdb_lease_delete(uint64_t *receipts, int nreceipts);
+int bdb_lease_redeliver(uint64_t receipt, item *it);
 
 void start_chkpoint_thread(void);
 void start_memp_trickle_thread(void);
 void start_dl_detect_thread(void);
+void start_reap_thread(void);
 void bdb_db_close(void);
 void bdb_env_close(void);
 void bdb_chkpoint(void);
 
+/* room for what print_bdb_env_stats() writes */
+#define BDB_ENV_STATS_SIZE 4096
+int print_bdb_env_stats(char *buf);
+
 /* ibuffer management */
 void item_init(void);
 item *do_item_from_freelist(void);
@@ -270,6 +373,45 @@ int item_put(char *key, size_t nkey, item *it);
 int item_delete(char *key, size_t nkey);
 int item_exists(char *key, size_t nkey);
 
+/* compression */
+size_t lz_compress(const char *src, const size_t src_size, char *dst, const size_t dst_size);
+int lz_decompress(const char *src, const size_t src_size, char *dst, const size_t dst_size);
+
+/* latency histograms, see latency.c for the phase names */
+enum latency_phase {
+    LATENCY_PROCESS_COMMAND,
+    LATENCY_PARSE,          /* tokenizing and command lookup */
+    LATENCY_TRANSMIT,
+    LATENCY_GET_TXN_BEGIN,
+    LATENCY_GET_QLIST,      /* queue.list lookup */
+    LATENCY_GET_CONSUME,    /* DB_CONSUME, chunks and length update */
+    LATENCY_GET_COMMIT,
+    LATENCY_PUT_TXN_BEGIN,
+    LATENCY_PUT_QLIST,
+    LATENCY_PUT_APPEND,     /* DB_APPEND, chunks and length update */
+    LATENCY_PUT_COMMIT,
+    LATENCY_PHASES
+};
+
+void latency_init(int nthreads);
+uint64_t latency_now(void);
+uint64_t latency_mark(const int phase, const uint64_t start);
+void latency_reset(void);
+void latency_take(uint64_t *phases);
+uint64_t latency_window(const int phase, const double q);
+char *latency_stats(int *bytes);
+
+/* slow log, see slowlog.c */
+void slowlog_add(const slowlog_entry_t *e);
+char *slowlog_stats(int *bytes);
+
+/* leases */
+void lease_init(void);
+uint64_t lease_new_receipt(void);
+int lease_add(uint64_t receipt, item *it, unsigned int lease_ms);
+int lease_ack(uint64_t receipt);
+void start_lease_thread(void);
+
 /* conn management */
 conn *do_conn_from_freelist();
 bool do_conn_add_to_freelist(conn *c);
@@ -298,6 +440,7 @@ void dispatch_conn_new(int sfd, int init_state, int event_flags, int read_buffer
 conn *mt_conn_from_freelist(void);
 bool  mt_conn_add_to_freelist(conn *c);
 int   mt_is_listen_thread(void);
+int   mt_thread_index(void);
 item *mt_item_from_freelist(void);
 int mt_item_add_to_freelist(item *it);
 void  mt_stats_lock(void);
@@ -309,6 +452,7 @@ int   mt_store_item(item *item, int comm);
 # define conn_from_freelist()        mt_conn_from_freelist()
 # define conn_add_to_freelist(x)     mt_conn_add_to_freelist(x)
 # define is_listen_thread()          mt_is_listen_thread()
+# define thread_index()              mt_thread_index()
 # define item_from_freelist()        mt_item_from_freelist()
 # define item_add_to_freelist(x)     mt_item_add_to_freelist(x)
 # define store_item(x,y)             mt_store_item(x,y)
@@ -326,6 +470,7 @@ int   mt_store_item(item *item, int comm);
 # define dispatch_conn_new(x,y,z,a,b) conn_new(x,y,z,a,b,main_base)
 # define dispatch_event_add(t,c)      event_add(&(c)->event, 0)
 # define is_listen_thread()           1
+# define thread_index()               0
 # define item_from_freelist()         do_item_from_freelist()
 # define item_add_to_freelist(x)      do_item_add_to_freelist(x)
 # define store_item(x,y)              do_store_item(x,y)
@@ -346,4 +491,6 @@ int   mt_store_item(item *item, int comm);
 
 extern DB_ENV *envp;
 extern DB *qlist_dbp;
+extern DB *lease_dbp;
+extern DB *chunk_dbp;
 extern int daemon_quit;
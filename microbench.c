@@ -0,0 +1,583 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *  MemcacheQ - Simple Queue Service over Memcache
+ *
+ *      http://memcacheq.googlecode.com
+ *
+ *  Copyright 2008 Steve Chu.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ *  mcq-microbench: times the server's hot-path functions in-process,
+ *  without any network in the way.
+ *
+ *  Usage: mcq-microbench [-n <iterations>] [-t <threads>] [-H <dir>] [benchmark ...]
+ *
+ *  The allocator, freelist, iov and storage benchmarks run in 1, 2, 4 ...
+ *  up to -t threads at once, over a few message sizes; the storage ones
+ *  only with -H, as they need a BerkeleyDB environment to write to.
+ *
+ */
+
+/*
+ * The functions we want to time are static, so the server is pulled in
+ * whole and its main() renamed out of the way.
+ */
+#define main memcacheq_main
+#include "memcacheq.c"
+#undef main
+
+#include <sys/time.h>
+#include <pthread.h>
+
+#define BENCH_DEFAULT_ITERATIONS 1000000
+#define BENCH_LINE_SIZE 4096
+#define BENCH_BDB_SCALE 100     /* storage benchmarks do 1/100 of the iterations */
+#define BENCH_QUEUE "mcq-microbench"
+
+/* results land here so the compiler can't drop the work */
+static volatile size_t bench_sink;
+
+static double bench_now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e9 + tv.tv_usec * 1e3;
+}
+
+static void bench_report(const char *name, const long ops, const double ns) {
+    printf("%-28s %12ld ops %10.1f ns/op %14.0f ops/s\n",
+           name, ops, ns / ops, ops / (ns / 1e9));
+}
+
+/* typical command lines, as the parser sees them (without \r\n) */
+static const char *bench_lines[] = {
+    "get initial",
+    "set initial 0 0 1024",
+    "get preprocessed",
+    "set preprocessed 0 0 4000 noreply",
+    "get q1 q2 q3 q4 q5 q6 q7 q8 q9 q10",
+    "get pagecat:0 pagecat:1 pagecat:2 pagecat:3 pagecat:4 pagecat:5 pagecat:6"
+        " pagecat:7 pagecat:8 pagecat:9 pagecat:10 pagecat:11 pagecat:12"
+        " pagecat:13 pagecat:14 pagecat:15 pagecat:16 pagecat:17 pagecat:18"
+        " pagecat:19 pagecat:20 pagecat:21 pagecat:22 pagecat:23 pagecat:24"
+        " pagecat:25 pagecat:26 pagecat:27 pagecat:28 pagecat:29 pagecat:30"
+        " pagecat:31 pagecat:32 pagecat:33 pagecat:34 pagecat:35 pagecat:36"
+        " pagecat:37 pagecat:38 pagecat:39",
+    "delete done",
+    "stats queue",
+    "version",
+};
+
+#define BENCH_NLINES (sizeof(bench_lines) / sizeof(bench_lines[0]))
+
+static size_t bench_lengths[BENCH_NLINES];
+
+/* copies a sample line into buf, as try_read_command() leaves it in rbuf */
+static inline size_t bench_line(char *buf, const long i) {
+    const size_t length = bench_lengths[i % BENCH_NLINES];
+    memcpy(buf, bench_lines[i % BENCH_NLINES], length + 1);
+    return length;
+}
+
+#define SCALAR_MAX_TOKENS 8
+
+/*
+ * The byte-at-a-time tokenizer process_command() used before
+ * tokenize_line(). It stops after max_tokens - 1 tokens and leaves the
+ * rest of the line in the terminal token, so multi-gets came back for more.
+ */
+static size_t scalar_tokenize_command(char *command, token_t *tokens, const size_t max_tokens) {
+    char *s, *e;
+    size_t ntokens = 0;
+
+    for (s = e = command; ntokens < max_tokens - 1; ++e) {
+        if (*e == ' ') {
+            if (s != e) {
+                tokens[ntokens].value = s;
+                tokens[ntokens].length = e - s;
+                ntokens++;
+                *e = '\0';
+            }
+            s = e + 1;
+        }
+        else if (*e == '\0') {
+            if (s != e) {
+                tokens[ntokens].value = s;
+                tokens[ntokens].length = e - s;
+                ntokens++;
+            }
+            break;
+        }
+    }
+
+    tokens[ntokens].value =  *e == '\0' ? NULL : e;
+    tokens[ntokens].length = 0;
+    ntokens++;
+
+    return ntokens;
+}
+
+/* the strcmp() chain process_command() used before the dispatch tables */
+static int strcmp_dispatch(token_t *tokens, size_t ntokens) {
+    char *name = tokens[COMMAND_TOKEN].value;
+
+    if (ntokens >= 3 && strcmp(name, "get") == 0)
+        return 1;
+    if ((ntokens == 6 || ntokens == 7) && (strcmp(name, "add") == 0 || strcmp(name, "set") == 0))
+        return 2;
+    if (ntokens >= 3 && ntokens <= 5 && strcmp(name, "delete") == 0)
+        return 3;
+    if (ntokens >= 2 && strcmp(name, "stats") == 0)
+        return 4;
+    if (ntokens == 2 && strcmp(name, "version") == 0)
+        return 5;
+    if (ntokens == 2 && strcmp(name, "quit") == 0)
+        return 6;
+    if (ntokens == 3 && strcmp(name, "verbosity") == 0)
+        return 7;
+    if (ntokens == 2 && (strcmp(name, "db_archive") == 0 || strcmp(name, "db_checkpoint") == 0))
+        return 8;
+    return 0;
+}
+
+/* the old tokenizer over whole lines, rescanning multi-gets as they did */
+static void bench_tokenize_scalar(const long n) {
+    char buf[BENCH_LINE_SIZE];
+    token_t tokens[SCALAR_MAX_TOKENS];
+    size_t ntokens, sum = 0;
+    double start;
+    long i;
+
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+        bench_line(buf, i);
+        ntokens = scalar_tokenize_command(buf, tokens, SCALAR_MAX_TOKENS);
+        sum += ntokens;
+        while (tokens[ntokens - 1].value != NULL) {
+            ntokens = scalar_tokenize_command(tokens[ntokens - 1].value,
+                                              tokens, SCALAR_MAX_TOKENS);
+            sum += ntokens;
+        }
+    }
+    bench_report("tokenize_scalar", n, bench_now() - start);
+    bench_sink = sum;
+}
+
+/* tokenize_line(), the copy of the line included */
+static void bench_tokenize(const long n) {
+    char buf[BENCH_LINE_SIZE];
+    token_t tokens[TOKENS_FOR_LINE(BENCH_LINE_SIZE)];
+    size_t sum = 0;
+    double start;
+    long i;
+
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+        size_t length = bench_line(buf, i);
+        sum += tokenize_line(buf, length, tokens);
+    }
+    bench_report("tokenize_" TOKENIZE_IMPL, n, bench_now() - start);
+    bench_sink = sum;
+}
+
+/* tokenize_line() plus the old strcmp() chain */
+static void bench_parse_strcmp(const long n) {
+    char buf[BENCH_LINE_SIZE];
+    token_t tokens[TOKENS_FOR_LINE(BENCH_LINE_SIZE)];
+    size_t ntokens, sum = 0;
+    double start;
+    long i;
+
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+        size_t length = bench_line(buf, i);
+        ntokens = tokenize_line(buf, length, tokens);
+        sum += strcmp_dispatch(tokens, ntokens);
+    }
+    bench_report("parse_strcmp", n, bench_now() - start);
+    bench_sink = sum;
+}
+
+/* tokenize_line() plus the dispatch table lookup process_command() does */
+static void bench_parse_table(const long n) {
+    char buf[BENCH_LINE_SIZE];
+    token_t tokens[TOKENS_FOR_LINE(BENCH_LINE_SIZE)];
+    size_t ntokens, sum = 0;
+    const command_t *cmd;
+    double start;
+    long i;
+
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+        size_t length = bench_line(buf, i);
+        ntokens = tokenize_line(buf, length, tokens);
+        cmd = lookup_command(command_table, COMMAND_TABLE_SIZE(command_table),
+                             &tokens[COMMAND_TOKEN], ntokens);
+        sum += (cmd != NULL);
+    }
+    bench_report("parse_table", n, bench_now() - start);
+    bench_sink = sum;
+}
+
+static int bench_max_threads = 4;
+static bool bench_bdb_open;
+
+/* message sizes: one that fits a record at the default -B, ones that don't */
+static const int bench_sizes[] = { 64, 900, 4000, 65000 };
+#define BENCH_NSIZES (sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+
+typedef struct bench_thread_s {
+    pthread_t thread;
+    void (*run)(struct bench_thread_s *bt);
+    long n;                     /* iterations for this thread */
+    int size;
+    pthread_barrier_t *barrier;
+    double start, end;          /* of the timed part */
+    size_t sink;
+} bench_thread_t;
+
+/* every thread calls this when done preparing, to start timing together */
+static void bench_go(bench_thread_t *bt) {
+    pthread_barrier_wait(bt->barrier);
+    bt->start = bench_now();
+}
+
+static void *bench_thread_main(void *arg) {
+    bench_thread_t *bt = (bench_thread_t *)arg;
+    bt->run(bt);
+    bt->end = bench_now();
+    return NULL;
+}
+
+/*
+ * Runs run in 1, 2, 4 ... -t threads, n iterations each, and reports the
+ * ops of all threads over the time from the first start to the last end.
+ */
+static void bench_parallel(const char *name, void (*run)(bench_thread_t *bt),
+                           const long n, const int size) {
+    bench_thread_t bts[bench_max_threads];
+    pthread_barrier_t barrier;
+    double start, end;
+    char label[64];
+    int nthreads, i;
+
+    for (nthreads = 1; nthreads <= bench_max_threads; nthreads *= 2) {
+        pthread_barrier_init(&barrier, NULL, nthreads);
+        for (i = 0; i < nthreads; i++) {
+            memset(&bts[i], 0, sizeof(bench_thread_t));
+            bts[i].run = run;
+            bts[i].n = n;
+            bts[i].size = size;
+            bts[i].barrier = &barrier;
+            if (pthread_create(&bts[i].thread, NULL, bench_thread_main, &bts[i]) != 0) {
+                perror("pthread_create()");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (i = 0; i < nthreads; i++)
+            pthread_join(bts[i].thread, NULL);
+        pthread_barrier_destroy(&barrier);
+
+        start = bts[0].start;
+        end = bts[0].end;
+        for (i = 0; i < nthreads; i++) {
+            if (bts[i].start < start)
+                start = bts[i].start;
+            if (bts[i].end > end)
+                end = bts[i].end;
+            bench_sink += bts[i].sink;
+        }
+        snprintf(label, sizeof(label), "%s/%d/t%d", name, size, nthreads);
+        bench_report(label, n * nthreads, end - start);
+    }
+}
+
+/* item_alloc1() and item_free() of one message, freelist or malloc() */
+static void bench_item_alloc_run(bench_thread_t *bt) {
+    char key[] = BENCH_QUEUE;
+    item *it;
+    long i;
+
+    bench_go(bt);
+    for (i = 0; i < bt->n; i++) {
+        it = item_alloc1(key, sizeof(key) - 1, 0, bt->size + 2);
+        if (it == NULL) {
+            fprintf(stderr, "item_alloc1() failed\n");
+            exit(EXIT_FAILURE);
+        }
+        item_free(it);
+    }
+}
+
+static void bench_item_alloc(const long n) {
+    int s;
+
+    for (s = 0; s < BENCH_NSIZES; s++)
+        bench_parallel("item_alloc_free", bench_item_alloc_run, n, bench_sizes[s]);
+}
+
+/*
+ * Takes size buffers off the freelist and puts them back, which is all
+ * contention on its lock once there are threads.
+ */
+static void bench_freelist_run(bench_thread_t *bt) {
+    item *its[64];
+    long i;
+    int k;
+
+    bench_go(bt);
+    for (i = 0; i < bt->n; i += bt->size) {
+        for (k = 0; k < bt->size; k++)
+            its[k] = item_from_freelist();
+        for (k = 0; k < bt->size; k++) {
+            if (its[k] == NULL || item_add_to_freelist(its[k]) != 0)
+                free(its[k]);
+        }
+    }
+}
+
+static void bench_freelist(const long n) {
+    bench_parallel("freelist", bench_freelist_run, n, 1);
+    bench_parallel("freelist", bench_freelist_run, n, 16);
+    bench_parallel("freelist", bench_freelist_run, n, 64);
+}
+
+/*
+ * Builds get responses of size messages with add_iov(), as
+ * process_get_command() does, on a conn of its own. The iov list grows
+ * through ensure_iov_space() on the first big response, then is reused.
+ */
+static void bench_iov_run(bench_thread_t *bt) {
+    static const char value[] = "VALUE ";
+    static const char suffix_data[] = " 0 1024\r\n";
+    conn *c;
+    long i;
+    int k;
+
+    c = (conn *)calloc(1, sizeof(conn));
+    if (c == NULL) {
+        fprintf(stderr, "calloc()\n");
+        exit(EXIT_FAILURE);
+    }
+    c->iovsize = IOV_LIST_INITIAL;
+    c->msgsize = MSG_LIST_INITIAL;
+    c->iov = (struct iovec *)malloc(sizeof(struct iovec) * c->iovsize);
+    c->msglist = (struct msghdr *)malloc(sizeof(struct msghdr) * c->msgsize);
+    if (c->iov == NULL || c->msglist == NULL) {
+        fprintf(stderr, "malloc()\n");
+        exit(EXIT_FAILURE);
+    }
+
+    bench_go(bt);
+    for (i = 0; i < bt->n; i++) {
+        c->msgcurr = 0;
+        c->msgused = 0;
+        c->iovused = 0;
+        if (add_msghdr(c) != 0)
+            exit(EXIT_FAILURE);
+        for (k = 0; k < bt->size; k++) {
+            if (add_iov(c, value, 6) != 0 ||
+                add_iov(c, BENCH_QUEUE, sizeof(BENCH_QUEUE) - 1) != 0 ||
+                add_iov(c, suffix_data, sizeof(suffix_data) - 1) != 0)
+                exit(EXIT_FAILURE);
+        }
+        if (add_iov(c, "END\r\n", 5) != 0)
+            exit(EXIT_FAILURE);
+        bt->sink += c->msgused;
+    }
+
+    free(c->iov);
+    free(c->msglist);
+    free(c);
+}
+
+static void bench_iov(const long n) {
+    bench_parallel("add_iov", bench_iov_run, n, 1);
+    bench_parallel("add_iov", bench_iov_run, n / 10, 10);
+    bench_parallel("add_iov", bench_iov_run, n / 100, 100);
+}
+
+/* opens the environment in -H and makes the queue, once */
+static bool bench_bdb(void) {
+    char key[] = BENCH_QUEUE;
+    item *it;
+
+    if (bdb_settings.env_home == NULL) {
+        fprintf(stderr, "bdb_put, bdb_get: skipped, give -H <dir> for a scratch environment\n");
+        return false;
+    }
+    if (!bench_bdb_open) {
+        bdb_env_init();
+        bdb_qlist_db_open();
+        bdb_chunk_db_open();
+        bench_bdb_open = true;
+
+        it = item_alloc1(key, sizeof(key) - 1, 0, 3);
+        memcpy(ITEM_data(it), "0\r\n", 3);
+        bdb_add(key, sizeof(key) - 1, it);      /* fails harmlessly if it exists */
+        item_free(it);
+    }
+    return true;
+}
+
+static item *bench_message(const int size) {
+    char key[] = BENCH_QUEUE;
+    item *it = item_alloc1(key, sizeof(key) - 1, 0, size + 2);
+
+    if (it == NULL) {
+        fprintf(stderr, "item_alloc1() failed\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(ITEM_data(it), 'm', size);
+    memcpy(ITEM_data(it) + size, "\r\n", 2);
+    return it;
+}
+
+/* what complete_nread() does for a set: bdb_put() and item_free() */
+static void bench_bdb_put_run(bench_thread_t *bt) {
+    long i;
+
+    bench_go(bt);
+    for (i = 0; i < bt->n; i++) {
+        item *it = bench_message(bt->size);
+        if (bdb_put(BENCH_QUEUE, sizeof(BENCH_QUEUE) - 1, it) != 0) {
+            fprintf(stderr, "bdb_put() failed\n");
+            exit(EXIT_FAILURE);
+        }
+        item_free(it);
+    }
+}
+
+/* bdb_get() of messages this thread put there first, untimed */
+static void bench_bdb_get_run(bench_thread_t *bt) {
+    long i;
+
+    bench_bdb_put_run(bt);
+    pthread_barrier_wait(bt->barrier);  /* nobody gets before all have put */
+    bt->start = bench_now();
+    for (i = 0; i < bt->n; i++) {
+        item *it = bdb_get(BENCH_QUEUE, sizeof(BENCH_QUEUE) - 1);
+        if (it == NULL) {
+            fprintf(stderr, "bdb_get() found the queue empty\n");
+            exit(EXIT_FAILURE);
+        }
+        bt->sink += it->nbytes;
+        item_free(it);
+    }
+}
+
+static void bench_bdb_put(const long n) {
+    item *it;
+    int s;
+
+    if (!bench_bdb())
+        return;
+    for (s = 0; s < BENCH_NSIZES; s++)
+        bench_parallel("bdb_put", bench_bdb_put_run, n / BENCH_BDB_SCALE, bench_sizes[s]);
+    /* leave the queue as it was */
+    while ((it = bdb_get(BENCH_QUEUE, sizeof(BENCH_QUEUE) - 1)) != NULL)
+        item_free(it);
+}
+
+static void bench_bdb_get(const long n) {
+    int s;
+
+    if (!bench_bdb())
+        return;
+    for (s = 0; s < BENCH_NSIZES; s++)
+        bench_parallel("bdb_get", bench_bdb_get_run, n / BENCH_BDB_SCALE, bench_sizes[s]);
+}
+
+typedef struct {
+    const char *name;
+    void (*run)(const long n);
+} bench_t;
+
+static const bench_t benches[] = {
+    { "tokenize_scalar", bench_tokenize_scalar },
+    { "tokenize",        bench_tokenize },
+    { "parse_strcmp",    bench_parse_strcmp },
+    { "parse_table",     bench_parse_table },
+    { "item_alloc_free", bench_item_alloc },
+    { "freelist",        bench_freelist },
+    { "add_iov",         bench_iov },
+    { "bdb_put",         bench_bdb_put },
+    { "bdb_get",         bench_bdb_get },
+    { NULL, NULL }
+};
+
+int main(int argc, char **argv) {
+    long iterations = BENCH_DEFAULT_ITERATIONS;
+    const bench_t *b;
+    int c, i, ran = 0;
+
+    settings_init();
+    bdb_settings_init();
+    bdb_settings.env_home = NULL;
+
+    while ((c = getopt(argc, argv, "n:t:H:B:Nh")) != -1) {
+        switch (c) {
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        case 't':
+            bench_max_threads = atoi(optarg);
+            break;
+        case 'H':
+            bdb_settings.env_home = optarg;
+            break;
+        case 'B':
+            bdb_settings.re_len = atoi(optarg);
+            break;
+        case 'N':
+            bdb_settings.txn_nosync = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n <iterations>] [-t <threads>] [-H <dir>] [-B <num>] [-N]"
+                    " [benchmark ...]\n", argv[0]);
+            fprintf(stderr, "benchmarks:");
+            for (b = benches; b->name != NULL; b++)
+                fprintf(stderr, " %s", b->name);
+            fprintf(stderr, "\n");
+            return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (iterations < BENCH_BDB_SCALE || bench_max_threads <= 0) {
+        fprintf(stderr, "iterations should be at least %d, threads greater than 0\n", BENCH_BDB_SCALE);
+        return EXIT_FAILURE;
+    }
+
+    item_init();
+    stats_init();
+    thread_init(1, event_init());
+
+    for (i = 0; i < BENCH_NLINES; i++) {
+        bench_lengths[i] = strlen(bench_lines[i]);
+        assert(bench_lengths[i] < BENCH_LINE_SIZE);
+    }
+
+    for (b = benches; b->name != NULL; b++) {
+        if (optind < argc) {
+            for (i = optind; i < argc; i++) {
+                if (strcmp(argv[i], b->name) == 0)
+                    break;
+            }
+            if (i == argc)
+                continue;
+        }
+        b->run(iterations);
+        ran++;
+    }
+
+    if (bench_bdb_open) {
+        bdb_db_close();
+        bdb_env_close();
+    }
+
+    if (ran == 0) {
+        fprintf(stderr, "no such benchmark\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
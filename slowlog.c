@@ -0,0 +1,84 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *  MemcacheQ - Simple Queue Service over Memcache
+ *
+ *      http://memcacheq.googlecode.com
+ *
+ *  Copyright 2008 Steve Chu.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ *  The slow log behind "stats slowlog": the last SLOWLOG_SIZE requests
+ *  that took -W microseconds or more, from the command coming in until
+ *  its response was sent.
+ *
+ *  It is a ring without locks. A writer takes the next ticket with an
+ *  atomic add and owns the slot it maps to; the slot's sequence number is
+ *  odd while the entry is being written, so a reader that sees it change
+ *  or odd skips the slot rather than wait for it.
+ *
+ */
+
+#include "memcacheq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLOWLOG_SIZE 128        /* a power of two */
+
+typedef struct {
+    volatile uint64_t seq;      /* 2 * ticket + 2 once written, odd while writing */
+    slowlog_entry_t entry;
+} slowlog_slot_t;
+
+static slowlog_slot_t slowlog_ring[SLOWLOG_SIZE];
+static volatile uint64_t slowlog_next;      /* the next ticket */
+
+void slowlog_add(const slowlog_entry_t *e) {
+    uint64_t ticket = __sync_fetch_and_add(&slowlog_next, 1);
+    slowlog_slot_t *slot = &slowlog_ring[ticket & (SLOWLOG_SIZE - 1)];
+
+    slot->seq = 2 * ticket + 1;
+    __sync_synchronize();
+    memcpy(&slot->entry, e, sizeof(slowlog_entry_t));
+    __sync_synchronize();
+    slot->seq = 2 * ticket + 2;
+}
+
+/*
+ * "STAT <id> <time> <total_usec> <command> <queue> <bytes>" and the phase
+ * times per entry, newest first, then END. Returns a buffer the caller
+ * frees, or NULL when out of memory.
+ */
+char *slowlog_stats(int *bytes) {
+    slowlog_entry_t e;
+    uint64_t next, ticket, seq;
+    char *buf, *pos;
+
+    buf = pos = (char *)malloc(SLOWLOG_SIZE * (SLOWLOG_QUEUE_MAX + 200) + 8);
+    if (buf == NULL)
+        return NULL;
+
+    next = slowlog_next;
+    for (ticket = next; ticket > 0 && next - ticket < SLOWLOG_SIZE; ticket--) {
+        slowlog_slot_t *slot = &slowlog_ring[(ticket - 1) & (SLOWLOG_SIZE - 1)];
+
+        seq = slot->seq;
+        __sync_synchronize();
+        memcpy(&e, &slot->entry, sizeof(slowlog_entry_t));
+        __sync_synchronize();
+        if (seq != 2 * (ticket - 1) + 2 || slot->seq != seq)
+            continue;   /* being written, or already written over */
+
+        pos += sprintf(pos, "STAT %llu %lu %u %s %s %u txn_begin=%u qlist=%u data=%u commit=%u transmit=%u\r\n",
+                       (unsigned long long)ticket, (unsigned long)e.when, e.total_usec,
+                       e.command, e.queue[0] != '\0' ? e.queue : "-", e.nbytes,
+                       e.usec[SLOWLOG_TXN_BEGIN], e.usec[SLOWLOG_QLIST], e.usec[SLOWLOG_DATA],
+                       e.usec[SLOWLOG_COMMIT], e.usec[SLOWLOG_TRANSMIT]);
+    }
+    pos += sprintf(pos, "END\r\n");
+
+    *bytes = pos - buf;
+    return buf;
+}
@@ -0,0 +1,51 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+
+use FindBin;
+use IO::Socket::INET;
+use Test::More 'no_plan';
+
+system("rm -rf $FindBin::Bin/../mydata");
+system("$FindBin::Bin/../memcacheq -d -p 22204 -B 512 -r -c 1024 -m 64 -A 4096 -H $FindBin::Bin/../mydata -N -v > ./testenv.log 2>&1");
+sleep 1;
+
+my $sock = IO::Socket::INET->new(PeerAddr => "localhost:22204", Proto => "tcp")
+    or die "can not connect: $!";
+
+my $q = "test" . time;
+
+sub get {
+    my $cmd = shift;
+    print $sock "$cmd\r\n";
+    my $line = <$sock>;
+    return undef if $line eq "END\r\n";
+    my ($len) = $line =~ /^VALUE \Q$q\E 0 (\d+)\r\n$/ or die "bad line: $line";
+    read($sock, my $data, $len + 2);
+    <$sock>;    # END
+    return substr($data, 0, $len);
+}
+
+print $sock "add $q 0 0 1\r\n0\r\n";
+is(scalar <$sock>, "STORED\r\n");
+
+# one record, a head and a chunk, many chunks
+my @msgs = ("small", "x" x 600, join("", map { chr(65 + $_ % 26) x 100 } 0 .. 999));
+for my $msg (@msgs) {
+    print $sock "set $q 0 0 " . length($msg) . "\r\n$msg\r\n";
+    is(scalar <$sock>, "STORED\r\n", "set of " . length($msg) . " bytes");
+}
+
+is(get("peek $q"), "small", "peek sees the head of the queue");
+for my $msg (@msgs) {
+    is(get("get $q"), $msg, "get of " . length($msg) . " bytes comes back whole");
+}
+is(get("get $q"), undef, "no chunk left behind as a message");
+
+my $huge = "z" x (1024 * 1024 + 1);
+print $sock "set $q 0 0 " . length($huge) . "\r\n$huge\r\n";
+is(scalar <$sock>, "SERVER_ERROR out of memory storing object\r\n", "over 1MB is refused");
+
+close $sock;
+system("pkill memcacheq");
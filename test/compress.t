@@ -0,0 +1,52 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+
+use FindBin;
+use IO::Socket::INET;
+use Test::More 'no_plan';
+
+system("rm -rf $FindBin::Bin/../mydata");
+system("$FindBin::Bin/../memcacheq -d -p 22209 -B 4064 -r -c 1024 -m 64 -A 4096 -H $FindBin::Bin/../mydata -N -v > ./testenv.log 2>&1");
+sleep 1;
+
+my $sock = IO::Socket::INET->new(PeerAddr => "localhost:22209", Proto => "tcp")
+    or die "can not connect: $!";
+
+my $q = "test" . time;
+my $msg = join(" ", map { "message $_" } 1 .. 300);     # compresses well
+
+sub one_value {
+    my $line = <$sock>;
+    return undef if $line eq "END\r\n";
+    my ($len, $receipt) = $line =~ /^VALUE \Q$q\E 7 (\d+)(?: (\d+))?\r\n$/ or die "bad line: $line";
+    my $data;
+    read($sock, $data, $len + 2);
+    <$sock>;    # END
+    $data =~ s/\r\n$//;
+    return $data;
+}
+
+print $sock "add $q 0 0 10\r\n0 compress\r\n";
+is(scalar <$sock>, "STORED\r\n");
+for (1 .. 3) {
+    print $sock "set $q 7 0 " . length($msg) . "\r\n$msg\r\n";
+    is(scalar <$sock>, "STORED\r\n");
+}
+
+print $sock "stats compress\r\n";
+my ($raw, $stored) = <$sock> =~ /^STAT \Q$q\E (\d+) (\d+) / or die "no compress stats";
+<$sock>;    # END
+is($raw, 3 * (length($msg) + 2), "all three were compressed");
+ok($stored < $raw / 2, "and came out smaller");
+
+print $sock "peek $q\r\n";
+is(one_value(), $msg, "peek gives the message back as it was set");
+print $sock "get $q\r\n";
+is(one_value(), $msg, "so does get");
+print $sock "lget $q 60000\r\n";
+is(one_value(), $msg, "and lget");
+
+close $sock;
+system("pkill memcacheq");
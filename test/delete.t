@@ -0,0 +1,64 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+
+use FindBin;
+use IO::Socket::INET;
+use Test::More 'no_plan';
+
+system("rm -rf $FindBin::Bin/../mydata");
+system("$FindBin::Bin/../memcacheq -d -p 22205 -B 4064 -r -c 1024 -m 64 -A 4096 -H $FindBin::Bin/../mydata -N -v > ./testenv.log 2>&1");
+sleep 1;
+
+my $sock = IO::Socket::INET->new(PeerAddr => "localhost:22205", Proto => "tcp")
+    or die "can not connect: $!";
+
+my $q = "test" . time;
+
+sub fill {
+    print $sock "add $q 0 0 1\r\n0\r\n";
+    is(scalar <$sock>, "STORED\r\n");
+    for my $i (1 .. 200) {
+        print $sock "set $q 0 0 " . length($i) . "\r\n$i\r\n";
+        <$sock>;
+    }
+}
+
+fill();
+
+# another connection keeps reading the queue while it is deleted under it
+my $pid = fork();
+die "can not fork: $!" unless defined $pid;
+if ($pid == 0) {
+    my $reader = IO::Socket::INET->new(PeerAddr => "localhost:22205", Proto => "tcp")
+        or exit 1;
+    for my $i (1 .. 300) {
+        print $reader ($i % 2 ? "peek $q 5\r\n" : "get $q\r\n");
+        while (1) {
+            my $line = <$reader>;
+            exit 2 unless defined $line;
+            last if $line eq "END\r\n";
+            exit 3 unless $line =~ /^VALUE \Q$q\E 0 \d+\r\n$/;
+            <$reader>;
+        }
+    }
+    exit 0;
+}
+
+for my $round (1 .. 3) {
+    select(undef, undef, undef, 0.05);
+    print $sock "delete $q\r\n";
+    is(scalar <$sock>, "DELETED\r\n", "delete while the queue is being read");
+    fill() if $round < 3;
+}
+waitpid($pid, 0);
+is($? >> 8, 0, "the reader only ever saw whole responses");
+
+print $sock "get $q\r\n";
+is(scalar <$sock>, "END\r\n", "deleted queue is gone");
+print $sock "delete $q\r\n";
+is(scalar <$sock>, "NOT_FOUND\r\n");
+
+close $sock;
+system("pkill memcacheq");
@@ -0,0 +1,58 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+
+use FindBin;
+use IO::Socket::INET;
+use Test::More 'no_plan';
+
+system("rm -rf $FindBin::Bin/../mydata");
+system("$FindBin::Bin/../memcacheq -d -p 22203 -B 4064 -r -c 1024 -m 64 -A 4096 -H $FindBin::Bin/../mydata -N -v > ./testenv.log 2>&1");
+sleep 1;
+
+my $sock = IO::Socket::INET->new(PeerAddr => "localhost:22203", Proto => "tcp")
+    or die "can not connect: $!";
+
+my $q = "test" . time;
+
+sub lget {
+    my $ms = shift;
+    print $sock "lget $q $ms\r\n";
+    my $line = <$sock>;
+    return undef if $line eq "END\r\n";
+    my ($receipt) = $line =~ /^VALUE \Q$q\E 0 \d+ (\d+)\r\n$/ or die "bad line: $line";
+    my $data = <$sock>;
+    <$sock>;    # END
+    $data =~ s/\r\n$//;
+    return ($data, $receipt);
+}
+
+print $sock "add $q 0 0 1\r\n0\r\n";
+is(scalar <$sock>, "STORED\r\n");
+for my $msg ("first", "second") {
+    print $sock "set $q 0 0 " . length($msg) . "\r\n$msg\r\n";
+    is(scalar <$sock>, "STORED\r\n");
+}
+
+my ($data, $receipt) = lget(60000);
+is($data, "first", "lget returns the head of the queue");
+print $sock "ack $receipt\r\n";
+is(scalar <$sock>, "DELETED\r\n", "ack ends the lease");
+print $sock "ack $receipt\r\n";
+is(scalar <$sock>, "NOT_FOUND\r\n", "a receipt is good for one ack");
+
+($data, $receipt) = lget(200);
+is($data, "second");
+is(lget(200), undef, "leased message is off the queue");
+sleep 1;
+($data) = lget(60000);
+is($data, "second", "unacked message is redelivered");
+print $sock "ack $receipt\r\n";
+is(scalar <$sock>, "NOT_FOUND\r\n", "expired lease can't be acked");
+
+print $sock "lget $q 0\r\n";
+is(scalar <$sock>, "CLIENT_ERROR bad command line format\r\n");
+
+close $sock;
+system("pkill memcacheq");
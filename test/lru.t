@@ -0,0 +1,80 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+
+use FindBin;
+use IO::Socket::INET;
+use Test::More 'no_plan';
+
+# with -Q 1 only one queue stays open: each switch closes one and reopens another
+system("rm -rf $FindBin::Bin/../mydata");
+system("$FindBin::Bin/../memcacheq -d -p 22210 -B 4064 -r -c 1024 -m 64 -A 4096 -Q 1 -H $FindBin::Bin/../mydata -N -v > ./testenv.log 2>&1");
+sleep 1;
+
+my $sock = IO::Socket::INET->new(PeerAddr => "localhost:22210", Proto => "tcp")
+    or die "can not connect: $!";
+
+my $t = time;
+my @queues = map { "lru${_}_$t" } 1 .. 4;
+
+sub bdb_stat {
+    my $name = shift;
+    print $sock "stats bdb\r\n";
+    my $value;
+    while (my $line = <$sock>) {
+        last if $line =~ /^END/;
+        $value = $1 if $line =~ /^STAT $name (\d+)/;
+    }
+    return $value;
+}
+
+sub values_of {
+    my $q = shift;
+    my @values;
+    while (1) {
+        my $line = <$sock>;
+        last if $line eq "END\r\n";
+        $line =~ /^VALUE \Q$q\E 0 \d+\r\n$/ or die "bad line: $line";
+        my $data = <$sock>;
+        $data =~ s/\r\n$//;
+        push @values, $data;
+    }
+    return @values;
+}
+
+for my $q (@queues) {
+    print $sock "add $q 0 0 1\r\n0\r\n";
+    is(scalar <$sock>, "STORED\r\n");
+}
+my $evictions = bdb_stat("queue_handle_evictions");
+
+# round robin over the queues, so every command finds its queue closed
+for my $i (1 .. 3) {
+    for my $q (@queues) {
+        print $sock "set $q 0 0 " . length("$q-$i") . "\r\n$q-$i\r\n";
+        is(scalar <$sock>, "STORED\r\n");
+    }
+}
+is(bdb_stat("open_queues"), 1, "no more than -Q queues are open");
+ok(bdb_stat("queue_handle_evictions") >= $evictions + 11, "switching queues closes the cold ones");
+
+for my $q (@queues) {
+    print $sock "peek $q 3\r\n";
+    is_deeply([values_of($q)], ["$q-1", "$q-2", "$q-3"], "$q kept its messages across reopens");
+}
+for my $q (@queues) {
+    print $sock "get $q\r\n";
+    is_deeply([values_of($q)], ["$q-1"], "get after a reopen");
+}
+
+print $sock "purge $queues[0]\r\n";
+is(scalar <$sock>, "PURGED\r\n");
+for my $q (@queues) {
+    print $sock "peek $q 5\r\n";
+    is_deeply([values_of($q)], $q eq $queues[0] ? [] : ["$q-2", "$q-3"], "$q after a purge of $queues[0]");
+}
+is(bdb_stat("open_queues"), 1, "still only one open");
+
+close $sock;
+system("pkill memcacheq");
@@ -0,0 +1,72 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+
+use FindBin;
+use IO::Socket::INET;
+use Test::More 'no_plan';
+
+system("rm -rf $FindBin::Bin/../mydata");
+system("$FindBin::Bin/../memcacheq -d -p 22206 -B 4064 -r -c 1024 -m 64 -A 4096 -H $FindBin::Bin/../mydata -N -v > ./testenv.log 2>&1");
+sleep 1;
+
+my $sock = IO::Socket::INET->new(PeerAddr => "localhost:22206", Proto => "tcp")
+    or die "can not connect: $!";
+
+my $t = time;
+my ($src, $dst, $zq) = ("src$t", "dst$t", "zq$t");
+
+sub values_of {
+    my @values;
+    while (1) {
+        my $line = <$sock>;
+        last if $line eq "END\r\n";
+        my ($key, $len) = $line =~ /^VALUE (\S+) \d+ (\d+)\r\n$/ or die "bad line: $line";
+        my $data = <$sock>;
+        $data =~ s/\r\n$//;
+        push @values, "$key $data";
+    }
+    return @values;
+}
+
+for my $q ([$src, "0"], [$dst, "0"], [$zq, "0 compress"]) {
+    print $sock "add $q->[0] 0 0 " . length($q->[1]) . "\r\n$q->[1]\r\n";
+    is(scalar <$sock>, "STORED\r\n");
+}
+my @msgs = ("one", "two", "three", "a" x 3000, join(",", 1 .. 800));
+for my $msg (@msgs) {
+    print $sock "set $src 0 0 " . length($msg) . "\r\n$msg\r\n";
+    is(scalar <$sock>, "STORED\r\n");
+}
+
+print $sock "move $src $dst\r\n";
+is(scalar <$sock>, "MOVED 1\r\n", "one message by default");
+print $sock "move $src $dst 2 get\r\n";
+is_deeply([values_of()], ["$dst two", "$dst three"], "get returns the moved messages under dst");
+
+# through the compressed queue and back, the messages come out the same
+print $sock "move $src $zq 10\r\n";
+is(scalar <$sock>, "MOVED 2\r\n", "stops when src runs empty");
+print $sock "peek $zq 2\r\n";
+is_deeply([values_of()], ["$zq $msgs[3]", "$zq $msgs[4]"], "moved into a compressed queue");
+print $sock "move $zq $dst 5 get\r\n";
+is_deeply([values_of()], ["$dst $msgs[3]", "$dst $msgs[4]"], "moved out of a compressed queue");
+for my $msg (@msgs) {
+    print $sock "get $dst\r\n";
+    is_deeply([values_of()], ["$dst $msg"], "dst has them in order");
+}
+
+print $sock "move $src $dst\r\n";
+is(scalar <$sock>, "MOVED 0\r\n", "nothing to move");
+print $sock "move nosuch$t $dst\r\n";
+is(scalar <$sock>, "NOT_FOUND\r\n", "missing source queue");
+print $sock "move $src nosuch$t\r\n";
+is(scalar <$sock>, "NOT_FOUND\r\n", "missing destination queue");
+print $sock "move $src $src 5\r\n";
+is(scalar <$sock>, "CLIENT_ERROR bad command line format\r\n", "a queue can't be moved onto itself");
+print $sock "move $src $dst 0\r\n";
+is(scalar <$sock>, "CLIENT_ERROR bad command line format\r\n");
+
+close $sock;
+system("pkill memcacheq");
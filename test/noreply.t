@@ -0,0 +1,54 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+
+use FindBin;
+use IO::Socket::INET;
+use Test::More 'no_plan';
+
+system("rm -rf $FindBin::Bin/../mydata");
+system("$FindBin::Bin/../memcacheq -d -p 22202 -B 4064 -r -c 1024 -m 64 -A 4096 -H $FindBin::Bin/../mydata -N -v > ./testenv.log 2>&1");
+sleep 1;
+
+my $sock = IO::Socket::INET->new(PeerAddr => "localhost:22202", Proto => "tcp")
+    or die "can not connect: $!";
+
+my $q = "test" . time;
+
+sub stat_value {
+    my $name = shift;
+    print $sock "stats\r\n";
+    my $value;
+    while (my $line = <$sock>) {
+        last if $line =~ /^END/;
+        $value = $1 if $line =~ /^STAT $name (\d+)/;
+    }
+    return $value;
+}
+
+# pipelined, with all the replies suppressed
+print $sock "add $q 0 0 1 noreply\r\n0\r\n";
+print $sock "set $q 0 0 3 noreply\r\n$_\r\n" for 100..109;
+print $sock "get $q\r\n";
+is(scalar <$sock>, "VALUE $q 0 3\r\n", "noreply set stored the message");
+is(scalar <$sock>, "100\r\n");
+is(scalar <$sock>, "END\r\n");
+
+my $fails = stat_value("noreply_fails");
+print $sock "set no_such_queue_$q 0 0 1 noreply\r\nx\r\n";
+print $sock "delete no_such_queue_$q noreply\r\n";
+is(stat_value("noreply_fails"), $fails + 2, "suppressed failures are counted");
+print $sock "delete " . ("k" x 300) . " noreply\r\n";
+is(stat_value("noreply_fails"), $fails + 3, "so are suppressed client errors");
+
+print $sock "set $q 0 0 1 badopt\r\nx\r\n";
+is(scalar <$sock>, "CLIENT_ERROR bad command line format\r\n", "unknown option is rejected");
+is(scalar <$sock>, "ERROR\r\n", "data line is taken as a command");
+
+print $sock "delete $q noreply\r\n";
+print $sock "version\r\n";
+like(scalar <$sock>, qr/^VERSION /, "noreply delete sends nothing");
+
+close $sock;
+system("pkill memcacheq");
@@ -0,0 +1,60 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+
+use FindBin;
+use IO::Socket::INET;
+use Test::More 'no_plan';
+
+system("rm -rf $FindBin::Bin/../mydata");
+system("$FindBin::Bin/../memcacheq -d -p 22208 -B 4064 -r -c 1024 -m 64 -A 4096 -H $FindBin::Bin/../mydata -N -v > ./testenv.log 2>&1");
+sleep 1;
+
+my $sock = IO::Socket::INET->new(PeerAddr => "localhost:22208", Proto => "tcp")
+    or die "can not connect: $!";
+
+my $q = "test" . time;
+
+sub values_of {
+    my @values;
+    while (1) {
+        my $line = <$sock>;
+        last if $line eq "END\r\n";
+        $line =~ /^VALUE \Q$q\E 0 \d+\r\n$/ or die "bad line: $line";
+        my $data = <$sock>;
+        $data =~ s/\r\n$//;
+        push @values, $data;
+    }
+    return @values;
+}
+
+print $sock "add $q 0 0 1\r\n0\r\n";
+is(scalar <$sock>, "STORED\r\n");
+print $sock "peek $q\r\n";
+is_deeply([values_of()], [], "empty queue");
+print $sock "peek nosuch$q\r\n";
+is_deeply([values_of()], [], "missing queue");
+
+for my $i (1 .. 120) {
+    print $sock "set $q 0 0 " . length($i) . "\r\n$i\r\n";
+    <$sock>;
+}
+
+print $sock "peek $q\r\n";
+is_deeply([values_of()], [1], "one message by default");
+print $sock "peek $q 3\r\n";
+is_deeply([values_of()], [1, 2, 3], "peek doesn't consume");
+print $sock "get $q\r\n";
+is_deeply([values_of()], [1], "get returns what peek saw");
+
+print $sock "peek $q 1000\r\n";
+my @values = values_of();
+is(scalar @values, 100, "at most 100 messages");
+is_deeply(\@values, [2 .. 101]);
+
+print $sock "peek $q 0\r\n";
+is(scalar <$sock>, "CLIENT_ERROR bad command line format\r\n");
+
+close $sock;
+system("pkill memcacheq");
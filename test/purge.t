@@ -0,0 +1,44 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+
+use FindBin;
+use IO::Socket::INET;
+use Test::More 'no_plan';
+
+system("rm -rf $FindBin::Bin/../mydata");
+system("$FindBin::Bin/../memcacheq -d -p 22207 -B 4064 -r -c 1024 -m 64 -A 4096 -H $FindBin::Bin/../mydata -N -v > ./testenv.log 2>&1");
+sleep 1;
+
+my $sock = IO::Socket::INET->new(PeerAddr => "localhost:22207", Proto => "tcp")
+    or die "can not connect: $!";
+
+my $q = "test" . time;
+
+print $sock "add $q 0 0 1\r\n0\r\n";
+is(scalar <$sock>, "STORED\r\n");
+for my $msg ("first", "second", "x" x 3000) {
+    print $sock "set $q 0 0 " . length($msg) . "\r\n$msg\r\n";
+    is(scalar <$sock>, "STORED\r\n");
+}
+
+print $sock "purge $q\r\n";
+is(scalar <$sock>, "PURGED\r\n");
+print $sock "get $q\r\n";
+is(scalar <$sock>, "END\r\n", "nothing left after a purge");
+print $sock "peek $q\r\n";
+is(scalar <$sock>, "END\r\n");
+
+print $sock "set $q 0 0 5\r\nafter\r\n";
+is(scalar <$sock>, "STORED\r\n", "the queue is still there");
+print $sock "get $q\r\n";
+is(scalar <$sock>, "VALUE $q 0 5\r\n", "a set after purge is readable");
+is(scalar <$sock>, "after\r\n");
+is(scalar <$sock>, "END\r\n");
+
+print $sock "purge nosuch$q\r\n";
+is(scalar <$sock>, "NOT_FOUND\r\n", "unknown queue");
+
+close $sock;
+system("pkill memcacheq");
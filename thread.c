@@ -92,6 +92,10 @@ typedef struct {
 
 static LIBEVENT_THREAD *threads;
 
+/* holds each worker's index in threads, plus one, see mt_thread_index() */
+static pthread_key_t thread_index_key;
+static bool thread_index_ready = false;
+
 /*
  * Number of threads that have finished setting themselves up.
  */
@@ -327,6 +331,7 @@ static void *worker_libevent(void *arg) {
     /* Any per-thread setup can happen here; thread_init() will block until
      * all threads have finished initializing.
      */
+    pthread_setspecific(thread_index_key, (void *)(intptr_t)(me - threads + 1));
 
     pthread_mutex_lock(&init_lock);
     init_count++;
@@ -366,6 +371,8 @@ static void thread_libevent_process(int fd, short which, void *arg) {
                 }
                 close(item->sfd);
             }
+        } else {
+            c->thread = me - threads;
         }
         cqi_free(item);
     }
@@ -405,6 +412,16 @@ int mt_is_listen_thread() {
     return pthread_self() == threads[0].thread_id;
 }
 
+/*
+ * Index of the calling worker thread, the main one being 0, or -1 for
+ * any other thread. For per-thread counters that need no lock.
+ */
+int mt_thread_index() {
+    if (!thread_index_ready)
+        return -1;
+    return (int)(intptr_t)pthread_getspecific(thread_index_key) - 1;
+}
+
 /******************************* GLOBAL STATS ******************************/
 
 void mt_stats_lock() {
@@ -416,11 +433,11 @@ void mt_stats_unlock() {
 }
 
 void  mt_update_queue_length_lock() {
-    pthread_mutex_unlock(&queue_len_lock);
+    pthread_mutex_lock(&queue_len_lock);
 }
 
 void  mt_update_queue_length_unlock() {
-    pthread_mutex_lock(&queue_len_lock);
+    pthread_mutex_unlock(&queue_len_lock);
 }
 
 
@@ -455,6 +472,10 @@ void thread_init(int nthreads, struct event_base *main_base) {
     threads[0].base = main_base;
     threads[0].thread_id = pthread_self();
 
+    pthread_key_create(&thread_index_key, NULL);
+    pthread_setspecific(thread_index_key, (void *)(intptr_t)1);
+    thread_index_ready = true;
+
     for (i = 0; i < nthreads; i++) {
         int fds[2];
         if (pipe(fds)) {